@@ -133,6 +133,16 @@ int kvm_irqchip_remove_irqfd_notifier_gsi(KVMState *s, EventNotifier *n,
     return -ENOSYS;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+uint32_t kvm_dirty_ring_size(void)
+{
+    return 0;
+}
+
 bool kvm_has_free_slot(MachineState *ms)
 {
     return false;
@@ -396,6 +396,7 @@ BlockDriverState *bdrv_new(void)
     }
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->block_status_cache.lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -2180,9 +2181,11 @@ static void bdrv_drv_set_perm_commit(void *opaque)
     BlockDriverState *bs = opaque;
     uint64_t cumulative_perms, cumulative_shared_perms;
 
+    bdrv_get_cumulative_perm(bs, &cumulative_perms,
+                             &cumulative_shared_perms);
+    bdrv_block_status_cache_update(bs, cumulative_shared_perms);
+
     if (bs->drv->bdrv_set_perm) {
-        bdrv_get_cumulative_perm(bs, &cumulative_perms,
-                                 &cumulative_shared_perms);
         bs->drv->bdrv_set_perm(bs, cumulative_perms, cumulative_shared_perms);
     }
 }
@@ -2676,10 +2679,21 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
             child->klass->detach(child);
         }
         QLIST_REMOVE(child, next_parent);
+
+        /*
+         * The remaining parents may share write permissions; the cache is
+         * enabled again when the permissions of @old_bs are refreshed
+         */
+        bdrv_block_status_cache_update(old_bs, BLK_PERM_ALL);
     }
 
     child->bs = new_bs;
 
+    /* The parent's cached block status may refer to the old child */
+    if (child->klass == &child_of_bds) {
+        bdrv_block_status_cache_clear(child->opaque);
+    }
+
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
 
@@ -4612,6 +4626,7 @@ static void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     if (drv->bdrv_reopen_commit) {
         drv->bdrv_reopen_commit(reopen_state);
     }
+    bdrv_block_status_cache_clear(bs);
 
     /* set BDS specific flags now */
     qobject_unref(bs->explicit_options);
@@ -4673,6 +4688,7 @@ static void bdrv_close(BlockDriverState *bs)
         }
         bs->drv = NULL;
     }
+    bdrv_block_status_cache_clear(bs);
 
     QLIST_FOREACH_SAFE(child, &bs->children, next, next) {
         bdrv_unref_child(bs, child);
@@ -5050,6 +5066,8 @@ out:
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
 
@@ -5061,6 +5079,10 @@ static void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    qemu_mutex_destroy(&bs->block_status_cache.lock);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_log_cleanup(&bs->latency_log_histogram[i]);
+    }
     g_free(bs);
 }
 
@@ -5099,6 +5121,8 @@ BlockDriverState *bdrv_insert_node(BlockDriverState *bs, QDict *node_options,
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -5107,7 +5131,11 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        bdrv_block_status_cache_clear(bs);
+    }
+    return ret;
 }
 
 /*
@@ -5548,6 +5576,27 @@ bool bdrv_supports_compressed_writes(BlockDriverState *bs)
     return true;
 }
 
+/**
+ * Return whether requests for the given node and all of its children may be
+ * submitted from several threads at once.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        return false;
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 const char *bdrv_get_format_name(BlockDriverState *bs)
 {
     return bs->drv ? bs->drv->format_name : NULL;
@@ -6207,6 +6256,7 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
      * of the image is tried.
      */
     if (bs->open_flags & BDRV_O_INACTIVE) {
+        bdrv_block_status_cache_clear(bs);
         bs->open_flags &= ~BDRV_O_INACTIVE;
         ret = bdrv_refresh_perms(bs, errp);
         if (ret < 0) {
@@ -6319,6 +6369,7 @@ static int bdrv_inactivate_recurse(BlockDriverState *bs)
     }
 
     bs->open_flags |= BDRV_O_INACTIVE;
+    bdrv_block_status_cache_clear(bs);
 
     /*
      * Update permissions, they may differ for inactive nodes.
@@ -6712,6 +6763,13 @@ AioContext *bdrv_get_aio_context(BlockDriverState *bs)
     return bs ? bs->aio_context : qemu_get_aio_context();
 }
 
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    return ctx ?: bdrv_get_aio_context(bs);
+}
+
 AioContext *coroutine_fn bdrv_co_enter(BlockDriverState *bs)
 {
     Coroutine *self = qemu_coroutine_self();
@@ -7052,6 +7110,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        bool force,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -7061,8 +7121,10 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb,
-                                       cb_opaque, force, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb,
+                                      cb_opaque, force, errp);
+    bdrv_block_status_cache_clear(bs);
+    return ret;
 }
 
 /*
@@ -7492,6 +7554,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_block_status_cache_clear(c->bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -50,9 +51,14 @@ void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_log_cleanup(&stats->latency_log_histogram[i]);
+    }
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -182,6 +188,110 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+/* Shard of the log-linear histograms that the current thread counts in */
+static __thread int block_latency_log_shard = -1;
+static int block_latency_log_next_shard;
+
+static int block_latency_log_bucket(uint64_t latency_ns)
+{
+    int bits;
+
+    if (latency_ns < BLOCK_LOG_HIST_SUB_BUCKETS) {
+        return latency_ns;
+    }
+
+    bits = 63 - clz64(latency_ns);
+    if (bits >= BLOCK_LOG_HIST_MAX_BITS) {
+        return BLOCK_LOG_HIST_BUCKETS - 1;
+    }
+
+    /* The most significant bit selects the power of two, the next ones the
+     * bucket in it */
+    return (bits - BLOCK_LOG_HIST_SUB_BITS + 1) * BLOCK_LOG_HIST_SUB_BUCKETS +
+           ((latency_ns >> (bits - BLOCK_LOG_HIST_SUB_BITS)) &
+            (BLOCK_LOG_HIST_SUB_BUCKETS - 1));
+}
+
+/* Lowest latency counted in @bucket, which may also be BLOCK_LOG_HIST_BUCKETS
+ * for the end of the last regular bucket */
+uint64_t block_latency_log_bucket_start(int bucket)
+{
+    int bits;
+
+    assert(bucket >= 0 && bucket <= BLOCK_LOG_HIST_BUCKETS);
+    if (bucket < BLOCK_LOG_HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    bits = bucket / BLOCK_LOG_HIST_SUB_BUCKETS + BLOCK_LOG_HIST_SUB_BITS - 1;
+    return (uint64_t)(BLOCK_LOG_HIST_SUB_BUCKETS +
+                      bucket % BLOCK_LOG_HIST_SUB_BUCKETS)
+           << (bits - BLOCK_LOG_HIST_SUB_BITS);
+}
+
+/* May be called from any thread, without any lock */
+void block_latency_log_account(BlockLatencyLogHistogram *hist,
+                               int64_t latency_ns)
+{
+    Stat64 *bins;
+
+    if (block_latency_log_shard < 0) {
+        block_latency_log_shard =
+            qatomic_fetch_inc(&block_latency_log_next_shard) %
+            BLOCK_LOG_HIST_SHARDS;
+    }
+
+    bins = qatomic_rcu_read(&hist->shards[block_latency_log_shard]);
+    if (!bins) {
+        Stat64 *new_bins = g_new0(Stat64, BLOCK_LOG_HIST_BUCKETS);
+
+        bins = qatomic_cmpxchg(&hist->shards[block_latency_log_shard], NULL,
+                               new_bins);
+        if (bins) {
+            /* Another thread of this shard was faster */
+            g_free(new_bins);
+        } else {
+            bins = new_bins;
+        }
+    }
+
+    stat64_add(&bins[block_latency_log_bucket(MAX(latency_ns, 0))], 1);
+}
+
+/*
+ * Sum up the shards of @hist into @bins, an array of BLOCK_LOG_HIST_BUCKETS
+ * elements.  Returns false if nothing was ever counted in @hist.
+ */
+bool block_latency_log_read(BlockLatencyLogHistogram *hist, uint64_t *bins)
+{
+    bool found = false;
+    int i, j;
+
+    memset(bins, 0, BLOCK_LOG_HIST_BUCKETS * sizeof(bins[0]));
+    for (i = 0; i < BLOCK_LOG_HIST_SHARDS; i++) {
+        Stat64 *shard = qatomic_rcu_read(&hist->shards[i]);
+
+        if (!shard) {
+            continue;
+        }
+        found = true;
+        for (j = 0; j < BLOCK_LOG_HIST_BUCKETS; j++) {
+            bins[j] += stat64_get(&shard[j]);
+        }
+    }
+    return found;
+}
+
+void block_latency_log_cleanup(BlockLatencyLogHistogram *hist)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_LOG_HIST_SHARDS; i++) {
+        g_free(hist->shards[i]);
+        hist->shards[i] = NULL;
+    }
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -199,6 +309,9 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         return;
     }
 
+    block_latency_log_account(&stats->latency_log_histogram[cookie->type],
+                              latency_ns);
+
     WITH_QEMU_LOCK_GUARD(&stats->lock) {
         if (failed) {
             stats->failed_ops[cookie->type]++;
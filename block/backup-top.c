@@ -34,9 +34,21 @@
 
 #include "block/backup-top.h"
 
-typedef struct BDRVBackupTopState {
+/*
+ * Several backups of the same source share one filter: each has its own
+ * target child and block-copy state, and the states form a group so that
+ * the old data is read once and written to all targets.
+ */
+typedef struct BackupTopTarget {
     BlockCopyState *bcs;
     BdrvChild *target;
+    QLIST_ENTRY(BackupTopTarget) next;
+} BackupTopTarget;
+
+typedef struct BDRVBackupTopState {
+    QLIST_HEAD(, BackupTopTarget) targets;
+    BlockCopyGroup *group;
+    unsigned next_target_index;
     int64_t cluster_size;
 } BDRVBackupTopState;
 
@@ -51,7 +63,9 @@ static coroutine_fn int backup_top_cbw(BlockDriverState *bs, uint64_t offset,
                                        uint64_t bytes, BdrvRequestFlags flags)
 {
     BDRVBackupTopState *s = bs->opaque;
+    BackupTopTarget *t;
     uint64_t off, end;
+    int ret;
 
     if (flags & BDRV_REQ_WRITE_UNCHANGED) {
         return 0;
@@ -60,7 +74,18 @@ static coroutine_fn int backup_top_cbw(BlockDriverState *bs, uint64_t offset,
     off = QEMU_ALIGN_DOWN(offset, s->cluster_size);
     end = QEMU_ALIGN_UP(offset + bytes, s->cluster_size);
 
-    return block_copy(s->bcs, off, end - off, true);
+    /*
+     * The first copy also writes the data to the other targets, the next
+     * ones only have to wait for it or to retry what failed.
+     */
+    QLIST_FOREACH(t, &s->targets, next) {
+        ret = block_copy(t->bcs, off, end - off, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
 }
 
 static int coroutine_fn backup_top_co_pdiscard(BlockDriverState *bs,
@@ -107,6 +132,13 @@ static int coroutine_fn backup_top_co_flush(BlockDriverState *bs)
     return bdrv_co_flush(bs->backing->bs);
 }
 
+static void backup_top_close(BlockDriverState *bs)
+{
+    BDRVBackupTopState *s = bs->opaque;
+
+    block_copy_group_free(s->group);
+}
+
 static void backup_top_refresh_filename(BlockDriverState *bs)
 {
     if (bs->backing == NULL) {
@@ -158,6 +190,7 @@ BlockDriver bdrv_backup_top_filter = {
     .bdrv_co_pwrite_zeroes      = backup_top_co_pwrite_zeroes,
     .bdrv_co_pdiscard           = backup_top_co_pdiscard,
     .bdrv_co_flush              = backup_top_co_flush,
+    .bdrv_close                 = backup_top_close,
 
     .bdrv_refresh_filename      = backup_top_refresh_filename,
 
@@ -166,6 +199,102 @@ BlockDriver bdrv_backup_top_filter = {
     .is_filter = true,
 };
 
+static BdrvChild *backup_top_attach_target(BlockDriverState *top,
+                                           BlockDriverState *target,
+                                           Error **errp)
+{
+    BDRVBackupTopState *s = top->opaque;
+    g_autofree char *name = NULL;
+    BdrvChild *child;
+
+    /* The first target keeps the name it always had */
+    if (s->next_target_index) {
+        name = g_strdup_printf("target.%u", s->next_target_index);
+    } else {
+        name = g_strdup("target");
+    }
+
+    bdrv_ref(target);
+    child = bdrv_attach_child(top, target, name, &child_of_bds,
+                              BDRV_CHILD_DATA, errp);
+    if (!child) {
+        bdrv_unref(target);
+        return NULL;
+    }
+
+    s->next_target_index++;
+    return child;
+}
+
+/* Called with the source drained */
+static BlockCopyState *backup_top_add_bcs(BlockDriverState *top,
+                                          BdrvChild *target,
+                                          BackupPerf *perf,
+                                          BdrvRequestFlags write_flags,
+                                          Error **errp)
+{
+    BDRVBackupTopState *s = top->opaque;
+    BackupTopTarget *t;
+    BlockCopyState *bcs;
+
+    bcs = block_copy_state_new(top->backing, target, s->cluster_size,
+                               perf->use_copy_range, write_flags, errp);
+    if (!bcs) {
+        error_prepend(errp, "Cannot create block-copy-state: ");
+        return NULL;
+    }
+
+    t = g_new(BackupTopTarget, 1);
+    *t = (BackupTopTarget) {
+        .bcs = bcs,
+        .target = target,
+    };
+    QLIST_INSERT_HEAD(&s->targets, t, next);
+    block_copy_group_add(s->group, bcs);
+
+    return bcs;
+}
+
+int64_t bdrv_backup_top_cluster_size(BlockDriverState *bs)
+{
+    BDRVBackupTopState *s;
+
+    if (bs->drv != &bdrv_backup_top_filter) {
+        return 0;
+    }
+
+    s = bs->opaque;
+    return s->cluster_size;
+}
+
+/* Add @target to the backup-top filter @top of a running backup */
+static BlockCopyState *backup_top_share(BlockDriverState *top,
+                                        BlockDriverState *target,
+                                        BackupPerf *perf,
+                                        BdrvRequestFlags write_flags,
+                                        Error **errp)
+{
+    BlockDriverState *source = bdrv_filter_bs(top);
+    BdrvChild *child;
+    BlockCopyState *bcs;
+
+    assert(source->total_sectors == target->total_sectors);
+
+    child = backup_top_attach_target(top, target, errp);
+    if (!child) {
+        return NULL;
+    }
+
+    bdrv_drained_begin(source);
+    bcs = backup_top_add_bcs(top, child, perf, write_flags, errp);
+    bdrv_drained_end(source);
+
+    if (!bcs) {
+        bdrv_unref_child(top, child);
+    }
+    return bcs;
+}
+
 BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
                                          BlockDriverState *target,
                                          const char *filter_node_name,
@@ -179,8 +308,20 @@ BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
     int ret;
     BDRVBackupTopState *state;
     BlockDriverState *top;
+    BdrvChild *child;
     bool appended = false;
 
+    if (bdrv_backup_top_cluster_size(source)) {
+        assert(!filter_node_name);
+        assert(cluster_size == bdrv_backup_top_cluster_size(source));
+
+        *bcs = backup_top_share(source, target, perf, write_flags, errp);
+        if (!*bcs) {
+            return NULL;
+        }
+        return source;
+    }
+
     assert(source->total_sectors == target->total_sectors);
 
     top = bdrv_new_open_driver(&bdrv_backup_top_filter, filter_node_name,
@@ -196,12 +337,12 @@ BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
     top->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
             ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
              source->supported_zero_flags);
+    QLIST_INIT(&state->targets);
+    state->group = block_copy_group_new();
+    state->cluster_size = cluster_size;
 
-    bdrv_ref(target);
-    state->target = bdrv_attach_child(top, target, "target", &child_of_bds,
-                                      BDRV_CHILD_DATA, errp);
-    if (!state->target) {
-        bdrv_unref(target);
+    child = backup_top_attach_target(top, target, errp);
+    if (!child) {
         bdrv_unref(top);
         return NULL;
     }
@@ -215,15 +356,10 @@ BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
     }
     appended = true;
 
-    state->cluster_size = cluster_size;
-    state->bcs = block_copy_state_new(top->backing, state->target,
-                                      cluster_size, perf->use_copy_range,
-                                      write_flags, errp);
-    if (!state->bcs) {
-        error_prepend(errp, "Cannot create block-copy-state: ");
+    *bcs = backup_top_add_bcs(top, child, perf, write_flags, errp);
+    if (!*bcs) {
         goto fail;
     }
-    *bcs = state->bcs;
 
     bdrv_drained_end(source);
 
@@ -231,23 +367,47 @@ BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
 
 fail:
     if (appended) {
-        bdrv_backup_top_drop(top);
-    } else {
-        bdrv_unref(top);
+        bdrv_drop_filter(top, &error_abort);
     }
+    bdrv_unref(top);
 
     bdrv_drained_end(source);
 
     return NULL;
 }
 
-void bdrv_backup_top_drop(BlockDriverState *bs)
+void bdrv_backup_top_drop(BlockDriverState *bs, BlockCopyState *bcs)
 {
     BDRVBackupTopState *s = bs->opaque;
+    BlockDriverState *source = bdrv_filter_bs(bs);
+    BackupTopTarget *t;
 
-    bdrv_drop_filter(bs, &error_abort);
+    QLIST_FOREACH(t, &s->targets, next) {
+        if (t->bcs == bcs) {
+            break;
+        }
+    }
+    assert(t);
+
+    if (QLIST_FIRST(&s->targets) == t && !QLIST_NEXT(t, next)) {
+        /* This was the last backup using the filter */
+        bdrv_drop_filter(bs, &error_abort);
 
-    block_copy_state_free(s->bcs);
+        QLIST_REMOVE(t, next);
+        block_copy_group_remove(bcs);
+        block_copy_state_free(bcs);
+        g_free(t);
+
+        bdrv_unref(bs);
+        return;
+    }
+
+    bdrv_drained_begin(source);
+    QLIST_REMOVE(t, next);
+    block_copy_group_remove(bcs);
+    bdrv_drained_end(source);
 
-    bdrv_unref(bs);
+    block_copy_state_free(bcs);
+    bdrv_unref_child(bs, t->target);
+    g_free(t);
 }
@@ -37,6 +37,14 @@ BlockDriverState *bdrv_backup_top_append(BlockDriverState *source,
                                          BdrvRequestFlags write_flags,
                                          BlockCopyState **bcs,
                                          Error **errp);
-void bdrv_backup_top_drop(BlockDriverState *bs);
+void bdrv_backup_top_drop(BlockDriverState *bs, BlockCopyState *bcs);
+
+/*
+ * If @bs is the backup-top filter of a running backup, return the cluster
+ * size of its copy, else 0.  bdrv_backup_top_append() on such a node with
+ * that cluster size adds a target to the filter, so that both backups read
+ * the source once, instead of inserting another filter.
+ */
+int64_t bdrv_backup_top_cluster_size(BlockDriverState *bs);
 
 #endif /* BACKUP_TOP_H */
@@ -104,7 +104,7 @@ static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
     block_job_remove_all_bdrv(&s->common);
-    bdrv_backup_top_drop(s->backup_top);
+    bdrv_backup_top_drop(s->backup_top, s->bcs);
 }
 
 void backup_do_checkpoint(BlockJob *job, Error **errp)
@@ -308,6 +308,7 @@ static void coroutine_fn backup_pause(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
 
+    block_copy_set_paused(s->bcs, true);
     if (s->bg_bcs_call && !block_copy_call_finished(s->bg_bcs_call)) {
         block_copy_call_cancel(s->bg_bcs_call);
         s->wait = true;
@@ -315,6 +316,13 @@ static void coroutine_fn backup_pause(Job *job)
     }
 }
 
+static void coroutine_fn backup_resume(Job *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    block_copy_set_paused(s->bcs, false);
+}
+
 static void coroutine_fn backup_set_speed(BlockJob *job, int64_t speed)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common);
@@ -349,6 +357,7 @@ static const BlockJobDriver backup_job_driver = {
         .abort                  = backup_abort,
         .clean                  = backup_clean,
         .pause                  = backup_pause,
+        .resume                 = backup_resume,
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
@@ -406,7 +415,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
 {
     int64_t len, target_len;
     BackupBlockJob *job = NULL;
-    int64_t cluster_size;
+    int64_t cluster_size, shared_cluster_size;
+    BlockDriverState *source;
     BdrvRequestFlags write_flags;
     BlockDriverState *backup_top = NULL;
     BlockCopyState *bcs = NULL;
@@ -418,7 +428,24 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     assert(sync_mode != MIRROR_SYNC_MODE_INCREMENTAL);
     assert(sync_bitmap || sync_mode != MIRROR_SYNC_MODE_BITMAP);
 
-    if (bs == target) {
+    /*
+     * A node that is already being backed up is the backup-top filter of
+     * the running backup.  Share it, so that the source is read once for
+     * both targets, instead of stacking another filter on top of it.
+     */
+    shared_cluster_size = bdrv_backup_top_cluster_size(bs);
+    if (shared_cluster_size) {
+        if (filter_node_name) {
+            error_setg(errp, "A filter node name cannot be set when the "
+                       "source is already being backed up");
+            return NULL;
+        }
+        source = bdrv_filter_bs(bs);
+    } else {
+        source = bs;
+    }
+
+    if (bs == target || source == target) {
         error_setg(errp, "Source and target cannot be the same");
         return NULL;
     }
@@ -441,7 +468,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
-    if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
+    if (bdrv_op_is_blocked(source, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
 
@@ -454,6 +481,16 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         goto error;
     }
 
+    if (shared_cluster_size) {
+        if (cluster_size > shared_cluster_size) {
+            error_setg(errp, "The target needs a cluster size of %" PRIi64
+                       ", larger than the %" PRIi64 " of the running backup "
+                       "of the source", cluster_size, shared_cluster_size);
+            return NULL;
+        }
+        cluster_size = shared_cluster_size;
+    }
+
     if (perf->max_workers < 1) {
         error_setg(errp, "max-workers must be greater than zero");
         return NULL;
@@ -518,7 +555,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
      * For more information see commit f8d59dfb40bb and test
      * tests/qemu-iotests/222
      */
-    write_flags = (bdrv_chain_contains(target, bs) ? BDRV_REQ_SERIALISING : 0) |
+    write_flags = (bdrv_chain_contains(target, source) ?
+                   BDRV_REQ_SERIALISING : 0) |
                   (compress ? BDRV_REQ_WRITE_COMPRESSED : 0),
 
     backup_top = bdrv_backup_top_append(bs, target, filter_node_name,
@@ -551,6 +589,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
 
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
+    /* sync=none only copies what the guest is about to overwrite */
+    block_copy_set_cbw_only(bcs, sync_mode == MIRROR_SYNC_MODE_NONE);
 
     /* Required permissions are already taken by backup-top target */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
@@ -563,7 +603,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         bdrv_reclaim_dirty_bitmap(sync_bitmap, NULL);
     }
     if (backup_top) {
-        bdrv_backup_top_drop(backup_top);
+        bdrv_backup_top_drop(backup_top, bcs);
     }
 
     return NULL;
@@ -83,8 +83,12 @@ struct BlockBackend {
 
     int quiesce_counter;
     CoQueue queued_requests;
+    QemuMutex queued_requests_lock; /* protects queued_requests */
     bool disable_request_queuing;
 
+    /* Submit aio requests in the calling thread, see blk_set_multiqueue() */
+    bool multiqueue;
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -355,6 +359,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
     block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->queued_requests);
+    qemu_mutex_init(&blk->queued_requests_lock);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
@@ -470,6 +475,7 @@ static void blk_delete(BlockBackend *blk)
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -1152,6 +1158,38 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+/*
+ * In multiqueue mode, aio requests run in the AioContext of the thread that
+ * submits them instead of the AioContext of @blk, and their completion
+ * callback is called in that thread too.  This lets several iothreads issue
+ * requests to the same BlockBackend in parallel, provided that all nodes
+ * below it support it (see bdrv_supports_multiqueue()); requests fall back
+ * to the AioContext of @blk otherwise.
+ *
+ * Callers must not rely on the AioContext lock of @blk to serialize their
+ * requests or completions.
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool enable)
+{
+    blk->multiqueue = enable;
+}
+
+bool blk_supports_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    return bs && bdrv_supports_multiqueue(bs);
+}
+
+/* Return the AioContext in which an aio request on @blk must run */
+static AioContext *blk_aio_context_for_request(BlockBackend *blk)
+{
+    if (blk->multiqueue && blk_supports_multiqueue(blk)) {
+        return bdrv_get_request_aio_context(blk_bs(blk));
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1188,11 +1226,13 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
 {
     assert(blk->in_flight > 0);
 
+    qemu_mutex_lock(&blk->queued_requests_lock);
     if (blk->quiesce_counter && !blk->disable_request_queuing) {
         blk_dec_in_flight(blk);
-        qemu_co_queue_wait(&blk->queued_requests, NULL);
+        qemu_co_queue_wait(&blk->queued_requests, &blk->queued_requests_lock);
         blk_inc_in_flight(blk);
     }
+    qemu_mutex_unlock(&blk->queued_requests_lock);
 }
 
 /* To be called between exactly one pair of blk_inc/dec_in_flight() */
@@ -1373,6 +1413,15 @@ void blk_inc_in_flight(BlockBackend *blk)
 void blk_dec_in_flight(BlockBackend *blk)
 {
     qatomic_dec(&blk->in_flight);
+    if (blk->multiqueue) {
+        AioContext *ctx = blk_get_aio_context(blk);
+
+        /* See bdrv_wakeup() */
+        if (ctx != qemu_get_aio_context() &&
+            ctx != qemu_get_current_aio_context()) {
+            aio_notify(ctx);
+        }
+    }
     aio_wait_kick();
 }
 
@@ -1396,7 +1445,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
+    replay_bh_schedule_oneshot_event(blk_aio_context_for_request(blk),
                                      error_callback_bh, acb);
     return &acb->common;
 }
@@ -1404,6 +1453,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
 typedef struct BlkAioEmAIOCB {
     BlockAIOCB common;
     BlkRwCo rwco;
+    AioContext *ctx;
     int bytes;
     bool has_returned;
 } BlkAioEmAIOCB;
@@ -1412,7 +1462,7 @@ static AioContext *blk_aio_em_aiocb_get_aio_context(BlockAIOCB *acb_)
 {
     BlkAioEmAIOCB *acb = container_of(acb_, BlkAioEmAIOCB, common);
 
-    return blk_get_aio_context(acb->rwco.blk);
+    return acb->ctx;
 }
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
@@ -1453,16 +1503,16 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
         .flags  = flags,
         .ret    = NOT_DONE,
     };
+    acb->ctx = blk_aio_context_for_request(blk);
     acb->bytes = bytes;
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(acb->ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
-                                         blk_aio_complete_bh, acb);
+        replay_bh_schedule_oneshot_event(acb->ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -2420,9 +2470,12 @@ static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
-        while (qemu_co_enter_next(&blk->queued_requests, NULL)) {
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_enter_next(&blk->queued_requests,
+                                  &blk->queued_requests_lock)) {
             /* Resume all queued requests */
         }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
@@ -2455,6 +2508,71 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/*
+ * See bdrv_co_can_sendfile().  Nodes with I/O limits never use sendfile so
+ * that requests are throttled once, by the read that the caller does
+ * instead.
+ */
+bool coroutine_fn blk_co_can_sendfile(BlockBackend *blk, int64_t offset,
+                                      unsigned int bytes)
+{
+    if (blk_check_byte_request(blk, offset, bytes) ||
+        blk->public.throttle_group_member.throttle_state)
+    {
+        return false;
+    }
+
+    return bdrv_co_can_sendfile(blk->root, offset, bytes);
+}
+
+/* See bdrv_co_sendfile() */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 unsigned int bytes, int out_fd)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        goto out;
+    }
+    if (blk->public.throttle_group_member.throttle_state) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    bdrv_inc_in_flight(bs);
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, out_fd);
+    bdrv_dec_in_flight(bs);
+
+out:
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
+/* See bdrv_co_readahead() */
+int coroutine_fn blk_co_readahead(BlockBackend *blk, int64_t offset,
+                                  unsigned int bytes)
+{
+    int ret;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret == 0) {
+        ret = bdrv_co_readahead(blk->root, offset, bytes);
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
@@ -102,6 +102,13 @@ typedef struct BlockCopyTask {
      */
     int64_t bytes;
     QLIST_ENTRY(BlockCopyTask) list;
+
+    /*
+     * Tasks of the other states of the group, that get the data read by
+     * this task.  Only accessed by the coroutine running this task.
+     */
+    QLIST_HEAD(BlockCopyTaskList, BlockCopyTask) fanout;
+    QLIST_ENTRY(BlockCopyTask) fanout_list;
 } BlockCopyTask;
 
 static int64_t task_end(BlockCopyTask *task)
@@ -151,13 +158,33 @@ typedef struct BlockCopyState {
      * block_copy_reset_unallocated() every time it does.
      */
     bool skip_unallocated; /* atomic */
+    /*
+     * Set while the user of the state does not want background copies,
+     * e.g. while its job is paused.  Only copy-before-write requests then
+     * write to its target on its behalf.
+     */
+    bool paused; /* atomic */
+    /*
+     * Set for states that only copy on behalf of copy-before-write
+     * requests (sync=none backups): their copy_bitmap is fully set, but
+     * only the areas written by the guest have to be copied.
+     */
+    bool cbw_only; /* atomic */
     /* State fields that use a thread-safe API */
     BdrvDirtyBitmap *copy_bitmap;
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+
+    /* Only changed while the source is drained */
+    BlockCopyGroup *group;
+    QLIST_ENTRY(BlockCopyState) group_list;
 } BlockCopyState;
 
+struct BlockCopyGroup {
+    QLIST_HEAD(, BlockCopyState) states;
+};
+
 /* Called with lock held */
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
                                             int64_t offset, int64_t bytes)
@@ -214,24 +241,17 @@ static int64_t block_copy_chunk_size(BlockCopyState *s)
 }
 
 /*
- * Search for the first dirty area in offset/bytes range and create task at
- * the beginning of it.
+ * Create a task for the dirty area @offset/@bytes, aligning @bytes up to
+ * clusters.
+ *
+ * Called with lock held.
  */
-static coroutine_fn BlockCopyTask *
-block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
-                       int64_t offset, int64_t bytes)
+static BlockCopyTask *block_copy_task_new(BlockCopyState *s,
+                                          BlockCopyCallState *call_state,
+                                          int64_t offset, int64_t bytes,
+                                          BlockCopyMethod method)
 {
     BlockCopyTask *task;
-    int64_t max_chunk;
-
-    QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
-    if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
-                                           offset, offset + bytes,
-                                           max_chunk, &offset, &bytes))
-    {
-        return NULL;
-    }
 
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     bytes = QEMU_ALIGN_UP(bytes, s->cluster_size);
@@ -249,14 +269,37 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
         .call_state = call_state,
         .offset = offset,
         .bytes = bytes,
-        .method = s->method,
+        .method = method,
     };
     qemu_co_queue_init(&task->wait_queue);
+    QLIST_INIT(&task->fanout);
     QLIST_INSERT_HEAD(&s->tasks, task, list);
 
     return task;
 }
 
+/*
+ * Search for the first dirty area in offset/bytes range and create task at
+ * the beginning of it.
+ */
+static coroutine_fn BlockCopyTask *
+block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
+                       int64_t offset, int64_t bytes)
+{
+    int64_t max_chunk;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
+                                           offset, offset + bytes,
+                                           max_chunk, &offset, &bytes))
+    {
+        return NULL;
+    }
+
+    return block_copy_task_new(s, call_state, offset, bytes, s->method);
+}
+
 /*
  * block_copy_task_shrink
  *
@@ -302,6 +345,8 @@ void block_copy_state_free(BlockCopyState *s)
         return;
     }
 
+    assert(!s->group);
+
     ratelimit_destroy(&s->rate_limit);
     bdrv_release_dirty_bitmap(s->copy_bitmap);
     shres_destroy(s->mem);
@@ -352,8 +397,20 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
          */
         s->method = COPY_READ_WRITE_CLUSTER;
     } else if (write_flags & BDRV_REQ_WRITE_COMPRESSED) {
-        /* Compression supports only cluster-size writes and no copy-range. */
-        s->method = COPY_READ_WRITE_CLUSTER;
+        uint64_t max_compressed = QEMU_ALIGN_DOWN(
+                                    target->bs->bl.max_pwrite_compressed,
+                                    cluster_size);
+
+        /*
+         * Compression supports no copy-range, and only cluster-size writes
+         * unless the target can compress several clusters per request.
+         */
+        if (max_compressed > cluster_size) {
+            s->method = COPY_READ_WRITE;
+            s->max_transfer = MIN(s->max_transfer, max_compressed);
+        } else {
+            s->method = COPY_READ_WRITE_CLUSTER;
+        }
     } else {
         /*
          * If copy range enabled, start with COPY_RANGE_SMALL, until first
@@ -408,6 +465,164 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+BlockCopyGroup *block_copy_group_new(void)
+{
+    BlockCopyGroup *group = g_new0(BlockCopyGroup, 1);
+
+    QLIST_INIT(&group->states);
+    return group;
+}
+
+void block_copy_group_free(BlockCopyGroup *group)
+{
+    if (!group) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&group->states));
+    g_free(group);
+}
+
+void block_copy_group_add(BlockCopyGroup *group, BlockCopyState *s)
+{
+    BlockCopyState *first = QLIST_FIRST(&group->states);
+
+    assert(!s->group);
+    if (first) {
+        assert(first->source->bs == s->source->bs);
+        assert(first->cluster_size == s->cluster_size);
+    }
+
+    s->group = group;
+    QLIST_INSERT_HEAD(&group->states, s, group_list);
+}
+
+void block_copy_group_remove(BlockCopyState *s)
+{
+    if (!s->group) {
+        return;
+    }
+
+    QLIST_REMOVE(s, group_list);
+    s->group = NULL;
+}
+
+/*
+ * Whether data read for another state of the group may be written to the
+ * target of @s.  Compressed writes have their own size constraints, and
+ * sync=top states must not copy unallocated areas, so leave them alone.
+ */
+static bool block_copy_can_fanout(BlockCopyState *s)
+{
+    return !(s->write_flags & BDRV_REQ_WRITE_COMPRESSED) &&
+           !qatomic_read(&s->skip_unallocated);
+}
+
+/*
+ * Claim the areas of @task that are still dirty in the other states of its
+ * group, so that they are written with the data read by @task instead of
+ * being read again from the source.
+ *
+ * The claimed bytes are charged to the rate limit of the other state, as
+ * if it had copied them itself.  Background copies leave out the states
+ * that are paused or have exhausted their rate limit: they copy the areas
+ * themselves later.  They also leave out the copy-before-write only
+ * states, which would otherwise be turned into full copies.
+ * Copy-before-write requests must copy the old data to
+ * every target before the guest write, so they write to all targets, just
+ * as they ignore the rate limit of their own state.
+ */
+static void coroutine_fn block_copy_fanout_claim(BlockCopyTask *task)
+{
+    BlockCopyState *s = task->s;
+    BlockCopyState *peer;
+    int64_t end = task_end(task);
+    bool background = !task->call_state->ignore_ratelimit;
+
+    if (!s->group || task->method == COPY_RANGE_SMALL ||
+        task->method == COPY_RANGE_FULL)
+    {
+        return;
+    }
+
+    QLIST_FOREACH(peer, &s->group->states, group_list) {
+        int64_t offset = task->offset;
+        int64_t bytes;
+
+        if (peer == s || !block_copy_can_fanout(peer)) {
+            continue;
+        }
+        if (background && (qatomic_read(&peer->cbw_only) ||
+                           qatomic_read(&peer->paused) ||
+                           ratelimit_calculate_delay(&peer->rate_limit, 0)))
+        {
+            continue;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&peer->lock) {
+            while (bdrv_dirty_bitmap_next_dirty_area(peer->copy_bitmap,
+                                                     offset, end, INT64_MAX,
+                                                     &offset, &bytes))
+            {
+                BlockCopyTask *t = block_copy_task_new(peer, NULL, offset,
+                                                       bytes, task->method);
+
+                QLIST_INSERT_HEAD(&task->fanout, t, fanout_list);
+                ratelimit_calculate_delay(&peer->rate_limit, t->bytes);
+                offset = task_end(t);
+            }
+        }
+    }
+}
+
+/*
+ * Write the data read by a task (or zeroes if @buf is NULL) to the targets
+ * of the @fanout tasks and end them.  A failure only leaves the area dirty
+ * in the state whose target failed, which copies it again itself later.
+ */
+static void coroutine_fn
+block_copy_fanout_write(struct BlockCopyTaskList *fanout, int64_t offset,
+                        void *buf)
+{
+    BlockCopyTask *t, *next;
+
+    QLIST_FOREACH_SAFE(t, fanout, fanout_list, next) {
+        BlockCopyState *peer = t->s;
+        int64_t nbytes = MIN(task_end(t), peer->len) - t->offset;
+        int ret;
+
+        if (buf) {
+            ret = bdrv_co_pwrite(peer->target, t->offset, nbytes,
+                                 (uint8_t *)buf + (t->offset - offset),
+                                 peer->write_flags);
+        } else {
+            ret = bdrv_co_pwrite_zeroes(peer->target, t->offset, nbytes,
+                                        peer->write_flags);
+        }
+        trace_block_copy_fanout_write(peer, t->offset, nbytes, ret);
+
+        if (ret >= 0) {
+            progress_work_done(peer->progress, t->bytes);
+        }
+        QLIST_REMOVE(t, fanout_list);
+        block_copy_task_end(t, ret);
+        g_free(t);
+    }
+}
+
+/* Give back the @fanout areas, for which no data could be read */
+static void coroutine_fn
+block_copy_fanout_cancel(struct BlockCopyTaskList *fanout)
+{
+    BlockCopyTask *t, *next;
+
+    QLIST_FOREACH_SAFE(t, fanout, fanout_list, next) {
+        QLIST_REMOVE(t, fanout_list);
+        block_copy_task_end(t, -EAGAIN);
+        g_free(t);
+    }
+}
+
 /*
  * block_copy_do_copy
  *
@@ -415,6 +630,8 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
  * s->len only to cover last cluster when s->len is not aligned to clusters.
  *
  * No sync here: nor bitmap neighter intersecting requests handling, only copy.
+ * The data is also written to the targets of the @fanout tasks, which are
+ * ended.
  *
  * @method is an in-out argument, so that copy_range can be either extended to
  * a full-size buffer or disabled if the copy_range attempt fails.  The output
@@ -424,7 +641,8 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
                                            int64_t offset, int64_t bytes,
                                            BlockCopyMethod *method,
-                                           bool *error_is_read)
+                                           bool *error_is_read,
+                                           struct BlockCopyTaskList *fanout)
 {
     int ret;
     int64_t nbytes = MIN(offset + bytes, s->len) - offset;
@@ -446,6 +664,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
             trace_block_copy_write_zeroes_fail(s, offset, ret);
             *error_is_read = false;
         }
+        block_copy_fanout_write(fanout, offset, NULL);
         return ret;
 
     case COPY_RANGE_SMALL:
@@ -488,10 +707,13 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         if (ret < 0) {
             trace_block_copy_write_fail(s, offset, ret);
             *error_is_read = false;
-            goto out;
         }
 
+        /* The other targets do not depend on how the write to ours went */
+        block_copy_fanout_write(fanout, offset, bounce_buffer);
+
     out:
+        block_copy_fanout_cancel(fanout);
         qemu_vfree(bounce_buffer);
         break;
 
@@ -510,7 +732,10 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyMethod method = t->method;
     int ret;
 
-    ret = block_copy_do_copy(s, t->offset, t->bytes, &method, &error_is_read);
+    block_copy_fanout_claim(t);
+    ret = block_copy_do_copy(s, t->offset, t->bytes, &method, &error_is_read,
+                             &t->fanout);
+    assert(QLIST_EMPTY(&t->fanout));
 
     WITH_QEMU_LOCK_GUARD(&s->lock) {
         if (s->method == t->method) {
@@ -938,6 +1163,16 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
     qatomic_set(&s->skip_unallocated, skip);
 }
 
+void block_copy_set_paused(BlockCopyState *s, bool paused)
+{
+    qatomic_set(&s->paused, paused);
+}
+
+void block_copy_set_cbw_only(BlockCopyState *s, bool cbw_only)
+{
+    qatomic_set(&s->cbw_only, cbw_only);
+}
+
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     ratelimit_set_speed(&s->rate_limit, speed, BLOCK_COPY_SLICE_TIME);
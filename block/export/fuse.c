@@ -26,7 +26,11 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/sockets.h"
+#include "qemu-common.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -35,14 +39,46 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Capacity of the pipes that read data is spliced through.  This is the
+ * default limit for unprivileged users (/proc/sys/fs/pipe-max-size).
+ */
+#define FUSE_PIPE_SIZE (1024 * 1024)
+
+
+typedef struct FusePipe {
+    int fds[2];
+    QSLIST_ENTRY(FusePipe) next;
+} FusePipe;
 
 typedef struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    /*
+     * Requests are read from the session FD in the export's AioContext and
+     * in the AioContexts of @iothreads, and each one is processed in its own
+     * coroutine.  Requests that do not just read or write data move to the
+     * export's AioContext, so that only I/O is submitted from other threads.
+     */
+    IOThread **iothreads;
+    int num_iothreads;
+
+    /* Number of requests being processed, accessed with atomic ops */
+    unsigned int in_flight;
+    /* Set once no new request may be processed */
+    bool halted;
+
+    /* Serializes resizing the export, only taken in its AioContext */
+    CoMutex resize_lock;
+
+    /* Whether read data may be spliced, and pipes that are free for that */
+    bool splice;
+    QemuMutex pipes_lock;
+    QSLIST_HEAD(, FusePipe) pipes;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -64,6 +100,8 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
+static int setup_fuse_iothreads(FuseExport *exp, strList *iothreads,
+                                Error **errp);
 static void read_from_fuse_export(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
@@ -92,6 +130,13 @@ static int fuse_export_create(BlockExport *blk_exp,
         }
     }
 
+    qemu_co_mutex_init(&exp->resize_lock);
+    qemu_mutex_init(&exp->pipes_lock);
+    QSLIST_INIT(&exp->pipes);
+#ifdef F_SETPIPE_SZ
+    exp->splice = true;
+#endif
+
     init_exports_table();
 
     /*
@@ -136,6 +181,13 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->st_uid = getuid();
     exp->st_gid = getgid();
 
+    if (args->has_iothreads) {
+        ret = setup_fuse_iothreads(exp, args->iothreads, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     if (args->allow_other == FUSE_EXPORT_ALLOW_OTHER_AUTO) {
         /* Ignore errors on our first attempt */
         ret = setup_fuse_export(exp, args->mountpoint, true, NULL);
@@ -179,7 +231,7 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     const char *fuse_argv[4];
     char *mount_opts;
     struct fuse_args fuse_args;
-    int ret;
+    int i, ret;
 
     /*
      * max_read needs to match what fuse_init() sets.
@@ -214,9 +266,20 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
+    /*
+     * All threads are woken up when a request arrives, those that come too
+     * late must not block in read()
+     */
+    qemu_set_nonblock(fuse_session_fd(exp->fuse_session));
+
     aio_set_fd_handler(exp->common.ctx,
                        fuse_session_fd(exp->fuse_session), true,
                        read_from_fuse_export, NULL, NULL, exp);
+    for (i = 0; i < exp->num_iothreads; i++) {
+        aio_set_fd_handler(iothread_get_aio_context(exp->iothreads[i]),
+                           fuse_session_fd(exp->fuse_session), true,
+                           read_from_fuse_export, NULL, NULL, exp);
+    }
     exp->fd_handler_set_up = true;
 
     return 0;
@@ -226,33 +289,131 @@ fail:
     return ret;
 }
 
+/**
+ * Let the iothreads named in @iothreads read and process requests, too.
+ */
+static int setup_fuse_iothreads(FuseExport *exp, strList *iothreads,
+                                Error **errp)
+{
+    strList *e;
+
+    if (!blk_supports_multiqueue(exp->common.blk)) {
+        error_setg(errp, "iothreads is not supported by the exported node");
+        return -ENOTSUP;
+    }
+
+    for (e = iothreads; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", e->value);
+            return -ENOENT;
+        }
+        if (iothread_get_aio_context(iothread) == exp->common.ctx) {
+            continue;
+        }
+
+        object_ref(OBJECT(iothread));
+        exp->iothreads = g_renew(IOThread *, exp->iothreads,
+                                 exp->num_iothreads + 1);
+        exp->iothreads[exp->num_iothreads++] = iothread;
+    }
+
+    if (exp->num_iothreads) {
+        blk_set_multiqueue(exp->common.blk, true);
+    }
+    return 0;
+}
+
+typedef struct FuseRequest {
+    FuseExport *exp;
+    struct fuse_buf buf;
+} FuseRequest;
+
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *r = opaque;
+    FuseExport *exp = r->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &r->buf);
+
+    free(r->buf.mem);
+    g_free(r);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        /* Wake up fuse_export_delete() */
+        aio_wait_kick();
+    }
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
+ * Runs in the export's AioContext and in those of its iothreads.  Each
+ * request gets its own buffer and coroutine, so that further requests can
+ * be read while it waits for I/O.
  */
 static void read_from_fuse_export(void *opaque)
 {
     FuseExport *exp = opaque;
+    FuseRequest *r;
+    Coroutine *co;
     int ret;
 
-    blk_exp_ref(&exp->common);
+    qatomic_inc(&exp->in_flight);
+    if (qatomic_read(&exp->halted)) {
+        goto out;
+    }
+
+    r = g_new0(FuseRequest, 1);
+    r->exp = exp;
 
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &r->buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
+    if (ret <= 0) {
+        /* -EAGAIN if another thread took the request */
+        free(r->buf.mem);
+        g_free(r);
         goto out;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
+    /* The request owns the in-flight reference from now on */
+    co = qemu_coroutine_create(fuse_co_process_request, r);
+    qemu_coroutine_enter(co);
+    return;
 
 out:
-    blk_exp_unref(&exp->common);
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick();
+    }
+}
+
+/**
+ * Move the current request to the export's AioContext.  All operations
+ * other than reading and writing data are done there, without racing
+ * with each other.
+ */
+static void coroutine_fn fuse_co_enter_home(FuseExport *exp)
+{
+    if (qemu_get_current_aio_context() != exp->common.ctx) {
+        aio_co_reschedule_self(exp->common.ctx);
+    }
+}
+
+/* Runs after any read_from_fuse_export() that was already dispatched */
+static void fuse_export_sync_bh(void *opaque)
+{
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    int i;
+
+    qatomic_set(&exp->halted, true);
+    /* Pairs with the check in read_from_fuse_export() */
+    smp_mb();
 
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
@@ -261,7 +422,29 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
             aio_set_fd_handler(exp->common.ctx,
                                fuse_session_fd(exp->fuse_session), true,
                                NULL, NULL, NULL, NULL);
+            for (i = 0; i < exp->num_iothreads; i++) {
+                aio_set_fd_handler(
+                    iothread_get_aio_context(exp->iothreads[i]),
+                    fuse_session_fd(exp->fuse_session), true,
+                    NULL, NULL, NULL, NULL);
+            }
             exp->fd_handler_set_up = false;
+
+            /*
+             * A read_from_fuse_export() that was dispatched before the
+             * handlers were removed may not have counted itself in
+             * @in_flight yet, so fuse_export_delete() could not wait for
+             * it.  Once a BH has run in each AioContext, every such call
+             * has either returned or counted itself.
+             */
+            aio_wait_bh_oneshot(exp->common.ctx, fuse_export_sync_bh, NULL);
+            for (i = 0; i < exp->num_iothreads; i++) {
+                AioContext *ctx = iothread_get_aio_context(exp->iothreads[i]);
+
+                aio_context_acquire(ctx);
+                aio_wait_bh_oneshot(ctx, fuse_export_sync_bh, NULL);
+                aio_context_release(ctx);
+            }
         }
     }
 
@@ -277,6 +460,11 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    FusePipe *p;
+    int i;
+
+    /* Requests hold no reference to the export, wait for them here */
+    AIO_WAIT_WHILE(exp->common.ctx, qatomic_read(&exp->in_flight) > 0);
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -286,7 +474,22 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    if (exp->num_iothreads) {
+        blk_set_multiqueue(exp->common.blk, false);
+    }
+    for (i = 0; i < exp->num_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
+
+    while ((p = QSLIST_FIRST(&exp->pipes))) {
+        QSLIST_REMOVE_HEAD(&exp->pipes, next);
+        close(p->fds[0]);
+        close(p->fds[1]);
+        g_free(p);
+    }
+    qemu_mutex_destroy(&exp->pipes_lock);
+
     g_free(exp->mountpoint);
 }
 
@@ -328,6 +531,11 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /* Read data can be spliced, see fuse_co_read_splice() */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
 }
 
 /**
@@ -350,6 +558,8 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     time_t now = time(NULL);
     FuseExport *exp = fuse_req_userdata(req);
 
+    fuse_co_enter_home(exp);
+
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
@@ -380,6 +590,7 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
+/* Called in the export's AioContext with exp->resize_lock held */
 static int fuse_do_truncate(const FuseExport *exp, int64_t size,
                             bool req_zero_write, PreallocMode prealloc)
 {
@@ -428,6 +639,8 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
     int supported_attrs;
     int ret;
 
+    fuse_co_enter_home(exp);
+
     supported_attrs = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE;
     if (exp->allow_other) {
         supported_attrs |= FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID;
@@ -466,7 +679,9 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
             return;
         }
 
+        qemu_co_mutex_lock(&exp->resize_lock);
         ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        qemu_co_mutex_unlock(&exp->resize_lock);
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -498,6 +713,101 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+static FusePipe *fuse_get_pipe(FuseExport *exp)
+{
+    FusePipe *p;
+
+    WITH_QEMU_LOCK_GUARD(&exp->pipes_lock) {
+        p = QSLIST_FIRST(&exp->pipes);
+        if (p) {
+            QSLIST_REMOVE_HEAD(&exp->pipes, next);
+            return p;
+        }
+    }
+
+    p = g_new(FusePipe, 1);
+    if (qemu_pipe(p->fds) < 0) {
+        g_free(p);
+        return NULL;
+    }
+#ifdef F_SETPIPE_SZ
+    if (fcntl(p->fds[1], F_SETPIPE_SZ, FUSE_PIPE_SIZE) < FUSE_PIPE_SIZE)
+#endif
+    {
+        /* Reads would not fit, do not try again */
+        qatomic_set(&exp->splice, false);
+        close(p->fds[0]);
+        close(p->fds[1]);
+        g_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void fuse_put_pipe(FuseExport *exp, FusePipe *p, bool reuse)
+{
+    if (!reuse) {
+        close(p->fds[0]);
+        close(p->fds[1]);
+        g_free(p);
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&exp->pipes_lock);
+    QSLIST_INSERT_HEAD(&exp->pipes, p, next);
+}
+
+/**
+ * Try to reply to a read with data sent straight from the image file into
+ * a pipe, which libfuse then splices into the FUSE device, without copying
+ * it through a user space buffer.  Returns false if this is not possible,
+ * in which case nothing has been replied yet.
+ */
+static bool coroutine_fn fuse_co_read_splice(FuseExport *exp, fuse_req_t req,
+                                             off_t offset, size_t size)
+{
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    FusePipe *p;
+    int ret;
+
+    /* Data that is not page aligned can take one more pipe buffer */
+    if (!size || size > FUSE_PIPE_SIZE - qemu_real_host_page_size ||
+        !qatomic_read(&exp->splice))
+    {
+        return false;
+    }
+
+    p = fuse_get_pipe(exp);
+    if (!p) {
+        return false;
+    }
+
+    ret = blk_co_sendfile(exp->common.blk, offset, size, p->fds[1]);
+    if (ret == -ENOTSUP) {
+        fuse_put_pipe(exp, p, true);
+        return false;
+    } else if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        fuse_put_pipe(exp, p, false);
+        return true;
+    } else if (ret != size) {
+        /*
+         * The pipe did not take all of the data; drop it with the part
+         * that it holds and read the data into a buffer instead
+         */
+        fuse_put_pipe(exp, p, false);
+        return false;
+    }
+
+    bufv.buf[0].flags = FUSE_BUF_IS_FD;
+    bufv.buf[0].fd = p->fds[0];
+    ret = fuse_reply_data(req, &bufv, 0);
+
+    /* The pipe is only empty if all of its data was sent */
+    fuse_put_pipe(exp, p, ret == 0);
+    return true;
+}
+
 /**
  * Handle client reads from the exported image.
  */
@@ -529,6 +839,10 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
+    if (fuse_co_read_splice(exp, req, offset, size)) {
+        return;
+    }
+
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -578,7 +892,19 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            fuse_co_enter_home(exp);
+            qemu_co_mutex_lock(&exp->resize_lock);
+            /* Another write may have grown the export in the meantime */
+            length = blk_getlength(exp->common.blk);
+            if (length < 0) {
+                ret = length;
+            } else if (offset + size > length) {
+                ret = fuse_do_truncate(exp, offset + size, true,
+                                       PREALLOC_MODE_OFF);
+            } else {
+                ret = 0;
+            }
+            qemu_co_mutex_unlock(&exp->resize_lock);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -597,25 +923,18 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 }
 
 /**
- * Let clients perform various fallocate() operations.
+ * Perform fallocate() operations for fuse_fallocate().  Called with
+ * exp->resize_lock held.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int coroutine_fn fuse_co_do_fallocate(FuseExport *exp, int mode,
+                                             off_t offset, off_t length)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
-    if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
-    }
-
     blk_len = blk_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
     if (mode & FALLOC_FL_KEEP_SIZE) {
@@ -624,8 +943,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
     if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
@@ -643,8 +961,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
             ret = fuse_do_truncate(exp, offset + length, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
@@ -661,16 +978,14 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
             ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
@@ -680,6 +995,30 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
+    return ret;
+}
+
+/**
+ * Let clients perform various fallocate() operations.
+ */
+static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
+                           off_t offset, off_t length,
+                           struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    if (!exp->writable) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    fuse_co_enter_home(exp);
+
+    qemu_co_mutex_lock(&exp->resize_lock);
+    ret = fuse_co_do_fallocate(exp, mode, offset, length);
+    qemu_co_mutex_unlock(&exp->resize_lock);
+
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -692,6 +1031,8 @@ static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
     FuseExport *exp = fuse_req_userdata(req);
     int ret;
 
+    fuse_co_enter_home(exp);
+
     ret = blk_flush(exp->common.blk);
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
@@ -720,6 +1061,8 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
         return;
     }
 
+    fuse_co_enter_home(exp);
+
     while (true) {
         int64_t pnum;
         int ret;
@@ -780,6 +1123,10 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
 }
 #endif
 
+/*
+ * All operations are called in a coroutine, in the thread that read the
+ * request (see read_from_fuse_export()).
+ */
 static const struct fuse_lowlevel_ops fuse_ops = {
     .init       = fuse_init,
     .lookup     = fuse_lookup,
@@ -18,6 +18,7 @@
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 
 /*
@@ -54,17 +55,25 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    /* Virtqueue i is processed in the AioContext of iothreads[i % n] */
+    IOThread **iothreads;
+    int num_iothreads;
+    AioContext **queue_ctx;
+    bool multiqueue;            /* multiqueue was enabled by this export */
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuDev *vu_dev = &server->vu_dev;
 
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
     vu_queue_notify(vu_dev, req->vq);
 
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static bool vu_blk_sect_range_ok(VuBlkExport *vexp, uint64_t sector,
@@ -290,6 +299,7 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
 
 err:
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
@@ -307,6 +317,7 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        vhost_user_server_inc_in_flight(server);
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
@@ -459,6 +470,76 @@ vu_blk_initialize_config(BlockDriverState *bs,
     config->max_write_zeroes_seg = cpu_to_le32(1);
 }
 
+/*
+ * Assign the virtqueues to the iothreads named in @iothreads, round-robin.
+ * Virtqueues whose iothread is the one of the export are left alone.
+ */
+static int vu_blk_exp_setup_iothreads(VuBlkExport *vexp, strList *iothreads,
+                                      uint16_t num_queues, Error **errp)
+{
+    BlockExport *exp = &vexp->export;
+    bool multiqueue = false;
+    strList *e;
+    int i;
+
+    for (e = iothreads; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", e->value);
+            return -ENOENT;
+        }
+        object_ref(OBJECT(iothread));
+        vexp->iothreads = g_renew(IOThread *, vexp->iothreads,
+                                  vexp->num_iothreads + 1);
+        vexp->iothreads[vexp->num_iothreads++] = iothread;
+    }
+    if (!vexp->num_iothreads) {
+        error_setg(errp, "iothreads must list at least one iothread");
+        return -EINVAL;
+    }
+
+    vexp->queue_ctx = g_new0(AioContext *, num_queues);
+    for (i = 0; i < num_queues; i++) {
+        IOThread *iothread = vexp->iothreads[i % vexp->num_iothreads];
+        AioContext *ctx = iothread_get_aio_context(iothread);
+
+        if (ctx != exp->ctx) {
+            vexp->queue_ctx[i] = ctx;
+            multiqueue = true;
+        }
+    }
+
+    if (multiqueue) {
+        if (!blk_supports_multiqueue(exp->blk)) {
+            error_setg(errp, "iothreads is not supported by the exported "
+                       "node");
+            return -ENOTSUP;
+        }
+        blk_set_multiqueue(exp->blk, true);
+        vexp->multiqueue = true;
+    }
+    return 0;
+}
+
+static void vu_blk_exp_free_iothreads(VuBlkExport *vexp)
+{
+    int i;
+
+    if (vexp->multiqueue) {
+        blk_set_multiqueue(vexp->export.blk, false);
+        vexp->multiqueue = false;
+    }
+    for (i = 0; i < vexp->num_iothreads; i++) {
+        object_unref(OBJECT(vexp->iothreads[i]));
+    }
+    g_free(vexp->iothreads);
+    vexp->iothreads = NULL;
+    vexp->num_iothreads = 0;
+    g_free(vexp->queue_ctx);
+    vexp->queue_ctx = NULL;
+}
+
 static void vu_blk_exp_request_shutdown(BlockExport *exp)
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
@@ -500,6 +581,15 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         return -EINVAL;
     }
 
+    if (vu_opts->has_iothreads) {
+        int ret = vu_blk_exp_setup_iothreads(vexp, vu_opts->iothreads,
+                                             num_queues, errp);
+        if (ret < 0) {
+            vu_blk_exp_free_iothreads(vexp);
+            return ret;
+        }
+    }
+
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
@@ -507,9 +597,11 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 num_queues, vexp->queue_ctx, &vu_blk_iface,
+                                 errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        vu_blk_exp_free_iothreads(vexp);
         return -EADDRNOTAVAIL;
     }
 
@@ -522,6 +614,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    vu_blk_exp_free_iothreads(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
@@ -31,6 +31,7 @@
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/units.h"
+#include "qemu/stats64.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
@@ -65,6 +66,7 @@
 #ifdef __linux__
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #include <linux/cdrom.h>
@@ -162,15 +164,19 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    /* The file cannot be polled, so rings with IOPOLL must not be used */
+    bool iopoll_unsupported;
+    /* sendfile() failed with EINVAL or ENOSYS on this file */
+    bool sendfile_unsupported;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
     struct {
-        uint64_t discard_nb_ok;
-        uint64_t discard_nb_failed;
-        uint64_t discard_bytes_ok;
+        Stat64 discard_nb_ok;
+        Stat64 discard_nb_failed;
+        Stat64 discard_bytes_ok;
     } stats;
 
     PRManager *pr_mgr;
@@ -216,6 +222,9 @@ typedef struct RawPosixAIOData {
             int aio_fd2;
             off_t aio_offset2;
         } copy_range;
+        struct {
+            int out_fd;
+        } sendfile;
         struct {
             PreallocMode prealloc;
             Error **errp;
@@ -558,6 +567,37 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * Register s->fd with the io_uring ring of @ctx, so that the kernel does not
+ * have to look it up for every request.  Requests submitted from other
+ * AioContexts simply use the plain file descriptor.
+ */
+static void raw_register_fixed_fd(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        aio = aio_get_linux_io_uring(ctx);
+        luring_register_fd(aio, s->fd);
+    }
+#endif
+}
+
+static void raw_unregister_fixed_fd(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        aio = aio_get_linux_io_uring(ctx);
+        luring_unregister_fd(aio, s->fd);
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -790,6 +830,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    /*
+     * Only register s->fd once nothing can fail any more: the registration
+     * keeps the file open, so a stale entry would redirect the requests of a
+     * later node that gets the same file descriptor number.
+     */
+    raw_register_fixed_fd(bs, bdrv_get_aio_context(bs));
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1804,6 +1851,69 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef __linux__
+/*
+ * Send as much of the range as the socket takes without blocking, and
+ * return the number of bytes sent.  The worker thread only waits for the
+ * file to be read; the caller waits for the socket to become writable.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    BDRVRawState *s = aiocb->bs->opaque;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t offset = aiocb->aio_offset;
+    int out_fd = aiocb->sendfile.out_fd;
+
+    while (bytes) {
+        ssize_t ret = sendfile(out_fd, aiocb->aio_fildes, &offset, bytes);
+
+        trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, offset, out_fd,
+                            bytes, ret);
+        if (ret == 0) {
+            /* The file was truncated in the meantime */
+            return -EIO;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                return aiocb->aio_nbytes - bytes;
+            case EINVAL:
+            case ENOSYS:
+                if (bytes == aiocb->aio_nbytes) {
+                    qatomic_set(&s->sendfile_unsupported, true);
+                    return -ENOTSUP;
+                }
+                /* fall through */
+            default:
+                return -errno;
+            }
+        }
+        bytes -= ret;
+    }
+    return aiocb->aio_nbytes;
+}
+
+/* readahead() returns once the range has been read into the page cache */
+static int handle_aiocb_readahead(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    int ret;
+
+    ret = readahead(aiocb->aio_fildes, aiocb->aio_offset, aiocb->aio_nbytes);
+    ret = ret < 0 ? -errno : 0;
+    trace_file_readahead(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                         aiocb->aio_nbytes, ret);
+    if (ret == -EINVAL) {
+        /* e.g. the file type does not support it */
+        ret = -ENOTSUP;
+    }
+    return ret;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2022,19 +2132,72 @@ out:
     return result;
 }
 
+/*
+ * Requests are submitted to the thread pool, Linux AIO or io_uring instance
+ * of the AioContext they are issued from.  This is the home AioContext of
+ * the node, unless it is served by several iothreads at once, in which case
+ * each of them uses its own.
+ */
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    /* @bs can be NULL, the main context is the fallback then */
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Return NULL if no Linux AIO context can be set up in the current
+ * AioContext; the caller falls back to the thread pool then.  The home
+ * AioContext is set up at open or attach time, so this only fails for the
+ * additional iothreads of a multiqueue node.
+ */
+static LinuxAioState *raw_get_linux_aio(BlockDriverState *bs)
+{
+    return aio_setup_linux_aio(bdrv_get_request_aio_context(bs), NULL);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/* Same as raw_get_linux_aio(), for io_uring */
+static LuringState *raw_get_linux_io_uring(BlockDriverState *bs)
+{
+    return aio_setup_linux_io_uring(bdrv_get_request_aio_context(bs), NULL);
+}
+
+/*
+ * Return the io_uring instance a request of @type can be submitted to, or
+ * NULL to use the thread pool.  A ring with polled completions only accepts
+ * O_DIRECT reads and writes on files that support polling.
+ */
+static LuringState *raw_get_linux_io_uring_for(BlockDriverState *bs,
+                                               int type)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio = raw_get_linux_io_uring(bs);
+
+    if (aio && luring_is_iopoll(aio) &&
+        (!(type & (QEMU_AIO_READ | QEMU_AIO_WRITE)) ||
+         !(s->open_flags & O_DIRECT) ||
+         qatomic_read(&s->iopoll_unsupported))) {
+        return NULL;
+    }
+    return aio;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *luring;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    LinuxAioState *laio;
+#endif
 
     if (fd_open(bs) < 0)
         return -EIO;
@@ -2048,16 +2211,28 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_io_uring &&
+               (luring = raw_get_linux_io_uring_for(bs, type))) {
+        int ret;
+
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        ret = luring_co_submit(bs, luring, s->fd, offset, qiov, type);
+        if (ret != -EOPNOTSUPP || !luring_is_iopoll(luring)) {
+            return ret;
+        }
+
+        /*
+         * The kernel rejects polled I/O on files whose driver cannot poll
+         * for completions before doing any I/O.  Use the thread pool for
+         * this file from now on.
+         */
+        trace_file_iopoll_unsupported(bs, s->fd);
+        qatomic_set(&s->iopoll_unsupported, true);
 #endif
 #ifdef CONFIG_LINUX_AIO
-    } else if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_aio && (laio = raw_get_linux_aio(bs))) {
         assert(qiov->size == bytes);
-        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return laio_co_submit(bs, laio, s->fd, offset, qiov, type);
 #endif
     }
 
@@ -2097,14 +2272,18 @@ static void raw_aio_plug(BlockDriverState *bs)
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_plug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_plug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
     }
 #endif
 }
@@ -2114,14 +2293,18 @@ static void raw_aio_unplug(BlockDriverState *bs)
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_unplug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_unplug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
     }
 #endif
 }
@@ -2145,8 +2328,10 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        LuringState *aio = raw_get_linux_io_uring_for(bs, QEMU_AIO_FLUSH);
+        if (aio) {
+            return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        }
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
@@ -2175,6 +2360,42 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
             s->use_linux_io_uring = false;
         }
     }
+#endif
+    raw_register_fixed_fd(bs, new_context);
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_unregister_fixed_fd(bs, bdrv_get_aio_context(bs));
+}
+
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+
+        if (aio) {
+            luring_register_buf(aio, host, size);
+        }
+    }
+#endif
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring) {
+        LuringState *aio = raw_get_linux_io_uring(bs);
+
+        if (aio) {
+            luring_unregister_buf(aio, host);
+        }
+    }
 #endif
 }
 
@@ -2182,6 +2403,7 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_unregister_fixed_fd(bs, bdrv_get_aio_context(bs));
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2933,10 +3155,10 @@ static void coroutine_fn raw_co_invalidate_cache(BlockDriverState *bs,
 static void raw_account_discard(BDRVRawState *s, uint64_t nbytes, int ret)
 {
     if (ret) {
-        s->stats.discard_nb_failed++;
+        stat64_add(&s->stats.discard_nb_failed, 1);
     } else {
-        s->stats.discard_nb_ok++;
-        s->stats.discard_bytes_ok += nbytes;
+        stat64_add(&s->stats.discard_nb_ok, 1);
+        stat64_add(&s->stats.discard_bytes_ok, nbytes);
     }
 }
 
@@ -3053,9 +3275,9 @@ static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
     return (BlockStatsSpecificFile) {
-        .discard_nb_ok = s->stats.discard_nb_ok,
-        .discard_nb_failed = s->stats.discard_nb_failed,
-        .discard_bytes_ok = s->stats.discard_bytes_ok,
+        .discard_nb_ok = stat64_get(&s->stats.discard_nb_ok),
+        .discard_nb_failed = stat64_get(&s->stats.discard_nb_failed),
+        .discard_bytes_ok = stat64_get(&s->stats.discard_bytes_ok),
     };
 }
 
@@ -3176,9 +3398,11 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_unregister_fixed_fd(bs, bdrv_get_aio_context(bs));
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_register_fixed_fd(bs, bdrv_get_aio_context(bs));
     }
     s->perm_change_fd = 0;
 
@@ -3248,11 +3472,95 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#ifdef __linux__
+static bool coroutine_fn raw_co_can_sendfile(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes)
+{
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+
+    if (fd_open(bs) < 0 || qatomic_read(&s->sendfile_unsupported)) {
+        return false;
+    }
+
+    /* With O_DIRECT, sendfile() has the same alignment requirements as I/O */
+    if (s->needs_alignment &&
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return false;
+    }
+
+    /*
+     * sendfile() stops at EOF, while the block layer reads zeroes after the
+     * end of an image file whose size is not aligned.
+     */
+    if (fstat(s->fd, &st) < 0 ||
+        (S_ISREG(st.st_mode) && offset + bytes > st.st_size)) {
+        return false;
+    }
+
+    return true;
+}
+
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, int out_fd)
+{
+    RawPosixAIOData acb;
+    BDRVRawState *s = bs->opaque;
+
+    if (!raw_co_can_sendfile(bs, offset, bytes)) {
+        return -ENOTSUP;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SENDFILE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .sendfile       = {
+            .out_fd         = out_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_sendfile, &acb);
+}
+
+static int coroutine_fn raw_co_readahead(BlockDriverState *bs, int64_t offset,
+                                         int64_t bytes)
+{
+    RawPosixAIOData acb;
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+    /* The page cache is bypassed with O_DIRECT */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_READAHEAD,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_readahead, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
+    .supports_block_status_cache = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -3274,10 +3582,18 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef __linux__
+    .bdrv_co_can_sendfile   = raw_co_can_sendfile,
+    .bdrv_co_sendfile       = raw_co_sendfile,
+    .bdrv_co_readahead      = raw_co_readahead,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3621,6 +3937,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
@@ -3640,10 +3957,18 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef __linux__
+    .bdrv_co_can_sendfile   = raw_co_can_sendfile,
+    .bdrv_co_sendfile       = raw_co_sendfile,
+    .bdrv_co_readahead      = raw_co_readahead,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3768,6 +4093,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3898,6 +4226,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
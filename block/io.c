@@ -916,6 +916,17 @@ void bdrv_inc_in_flight(BlockDriverState *bs)
 
 void bdrv_wakeup(BlockDriverState *bs)
 {
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    /*
+     * aio_wait_kick() only wakes up the main loop.  Requests to a multiqueue
+     * node can complete in another iothread than the one @bs is bound to,
+     * which may be waiting for them in aio_poll() itself, e.g. when draining.
+     */
+    if (ctx != qemu_get_aio_context() &&
+        ctx != qemu_get_current_aio_context()) {
+        aio_notify(ctx);
+    }
     aio_wait_kick();
 }
 
@@ -1798,6 +1809,15 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     return bdrv_co_preadv_part(child, offset, bytes, qiov, 0, flags);
 }
 
+/* Count the latency of a request that started at @start_ns */
+static void bdrv_latency_account(BlockDriverState *bs, enum BlockAcctType type,
+                                 int64_t start_ns)
+{
+    block_latency_log_account(&bs->latency_log_histogram[type],
+                              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                              start_ns);
+}
+
 int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset,
@@ -1806,6 +1826,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t start_ns;
     int ret;
 
     trace_bdrv_co_preadv_part(bs, offset, bytes, flags);
@@ -1832,6 +1853,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     /* Don't do copy-on-read if we read data before write operation */
     if (qatomic_read(&bs->copy_on_read)) {
@@ -1852,6 +1874,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     bdrv_padding_destroy(&pad);
 
 fail:
+    bdrv_latency_account(bs, BLOCK_ACCT_READ, start_ns);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2035,6 +2058,13 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    /* Even failed requests may have changed the allocation status */
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_block_status_cache_clear(bs);
+    } else if (req->bytes) {
+        bdrv_block_status_cache_invalidate(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2234,6 +2264,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t start_ns;
     int ret;
     bool padded = false;
 
@@ -2281,6 +2312,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
@@ -2307,6 +2339,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    bdrv_latency_account(bs, BLOCK_ACCT_WRITE, start_ns);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2358,6 +2391,224 @@ int bdrv_flush_all(void)
     return result;
 }
 
+/*
+ * Only so many extents are cached per node.  Once the cache is full, new
+ * results are not cached anymore until writes invalidate some extents, so
+ * that repeated scans of images with more extents still hit the beginning
+ * of the image instead of evicting each other.
+ */
+#define BDRV_BLOCK_STATUS_CACHE_MAX_EXTENTS 4096
+
+typedef struct BdrvBlockStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int status;                 /* without BDRV_BLOCK_EOF */
+    bool want_zero;
+    int64_t map;
+    BlockDriverState *file;
+} BdrvBlockStatusExtent;
+
+/* Overlapping extents compare equal, so lookups find any of them */
+static gint bdrv_block_status_extent_cmp(gconstpointer a, gconstpointer b,
+                                         gpointer opaque)
+{
+    const BdrvBlockStatusExtent *ea = a, *eb = b;
+
+    if (ea->offset + ea->bytes <= eb->offset) {
+        return -1;
+    } else if (eb->offset + eb->bytes <= ea->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Called with bsc->lock held */
+static void bdrv_block_status_cache_remove(BdrvBlockStatusCache *bsc,
+                                           int64_t offset, int64_t bytes)
+{
+    BdrvBlockStatusExtent key = { .offset = offset, .bytes = bytes };
+    BdrvBlockStatusExtent *e;
+
+    if (!bsc->extents) {
+        return;
+    }
+    while ((e = g_tree_lookup(bsc->extents, &key))) {
+        g_tree_remove(bsc->extents, e);
+    }
+}
+
+/*
+ * Drop the cached status of [offset, offset + bytes) in @bs, and make sure
+ * that block status queries that started before are not cached.
+ *
+ * Writing any part of a cluster allocates all of it, while cached extents
+ * may end in the middle of a cluster if that is where a query ended, so the
+ * range is rounded out to the allocation granularity of @bs.
+ */
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t offset, int64_t bytes)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    int64_t start;
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+    bsc->gen++;
+    if (bsc->granularity > 1) {
+        start = QEMU_ALIGN_DOWN(offset, bsc->granularity);
+        bytes = QEMU_ALIGN_UP(offset + bytes, bsc->granularity) - start;
+        offset = start;
+    }
+    bdrv_block_status_cache_remove(bsc, offset, bytes);
+}
+
+/*
+ * Drop the whole block status cache of @bs, for operations that change its
+ * allocation status without going through the request path, or that may
+ * make cached extents refer to other nodes.
+ */
+/* Called with bsc->lock held */
+static void bdrv_block_status_cache_do_clear(BdrvBlockStatusCache *bsc)
+{
+    bsc->gen++;
+    if (bsc->extents) {
+        g_tree_destroy(bsc->extents);
+        bsc->extents = NULL;
+    }
+}
+
+void bdrv_block_status_cache_clear(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+    bdrv_block_status_cache_do_clear(bsc);
+}
+
+/*
+ * Called when the permissions of @bs change, with @shared_perm the
+ * cumulative shared permissions of its parents.
+ *
+ * The status can only be cached if the driver allows it, and if nobody but
+ * the parents of @bs, whose writes invalidate the cache, may write to it.
+ * The decision is taken here rather than on every query, since the
+ * permissions may only be read under the BQL.
+ *
+ * The allocation granularity is the cluster size if the driver reports
+ * one, and at least the host page size otherwise, as an estimate of the
+ * block size of the host file system.
+ */
+void bdrv_block_status_cache_update(BlockDriverState *bs,
+                                    uint64_t shared_perm)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BlockDriverInfo bdi;
+    int64_t granularity;
+    bool enabled;
+
+    enabled = bs->drv && bs->drv->supports_block_status_cache &&
+              !(shared_perm & BLK_PERM_WRITE);
+    granularity = MAX(bs->bl.request_alignment, qemu_real_host_page_size);
+    if (enabled && bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+        granularity = MAX(granularity, bdi.cluster_size);
+    }
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+    /* Others may have been allowed to write to the node in the meantime */
+    bdrv_block_status_cache_do_clear(bsc);
+    bsc->granularity = granularity;
+    qatomic_set(&bsc->enabled, enabled);
+}
+
+/*
+ * Inactive nodes may be written by another process (e.g. the migration
+ * source), see bdrv_block_status_cache_update() for the rest.
+ */
+static bool bdrv_block_status_cache_usable(BlockDriverState *bs)
+{
+    return qatomic_read(&bs->block_status_cache.enabled) &&
+           !(bs->open_flags & BDRV_O_INACTIVE);
+}
+
+/*
+ * Cache a driver's block status result, unless the cache was invalidated
+ * since @gen was read: writes may have completed in the meantime.
+ */
+static void bdrv_block_status_cache_insert(BdrvBlockStatusCache *bsc,
+                                           uint64_t gen, bool want_zero,
+                                           int64_t offset, int64_t bytes,
+                                           int status, int64_t map,
+                                           BlockDriverState *file)
+{
+    BdrvBlockStatusExtent *e;
+
+    QEMU_LOCK_GUARD(&bsc->lock);
+
+    if (bsc->gen != gen) {
+        return;
+    }
+    if (!bsc->extents) {
+        bsc->extents = g_tree_new_full(bdrv_block_status_extent_cmp, NULL,
+                                       g_free, NULL);
+    }
+    bdrv_block_status_cache_remove(bsc, offset, bytes);
+    if (g_tree_nnodes(bsc->extents) >= BDRV_BLOCK_STATUS_CACHE_MAX_EXTENTS) {
+        return;
+    }
+
+    e = g_new(BdrvBlockStatusExtent, 1);
+    *e = (BdrvBlockStatusExtent) {
+        .offset = offset,
+        .bytes = bytes,
+        .status = status & ~BDRV_BLOCK_EOF,
+        .want_zero = want_zero,
+        .map = map,
+        .file = file,
+    };
+    g_tree_insert(bsc->extents, e, e);
+}
+
+/*
+ * Call the driver's .bdrv_co_block_status, or return the result of a
+ * previous call for the same range from the cache.
+ */
+static int coroutine_fn
+bdrv_co_driver_block_status(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file)
+{
+    BdrvBlockStatusCache *bsc = &bs->block_status_cache;
+    BdrvBlockStatusExtent key = { .offset = offset, .bytes = 1 };
+    BdrvBlockStatusExtent *e;
+    uint64_t gen = 0;
+    int ret;
+
+    if (!bdrv_block_status_cache_usable(bs)) {
+        return bs->drv->bdrv_co_block_status(bs, want_zero, offset, bytes,
+                                             pnum, map, file);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&bsc->lock) {
+        e = bsc->extents ? g_tree_lookup(bsc->extents, &key) : NULL;
+        /* A want_zero result is also good enough for !want_zero queries */
+        if (e && (e->want_zero || !want_zero)) {
+            *pnum = e->offset + e->bytes - offset;
+            *map = e->map + (offset - e->offset);
+            *file = e->file;
+            return e->status;
+        }
+        gen = bsc->gen;
+    }
+
+    ret = bs->drv->bdrv_co_block_status(bs, want_zero, offset, bytes,
+                                        pnum, map, file);
+    if (ret >= 0 && *pnum) {
+        bdrv_block_status_cache_insert(bsc, gen, want_zero, offset, *pnum,
+                                       ret, *map, *file);
+    }
+
+    return ret;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2447,9 +2698,9 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
     if (bs->drv->bdrv_co_block_status) {
-        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                            aligned_bytes, pnum, &local_map,
-                                            &local_file);
+        ret = bdrv_co_driver_block_status(bs, want_zero, aligned_offset,
+                                          aligned_bytes, pnum, &local_map,
+                                          &local_file);
     } else {
         /* Default code for filters */
 
@@ -2854,9 +3105,11 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     BdrvChild *primary_child = bdrv_primary_child(bs);
     BdrvChild *child;
     int current_gen;
+    int64_t start_ns;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     if (!bdrv_is_inserted(bs) || bdrv_is_read_only(bs) ||
         bdrv_is_sg(bs)) {
@@ -2968,6 +3221,7 @@ out:
     qemu_co_mutex_unlock(&bs->reqs_lock);
 
 early_exit:
+    bdrv_latency_account(bs, BLOCK_ACCT_FLUSH, start_ns);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -2978,6 +3232,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     BdrvTrackedRequest req;
     int max_pdiscard, ret;
     int head, tail, align;
+    int64_t start_ns;
     BlockDriverState *bs = child->bs;
 
     if (!bs || !bs->drv || !bdrv_is_inserted(bs)) {
@@ -3013,6 +3268,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     tail = (offset + bytes) % align;
 
     bdrv_inc_in_flight(bs);
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
 
     ret = bdrv_co_write_req_prepare(child, offset, bytes, &req, 0);
@@ -3083,6 +3339,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
 out:
     bdrv_co_write_req_finish(child, req.offset, req.bytes, &req, ret);
     tracked_request_end(&req);
+    bdrv_latency_account(bs, BLOCK_ACCT_UNMAP, start_ns);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -3178,7 +3435,8 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (qatomic_fetch_inc(&bs->io_plugged) == 0) {
+    if (qatomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -3191,7 +3449,8 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (qatomic_fetch_dec(&bs->io_plugged) == 1) {
+    if (qatomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
@@ -3345,6 +3604,89 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+bool coroutine_fn bdrv_co_can_sendfile(BdrvChild *child, int64_t offset,
+                                       int64_t bytes)
+{
+    BlockDriverState *bs = child ? child->bs : NULL;
+
+    if (!bs || !bdrv_is_inserted(bs) ||
+        bdrv_check_request32(offset, bytes, NULL, 0))
+    {
+        return false;
+    }
+
+    /* Copy-on-read needs the data in a buffer */
+    if (!bs->drv->bdrv_co_can_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read)) {
+        return false;
+    }
+
+    return bs->drv->bdrv_co_can_sendfile(bs, offset, bytes);
+}
+
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd)
+{
+    BlockDriverState *bs = child ? child->bs : NULL;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+
+    trace_bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    /* Copy-on-read needs the data in a buffer */
+    if (!bs->drv->bdrv_co_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_readahead(BdrvChild *child, int64_t offset,
+                                   int64_t bytes)
+{
+    BlockDriverState *bs = child ? child->bs : NULL;
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+
+    trace_bdrv_co_readahead(bs, offset, bytes);
+
+    if (!bs->drv->bdrv_co_readahead || bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    /* Nothing is returned, so no request needs to be tracked */
+    bdrv_inc_in_flight(bs);
+    ret = bs->drv->bdrv_co_readahead(bs, offset, bytes);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
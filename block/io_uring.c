@@ -10,17 +10,23 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
+#include "qemu/atomic.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
 #include "trace.h"
 
-/* io_uring ring size */
-#define MAX_ENTRIES 128
+/* Default io_uring ring size */
+#define DEFAULT_QUEUE_DEPTH 128
+
+/* Size of the registered file and buffer tables */
+#define MAX_FIXED_FILES 64
+#define MAX_FIXED_BUFS 16
 
 typedef struct LuringAIOCB {
     Coroutine *co;
@@ -50,6 +56,35 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    unsigned queue_depth;
+    bool sqpoll;
+    bool iopoll;
+
+    /*
+     * Whether the AioContext is busy polling for us: completions of an
+     * IORING_SETUP_IOPOLL ring are not signalled through the ring file
+     * descriptor, the kernel only finds them when asked to poll the devices.
+     * A kernel SQPOLL thread does that on its own.
+     */
+    bool busy_poll;
+
+    /*
+     * Registered files, so that the kernel does not have to look up the file
+     * descriptor for every request.  Free slots are -1.  The table is only
+     * modified under the BQL, with no request in flight for the file being
+     * (un)registered, and is looked up without locking on submission.
+     */
+    bool fixed_files;
+    int fixed_fds[MAX_FIXED_FILES];
+    unsigned fixed_fds_end;         /* one past the last used slot */
+
+    /*
+     * Registered buffers, so that the kernel does not have to map the pages
+     * of requests that lie within one of them.  Only used in the thread of
+     * @aio_context.
+     */
+    struct iovec fixed_bufs[MAX_FIXED_BUFS];
+    unsigned nr_fixed_bufs;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
@@ -58,6 +93,32 @@ typedef struct LuringState {
     QEMUBH *completion_bh;
 } LuringState;
 
+static void luring_iopoll(LuringState *s)
+{
+    if (s->iopoll && !s->sqpoll && s->io_q.in_flight &&
+        !io_uring_cq_ready(&s->ring)) {
+        /* Poll the devices once, without waiting */
+        syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+
+static void luring_update_busy_poll(LuringState *s)
+{
+    bool busy = s->iopoll && !s->sqpoll && s->io_q.in_flight;
+
+    if (busy == s->busy_poll) {
+        return;
+    }
+
+    s->busy_poll = busy;
+    if (busy) {
+        aio_context_inc_busy_poll(s->aio_context);
+    } else {
+        aio_context_dec_busy_poll(s->aio_context);
+    }
+}
+
 /**
  * luring_resubmit:
  *
@@ -89,7 +150,7 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     trace_luring_resubmit_short_read(s, luringcb, nread);
 
     /* Update read position */
-    luringcb->total_read = nread;
+    luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
     /* Shorten qiov */
@@ -102,8 +163,10 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
-    /* Update sqe */
-    luringcb->sqeq.off = nread;
+    /* Update sqe, a fixed buffer read becomes a vectored one */
+    luringcb->sqeq.opcode = IORING_OP_READV;
+    luringcb->sqeq.buf_index = 0;
+    luringcb->sqeq.off += nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
 
@@ -144,6 +207,8 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_iopoll(s);
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -219,6 +284,7 @@ end:
         }
     }
     qemu_bh_cancel(s->completion_bh);
+    luring_update_busy_poll(s);
 }
 
 static int ioq_submit(LuringState *s)
@@ -262,6 +328,7 @@ static int ioq_submit(LuringState *s)
          */
         luring_process_completions(s);
     }
+    luring_update_busy_poll(s);
     return ret;
 }
 
@@ -292,6 +359,8 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_iopoll(s);
+
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -326,6 +395,165 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor to register
+ *
+ * Add @fd to the registered files of the ring if there is room left and the
+ * kernel supports it.  Requests on @fd fall back to plain file descriptors
+ * otherwise.  Must be called under the BQL, with no request in flight on @fd.
+ */
+void luring_register_fd(LuringState *s, int fd)
+{
+    int slot = -1;
+    int ret;
+    unsigned i;
+
+    if (!s->fixed_files) {
+        return;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return;
+        }
+        if (slot < 0 && s->fixed_fds[i] == -1) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_register_fd(s, fd, slot, ret);
+    if (ret != 1) {
+        return;
+    }
+
+    qatomic_set(&s->fixed_fds[slot], fd);
+    if (slot >= s->fixed_fds_end) {
+        qatomic_set(&s->fixed_fds_end, slot + 1);
+    }
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor to unregister
+ *
+ * Must be called under the BQL, with no request in flight on @fd, before @fd
+ * is closed: the registered file keeps a reference to the open file.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int unused = -1;
+    unsigned i;
+
+    for (i = 0; i < s->fixed_fds_end; i++) {
+        if (s->fixed_fds[i] == fd) {
+            qatomic_set(&s->fixed_fds[i], -1);
+            trace_luring_register_fd(s, -1, i,
+                io_uring_register_files_update(&s->ring, i, &unused, 1));
+        }
+    }
+}
+
+static int luring_fixed_file_index(LuringState *s, int fd)
+{
+    unsigned end = qatomic_read(&s->fixed_fds_end);
+    unsigned i;
+
+    for (i = 0; i < end; i++) {
+        if (qatomic_read(&s->fixed_fds[i]) == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_update_fixed_bufs(LuringState *s)
+{
+    int ret;
+
+    /* Drops the previous registrations too, if any */
+    io_uring_unregister_buffers(&s->ring);
+    if (!s->nr_fixed_bufs) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs,
+                                    s->nr_fixed_bufs);
+    trace_luring_update_fixed_bufs(s, s->nr_fixed_bufs, ret);
+    if (ret < 0) {
+        /* Typically RLIMIT_MEMLOCK, just do without */
+        s->nr_fixed_bufs = 0;
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer that is going to be used for many requests, such as a
+ * bounce buffer.  Requests with a single I/O vector within a registered
+ * buffer are submitted as fixed buffer requests.  This is only an
+ * optimization: if the buffer cannot be registered, nothing changes.
+ *
+ * Must be called from the thread of the AioContext of @s, and the buffer
+ * must be unregistered from there before it is freed.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    if (s->aio_context != qemu_get_current_aio_context() ||
+        s->nr_fixed_bufs == MAX_FIXED_BUFS) {
+        return;
+    }
+
+    s->fixed_bufs[s->nr_fixed_bufs++] = (struct iovec) {
+        .iov_base = host,
+        .iov_len  = size,
+    };
+    luring_update_fixed_bufs(s);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    unsigned i;
+
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        if (s->fixed_bufs[i].iov_base == host) {
+            s->fixed_bufs[i] = s->fixed_bufs[--s->nr_fixed_bufs];
+            luring_update_fixed_bufs(s);
+            return;
+        }
+    }
+}
+
+static int luring_fixed_buf_index(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    unsigned i;
+
+    if (qiov->niov != 1 || !s->nr_fixed_bufs) {
+        return -1;
+    }
+
+    start = (uintptr_t)qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+    for (i = 0; i < s->nr_fixed_bufs; i++) {
+        uintptr_t buf = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (start >= buf && end <= buf + s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -342,15 +570,33 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int file_index = luring_fixed_file_index(s, fd);
+    int buf_index = -1;
+
+    if (type == QEMU_AIO_WRITE || type == QEMU_AIO_READ) {
+        buf_index = luring_fixed_buf_index(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len, offset,
+                                      buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len, offset,
+                                     buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -360,6 +606,10 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_index >= 0) {
+        sqes->fd = file_index;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -368,7 +618,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                            s->io_q.in_queue, s->io_q.in_flight);
     if (!s->io_q.blocked &&
         (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+         s->io_q.in_flight + s->io_q.in_queue >= s->queue_depth)) {
         ret = ioq_submit(s);
         trace_luring_do_submit_done(s, ret);
         return ret;
@@ -400,8 +650,21 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+/**
+ * luring_is_iopoll:
+ * @s: AIO state
+ *
+ * Returns: %true if completions of @s are polled, in which case only reads
+ * and writes on files opened with O_DIRECT can be submitted to it.
+ */
+bool luring_is_iopoll(LuringState *s)
+{
+    return s->iopoll;
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
+    assert(!s->busy_poll);
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
                        s);
     qemu_bh_delete(s->completion_bh);
@@ -416,21 +679,41 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned queue_depth, bool sqpoll, bool iopoll,
+                         Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {
+        .flags = (sqpoll ? IORING_SETUP_SQPOLL : 0) |
+                 (iopoll ? IORING_SETUP_IOPOLL : 0),
+    };
+    unsigned i;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    s->queue_depth = queue_depth ?: DEFAULT_QUEUE_DEPTH;
+    rc = io_uring_queue_init_params(s->queue_depth, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring%s%s",
+                         sqpoll ? " with submission queue polling" : "",
+                         iopoll ? " with completion polling" : "");
         g_free(s);
         return NULL;
     }
 
+    /* A sparse file table can be updated slot by slot (Linux 5.5+) */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    rc = io_uring_register_files(ring, s->fixed_fds, MAX_FIXED_FILES);
+    s->fixed_files = rc == 0;
+    s->sqpoll = sqpoll;
+    s->iopoll = iopoll;
+    trace_luring_init_params(s, s->queue_depth, sqpoll, iopoll,
+                             s->fixed_files);
+
     ioq_init(&s->io_q);
     return s;
 
@@ -24,10 +24,20 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 
+/*
+ * Initial limits for the background copy, they are then adapted to the
+ * target as described in mirror_adapt_limits().
+ */
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * The limits keep growing while the average write latency stays within
+ * this factor of the lowest one recently observed.
+ */
+#define MIRROR_LATENCY_TOLERANCE 2
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -76,6 +86,19 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+
+    /* Adapted limits of the background copy and their caps */
+    int max_in_flight;
+    int64_t max_io_bytes;
+    int max_in_flight_cap;
+    int64_t max_io_bytes_cap;
+    /* Target write latency statistics, in nanoseconds */
+    int window_writes;
+    bool window_failed;
+    int64_t window_latency_ns;
+    int64_t last_latency_ns;
+    int64_t min_latency_ns;
+
     int ret;
     bool unmap;
     int target_cluster_size;
@@ -232,9 +255,67 @@ static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
     mirror_iteration_done(op, ret);
 }
 
+/*
+ * Adapt the limits of the background copy to the target, AIMD-style.
+ *
+ * The writes to the target are accounted in windows of max_in_flight
+ * requests.  If the average latency of a window stays close to the lowest
+ * one observed, one more request is allowed in flight, or the requests are
+ * made twice as long once the in-flight cap is reached.  Otherwise, or if
+ * a write failed, the request length and then the number of requests are
+ * halved.  The reference latency slowly grows back so that a target which
+ * became permanently slower does not keep the limits at their minimum.
+ */
+static void mirror_adapt_limits(MirrorBlockJob *s, int64_t latency_ns,
+                                int ret)
+{
+    int64_t avg_ns;
+
+    if (ret < 0) {
+        s->window_failed = true;
+    }
+    s->window_latency_ns += latency_ns;
+    if (++s->window_writes < s->max_in_flight) {
+        return;
+    }
+
+    avg_ns = s->window_latency_ns / s->window_writes;
+    s->last_latency_ns = avg_ns;
+    s->window_writes = 0;
+    s->window_latency_ns = 0;
+
+    if (!s->min_latency_ns) {
+        s->min_latency_ns = avg_ns;
+    } else {
+        s->min_latency_ns = MIN(avg_ns,
+                                s->min_latency_ns + s->min_latency_ns / 8);
+    }
+
+    if (s->window_failed ||
+        avg_ns > s->min_latency_ns * MIRROR_LATENCY_TOLERANCE)
+    {
+        if (s->max_io_bytes > MAX(MAX_IO_BYTES, s->granularity)) {
+            s->max_io_bytes = MAX(s->max_io_bytes / 2, s->granularity);
+            /* Shorter requests complete faster, start over */
+            s->min_latency_ns = 0;
+        } else {
+            s->max_in_flight = MAX(s->max_in_flight / 2, 1);
+        }
+    } else if (s->max_in_flight < s->max_in_flight_cap) {
+        s->max_in_flight++;
+    } else if (s->max_io_bytes < s->max_io_bytes_cap) {
+        s->max_io_bytes = MIN(s->max_io_bytes * 2, s->max_io_bytes_cap);
+        s->min_latency_ns = 0;
+    }
+    s->window_failed = false;
+
+    trace_mirror_adapt_limits(s, avg_ns, s->max_in_flight, s->max_io_bytes);
+}
+
 static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
+    int64_t start_ns;
 
     if (ret < 0) {
         BlockErrorAction action;
@@ -249,7 +330,10 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    mirror_adapt_limits(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns,
+                        ret);
     mirror_write_complete(op, ret);
 }
 
@@ -476,7 +560,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_io_bytes;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -573,7 +657,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -833,7 +917,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1016,7 +1100,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1200,6 +1284,19 @@ static void mirror_cancel(Job *job, bool force)
     }
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_mirror = true;
+    info->mirror = g_new0(BlockJobInfoMirror, 1);
+    *info->mirror = (BlockJobInfoMirror) {
+        .max_in_flight = s->max_in_flight,
+        .chunk_size = s->max_io_bytes,
+        .write_latency_ns = s->last_latency_ns,
+    };
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(MirrorBlockJob),
@@ -1214,6 +1311,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1229,6 +1327,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1590,7 +1689,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             MirrorPerf *perf, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
@@ -1614,6 +1713,28 @@ static BlockJob *mirror_start_job(
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
 
+    if (perf->max_in_flight < 1) {
+        error_setg(errp, "max-in-flight must be greater than zero");
+        return NULL;
+    }
+
+    if (perf->max_in_flight > INT_MAX) {
+        error_setg(errp, "max-in-flight must not exceed %d", INT_MAX);
+        return NULL;
+    }
+
+    if (perf->max_chunk < 0) {
+        error_setg(errp, "max-chunk must be zero (which means no limit) or "
+                   "positive");
+        return NULL;
+    }
+
+    if (perf->max_chunk && perf->max_chunk < granularity) {
+        error_setg(errp, "Required max-chunk (%" PRIi64 ") is less than "
+                   "granularity (%" PRIu32 ")", perf->max_chunk, granularity);
+        return NULL;
+    }
+
     if (bdrv_skip_filters(bs) == bdrv_skip_filters(target)) {
         error_setg(errp, "Can't mirror node into itself");
         return NULL;
@@ -1749,6 +1870,16 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+
+    s->max_in_flight_cap = perf->max_in_flight;
+    s->max_io_bytes_cap = s->buf_size;
+    if (perf->max_chunk) {
+        s->max_io_bytes_cap = MIN(QEMU_ALIGN_DOWN(perf->max_chunk, granularity),
+                                  s->max_io_bytes_cap);
+    }
+    s->max_in_flight = MIN(MAX_IN_FLIGHT, s->max_in_flight_cap);
+    s->max_io_bytes = MIN(MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES),
+                          s->max_io_bytes_cap);
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1860,7 +1991,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, MirrorPerf *perf, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1877,7 +2008,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, perf, errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1887,6 +2018,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                               BlockCompletionFunc *cb, void *opaque,
                               bool auto_complete, Error **errp)
 {
+    MirrorPerf perf = { .max_in_flight = MIRROR_DEFAULT_MAX_IN_FLIGHT };
     bool base_read_only;
     BlockJob *job;
 
@@ -1904,7 +2036,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     &perf, errp);
     if (!job) {
         goto error_restore_flags;
     }
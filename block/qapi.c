@@ -424,7 +424,75 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
-static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
+/*
+ * Return the intervals of @hist from the first to the last non-empty one,
+ * or NULL if it is empty.
+ */
+static BlockLatencyHistogramInfo *
+bdrv_latency_log_histogram_info(BlockLatencyLogHistogram *hist)
+{
+    uint64_t bins[BLOCK_LOG_HIST_BUCKETS];
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries_tail, **bins_tail;
+    int first, last, i;
+
+    if (!block_latency_log_read(hist, bins)) {
+        return NULL;
+    }
+
+    for (first = 0; first < BLOCK_LOG_HIST_BUCKETS && !bins[first]; first++) {
+        /* skip empty buckets */
+    }
+    if (first == BLOCK_LOG_HIST_BUCKETS) {
+        return NULL;
+    }
+    for (last = BLOCK_LOG_HIST_BUCKETS - 1; !bins[last]; last--) {
+        /* skip empty buckets */
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries_tail = &info->boundaries;
+    bins_tail = &info->bins;
+
+    if (first > 0) {
+        QAPI_LIST_APPEND(boundaries_tail,
+                         block_latency_log_bucket_start(first));
+        QAPI_LIST_APPEND(bins_tail, 0);
+    }
+    for (i = first; i <= last; i++) {
+        QAPI_LIST_APPEND(bins_tail, bins[i]);
+        /* The last bucket also counts all longer latencies */
+        if (i + 1 < BLOCK_LOG_HIST_BUCKETS) {
+            QAPI_LIST_APPEND(boundaries_tail,
+                             block_latency_log_bucket_start(i + 1));
+        }
+    }
+    if (last + 1 < BLOCK_LOG_HIST_BUCKETS) {
+        QAPI_LIST_APPEND(bins_tail, 0);
+    }
+
+    return info;
+}
+
+static BlockLatencyLogHistograms *
+bdrv_latency_log_histograms(BlockLatencyLogHistogram *hist)
+{
+    BlockLatencyLogHistograms *h = g_new0(BlockLatencyLogHistograms, 1);
+
+    h->rd = bdrv_latency_log_histogram_info(&hist[BLOCK_ACCT_READ]);
+    h->has_rd = h->rd != NULL;
+    h->wr = bdrv_latency_log_histogram_info(&hist[BLOCK_ACCT_WRITE]);
+    h->has_wr = h->wr != NULL;
+    h->flush = bdrv_latency_log_histogram_info(&hist[BLOCK_ACCT_FLUSH]);
+    h->has_flush = h->flush != NULL;
+    h->unmap = bdrv_latency_log_histogram_info(&hist[BLOCK_ACCT_UNMAP]);
+    h->has_unmap = h->unmap != NULL;
+
+    return h;
+}
+
+static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk,
+                                 bool latency_histograms)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
@@ -502,10 +570,17 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    if (latency_histograms) {
+        ds->has_latency_log_histograms = true;
+        ds->latency_log_histograms =
+            bdrv_latency_log_histograms(stats->latency_log_histogram);
+    }
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
-                                        bool blk_level)
+                                        bool blk_level,
+                                        bool latency_histograms)
 {
     BdrvChild *parent_child;
     BlockDriverState *filter_or_cow_bs;
@@ -537,6 +612,12 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
         s->has_driver_specific = true;
     }
 
+    if (latency_histograms) {
+        s->has_node_latency_log_histograms = true;
+        s->node_latency_log_histograms =
+            bdrv_latency_log_histograms(bs->latency_log_histogram);
+    }
+
     parent_child = bdrv_primary_child(bs);
     if (!parent_child ||
         !(parent_child->role & (BDRV_CHILD_DATA | BDRV_CHILD_FILTERED)))
@@ -565,7 +646,8 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
     }
     if (parent_child) {
         s->has_parent = true;
-        s->parent = bdrv_query_bds_stats(parent_child->bs, blk_level);
+        s->parent = bdrv_query_bds_stats(parent_child->bs, blk_level,
+                                         latency_histograms);
     }
 
     filter_or_cow_bs = bdrv_filter_or_cow_bs(bs);
@@ -576,7 +658,8 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
          * be either)
          */
         s->has_backing = true;
-        s->backing = bdrv_query_bds_stats(filter_or_cow_bs, blk_level);
+        s->backing = bdrv_query_bds_stats(filter_or_cow_bs, blk_level,
+                                          latency_histograms);
     }
 
     return s;
@@ -613,19 +696,24 @@ BlockInfoList *qmp_query_block(Error **errp)
 
 BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
                                      bool query_nodes,
+                                     bool has_latency_histograms,
+                                     bool latency_histograms,
                                      Error **errp)
 {
     BlockStatsList *head = NULL, **tail = &head;
     BlockBackend *blk;
     BlockDriverState *bs;
 
+    latency_histograms = has_latency_histograms && latency_histograms;
+
     /* Just to be safe if query_nodes is not always initialized */
     if (has_query_nodes && query_nodes) {
         for (bs = bdrv_next_node(NULL); bs; bs = bdrv_next_node(bs)) {
             AioContext *ctx = bdrv_get_aio_context(bs);
 
             aio_context_acquire(ctx);
-            QAPI_LIST_APPEND(tail, bdrv_query_bds_stats(bs, false));
+            QAPI_LIST_APPEND(tail, bdrv_query_bds_stats(bs, false,
+                                                        latency_histograms));
             aio_context_release(ctx);
         }
     } else {
@@ -639,7 +727,7 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
             }
 
             aio_context_acquire(ctx);
-            s = bdrv_query_bds_stats(blk_bs(blk), true);
+            s = bdrv_query_bds_stats(blk_bs(blk), true, latency_histograms);
             s->has_device = true;
             s->device = g_strdup(blk_name(blk));
 
@@ -651,7 +739,7 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
                 g_free(qdev);
             }
 
-            bdrv_query_blk_stats(s->stats, blk);
+            bdrv_query_blk_stats(s->stats, blk, latency_histograms);
             aio_context_release(ctx);
 
             QAPI_LIST_APPEND(tail, s);
@@ -346,7 +346,18 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
 
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    /*
+     * Only the new table has to be on disk before the L1 entry points to
+     * it.  Writing back the whole L2 cache here would stall every other
+     * request on s->lock for as long as there are dirty tables.
+     */
+    ret = qcow2_cache_write_range(bs, s->l2_table_cache, l2_offset,
+                                  s->cluster_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
     if (ret < 0) {
         goto fail;
     }
@@ -1107,6 +1118,174 @@ err:
     return ret;
  }
 
+/*
+ * Prepare the data cluster at @host_offset, which the guest cluster at
+ * @offset maps to, for being shared: take a reference to it and clear
+ * QCOW_OFLAG_COPIED in the L2 entry of @offset, so that later writes to
+ * @offset allocate a new cluster instead of overwriting this one.
+ *
+ * Returns -EAGAIN if @offset does not map to @host_offset anymore.
+ */
+int qcow2_pin_cluster(BlockDriverState *bs, uint64_t offset,
+                      uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice, l2_entry;
+    int l2_index, ret;
+
+    assert(!has_subclusters(s));
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        (l2_entry & L2E_OFFSET_MASK) != host_offset)
+    {
+        ret = -EAGAIN;
+        goto out;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits, 1,
+                                        false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (l2_entry & QCOW_OFLAG_COPIED) {
+        if (qcow2_need_accurate_refcounts(s)) {
+            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                       s->refcount_block_cache);
+        }
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index, l2_entry & ~QCOW_OFLAG_COPIED);
+    }
+
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
+/*
+ * Set QCOW_OFLAG_COPIED in the L2 entry of the guest cluster at @offset if
+ * it maps to the data cluster at @host_offset, whose refcount must be 1, so
+ * that @offset can be overwritten in place again.
+ *
+ * Nothing is allocated: if the L2 table of @offset is shared with a
+ * snapshot, the data cluster is shared too and must keep the flag cleared.
+ *
+ * Returns 1 if @offset maps to @host_offset, 0 if it does not (or its L2
+ * table is shared), or a negative error code.
+ */
+int qcow2_set_cluster_copied(BlockDriverState *bs, uint64_t offset,
+                             uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t *l2_slice, l2_entry;
+    int l2_index, ret;
+
+    assert(!has_subclusters(s));
+
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED))
+    {
+        return 0;
+    }
+
+    ret = l2_load(bs, offset, s->l1_table[l1_index] & L1E_OFFSET_MASK,
+                  &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    ret = qcow2_get_cluster_type(bs, l2_entry) == QCOW2_CLUSTER_NORMAL &&
+          (l2_entry & L2E_OFFSET_MASK) == host_offset;
+    if (ret && !(l2_entry & QCOW_OFLAG_COPIED)) {
+        if (qcow2_need_accurate_refcounts(s)) {
+            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                       s->refcount_block_cache);
+        }
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index, l2_entry | QCOW_OFLAG_COPIED);
+    }
+
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
+/*
+ * Drop the reference taken by qcow2_pin_cluster().  If the guest cluster at
+ * @offset is the only user of @host_offset again, QCOW_OFLAG_COPIED is set
+ * back so that @offset can be overwritten in place.
+ */
+int qcow2_unpin_cluster(BlockDriverState *bs, uint64_t offset,
+                        uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount;
+    int ret;
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits, 1,
+                                        true, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0 || refcount != 1) {
+        return ret;
+    }
+
+    ret = qcow2_set_cluster_copied(bs, offset, host_offset);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Make the guest cluster at @offset map to the data cluster at @host_offset,
+ * which must have been pinned with qcow2_pin_cluster(); the reference taken
+ * there is handed over to @offset.  The cluster that @offset mapped to
+ * before is freed.
+ */
+int qcow2_link_shared_cluster(BlockDriverState *bs, uint64_t offset,
+                              uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice, old_l2_entry;
+    int l2_index, ret;
+
+    assert(!has_subclusters(s));
+    assert((host_offset & L2E_OFFSET_MASK) == host_offset);
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    if (old_l2_entry) {
+        qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_NEVER);
+    }
+
+    return 0;
+}
+
 /**
  * Frees the allocated clusters because the request failed and they won't
  * actually be linked.
@@ -0,0 +1,471 @@
+/*
+ * Deduplication of data clusters for the QCOW version 2 format
+ *
+ * When enabled, the fingerprint of each full cluster written by the guest
+ * is looked up in an in-memory index of recently written clusters.  If a
+ * cluster with the same content exists, the written cluster is mapped to
+ * it and its refcount is increased, like for clusters shared with internal
+ * snapshots, instead of allocating and writing a new one.  Images stay
+ * compatible with any qcow2 reader.
+ *
+ * The index only covers clusters written since the image was opened and is
+ * bounded in size; the oldest entries are replaced first.  Entries are not
+ * kept up to date when clusters are rewritten or freed, they are validated
+ * against the L2 tables and the data itself when they match.
+ *
+ * Shared clusters lack QCOW_OFLAG_COPIED.  When all guest clusters but one
+ * stop using a shared cluster, the flag must be set again on the last one,
+ * or writes to it would copy it and the image would be inconsistent.  A
+ * reverse map records which guest clusters were linked to each cluster
+ * shared since the image was opened, to find that last user.  The map is
+ * bounded to as many guest clusters as the index has entries.  When the
+ * last user of a cluster cannot be found that way (it was shared before
+ * the image was opened, or dropped from the map), the active L2 tables are
+ * walked to set the flag where needed, like after deleting a snapshot.
+ * That walk is deferred until the image is inactivated or deduplication
+ * is disabled.  Clusters that stop being shared while deduplication is
+ * disabled keep lacking the flag until "qemu-img check -r all".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DedupEntry {
+    uint64_t fingerprint;
+    uint64_t host_offset;       /* 0 if the entry is unused */
+    uint64_t guest_offset;
+} Qcow2DedupEntry;
+
+/* An in-place data write, during which its clusters must not be shared */
+typedef struct Qcow2DedupWrite {
+    uint64_t host_offset;
+    uint64_t bytes;
+    QLIST_ENTRY(Qcow2DedupWrite) next;
+} Qcow2DedupWrite;
+
+struct Qcow2DedupIndex {
+    /* Ring of entries, the oldest one is replaced first */
+    Qcow2DedupEntry *entries;
+    size_t nb_entries;
+    size_t next;
+
+    /* Maps a fingerprint to the newest entry that has it */
+    GHashTable *fingerprints;
+
+    /*
+     * Maps the host offset of a shared cluster to a GArray of the guest
+     * offsets that were linked to it.  Some of them may map elsewhere by
+     * now; the entry is dropped when the refcount falls to 1.
+     */
+    GHashTable *shared;
+    /* Number of guest offsets in @shared, at most nb_entries */
+    size_t nb_sharers;
+    /*
+     * Set when a cluster whose last user could not be found fell to a
+     * refcount of 1, until qcow2_dedup_fix_copied() walks the L2 tables
+     */
+    bool fix_copied;
+
+    QLIST_HEAD(, Qcow2DedupWrite) writes;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+Qcow2DedupIndex *qcow2_dedup_new(uint64_t index_size)
+{
+    Qcow2DedupIndex *d = g_new0(Qcow2DedupIndex, 1);
+
+    qcow2_dedup_resize(d, index_size);
+    d->shared = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                      (GDestroyNotify)g_array_unref);
+    QLIST_INIT(&d->writes);
+
+    return d;
+}
+
+/*
+ * Replace the index with an empty one of @index_size bytes.  The clusters
+ * shared so far are still tracked.  No write may be in flight.
+ */
+void qcow2_dedup_resize(Qcow2DedupIndex *d, uint64_t index_size)
+{
+    assert(QLIST_EMPTY(&d->writes));
+
+    if (d->fingerprints) {
+        g_hash_table_destroy(d->fingerprints);
+    }
+    g_free(d->entries);
+
+    d->nb_entries = MAX(index_size / sizeof(Qcow2DedupEntry), 1);
+    d->entries = g_new0(Qcow2DedupEntry, d->nb_entries);
+    d->next = 0;
+    d->fingerprints = g_hash_table_new(g_int64_hash, g_int64_equal);
+}
+
+void qcow2_dedup_free(Qcow2DedupIndex *d)
+{
+    if (!d) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&d->writes));
+    g_hash_table_destroy(d->fingerprints);
+    g_hash_table_destroy(d->shared);
+    g_free(d->entries);
+    g_free(d);
+}
+
+void qcow2_dedup_get_stats(Qcow2DedupIndex *d, Qcow2DedupStats *stats)
+{
+    *stats = (Qcow2DedupStats) {
+        .index_size = d->nb_entries,
+        .hits = d->hits,
+        .misses = d->misses,
+    };
+}
+
+static void qcow2_dedup_remove(Qcow2DedupIndex *d, Qcow2DedupEntry *e)
+{
+    if (g_hash_table_lookup(d->fingerprints, &e->fingerprint) == e) {
+        g_hash_table_remove(d->fingerprints, &e->fingerprint);
+    }
+    e->host_offset = 0;
+}
+
+static void qcow2_dedup_insert(Qcow2DedupIndex *d, uint64_t fingerprint,
+                               uint64_t host_offset, uint64_t guest_offset)
+{
+    Qcow2DedupEntry *e = &d->entries[d->next];
+
+    d->next = (d->next + 1) % d->nb_entries;
+    if (e->host_offset) {
+        qcow2_dedup_remove(d, e);
+    }
+
+    *e = (Qcow2DedupEntry) {
+        .fingerprint = fingerprint,
+        .host_offset = host_offset,
+        .guest_offset = guest_offset,
+    };
+    g_hash_table_replace(d->fingerprints, &e->fingerprint, e);
+}
+
+static void qcow2_dedup_untrack(Qcow2DedupIndex *d, uint64_t host_offset)
+{
+    GArray *sharers = g_hash_table_lookup(d->shared, &host_offset);
+
+    if (sharers) {
+        d->nb_sharers -= sharers->len;
+        g_hash_table_remove(d->shared, &host_offset);
+    }
+}
+
+static void qcow2_dedup_add_sharer(Qcow2DedupIndex *d, uint64_t host_offset,
+                                   uint64_t guest_offset)
+{
+    GArray *sharers = g_hash_table_lookup(d->shared, &host_offset);
+    guint i;
+
+    if (sharers) {
+        for (i = 0; i < sharers->len; i++) {
+            if (g_array_index(sharers, uint64_t, i) == guest_offset) {
+                return;
+            }
+        }
+    }
+
+    if (d->nb_sharers >= d->nb_entries) {
+        /* An incomplete list could miss the last user, forget them all */
+        qcow2_dedup_untrack(d, host_offset);
+        return;
+    }
+
+    if (!sharers) {
+        sharers = g_array_new(false, false, sizeof(uint64_t));
+        g_hash_table_insert(d->shared, g_memdup(&host_offset,
+                                                sizeof(host_offset)),
+                            sharers);
+    }
+    g_array_append_val(sharers, guest_offset);
+    d->nb_sharers++;
+}
+
+/*
+ * Called with s->lock held, after a reference to the data cluster at
+ * @host_offset was dropped.  If the cluster has a single user left, set
+ * QCOW_OFLAG_COPIED back in its L2 entry, or have qcow2_dedup_fix_copied()
+ * do it if that user is not known.
+ */
+void qcow2_dedup_cluster_released(BlockDriverState *bs, uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *d = s->dedup;
+    GArray *sharers;
+    uint64_t refcount;
+    bool found = false;
+    guint i;
+    int ret;
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0 || refcount > 1) {
+        return;
+    }
+
+    sharers = g_hash_table_lookup(d->shared, &host_offset);
+    if (sharers) {
+        g_array_ref(sharers);
+        qcow2_dedup_untrack(d, host_offset);
+
+        /* Only the remaining user still maps to @host_offset */
+        for (i = 0; refcount == 1 && !found && i < sharers->len; i++) {
+            ret = qcow2_set_cluster_copied(bs,
+                                           g_array_index(sharers, uint64_t, i),
+                                           host_offset);
+            if (ret < 0) {
+                break;
+            }
+            found = ret;
+        }
+        g_array_unref(sharers);
+    }
+
+    /*
+     * The remaining user may also be a snapshot, which doesn't need the
+     * flag; the walk then leaves everything as it is.
+     */
+    if (refcount == 1 && !found) {
+        d->fix_copied = true;
+    }
+    trace_qcow2_dedup_cluster_released(qemu_coroutine_self(), host_offset,
+                                       refcount, found, ret);
+}
+
+/*
+ * Set QCOW_OFLAG_COPIED on the clusters that stopped being shared without
+ * their last user being found, by walking the active L2 tables.  No request
+ * may be in flight.
+ */
+int qcow2_dedup_fix_copied(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *d = s->dedup;
+    int ret;
+
+    if (!d || !d->fix_copied) {
+        return 0;
+    }
+
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size,
+                                         0);
+    trace_qcow2_dedup_fix_copied(bs, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    d->fix_copied = false;
+    return 0;
+}
+
+/*
+ * Called with s->lock held, when an in-place write of @bytes at
+ * @host_offset is about to be submitted.
+ */
+void qcow2_dedup_write_begin(BDRVQcow2State *s, uint64_t host_offset,
+                             uint64_t bytes)
+{
+    Qcow2DedupWrite *w = g_new(Qcow2DedupWrite, 1);
+
+    *w = (Qcow2DedupWrite) {
+        .host_offset = host_offset,
+        .bytes = bytes,
+    };
+    QLIST_INSERT_HEAD(&s->dedup->writes, w, next);
+}
+
+/* Called with s->lock held, once the write has completed */
+void qcow2_dedup_write_end(BDRVQcow2State *s, uint64_t host_offset,
+                           uint64_t bytes)
+{
+    Qcow2DedupWrite *w;
+
+    QLIST_FOREACH(w, &s->dedup->writes, next) {
+        if (w->host_offset == host_offset && w->bytes == bytes) {
+            QLIST_REMOVE(w, next);
+            g_free(w);
+            return;
+        }
+    }
+    abort();
+}
+
+/* Whether the data cluster at @host_offset is being written in place */
+static bool qcow2_dedup_write_in_flight(BDRVQcow2State *s,
+                                        uint64_t host_offset)
+{
+    Qcow2DedupWrite *w;
+
+    QLIST_FOREACH(w, &s->dedup->writes, next) {
+        if (host_offset < w->host_offset + w->bytes &&
+            w->host_offset < host_offset + s->cluster_size)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Whether the guest cluster at @offset may be remapped: no cluster
+ * allocation for it may be in flight, and the cluster it currently maps to
+ * must not be written in place.
+ */
+static int qcow2_dedup_can_remap(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m;
+    QCow2SubclusterType type;
+    unsigned int bytes = s->cluster_size;
+    uint64_t host_offset;
+    int ret;
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (offset < m->offset + ((uint64_t)m->nb_clusters << s->cluster_bits)
+            && m->offset < offset + s->cluster_size)
+        {
+            return 0;
+        }
+    }
+
+    ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((type == QCOW2_SUBCLUSTER_NORMAL ||
+         type == QCOW2_SUBCLUSTER_ZERO_ALLOC) &&
+        qcow2_dedup_write_in_flight(s, host_offset))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Try to write the full cluster at guest offset @offset, whose data is in
+ * @qiov at @qiov_offset, by sharing an existing cluster with the same
+ * content.  The fingerprint of the data is stored in @fingerprint.
+ *
+ * Returns 1 if the cluster was deduplicated, 0 if the caller must write it
+ * normally and then call qcow2_dedup_co_record(), or a negative error code.
+ */
+int coroutine_fn qcow2_dedup_co_write_cluster(BlockDriverState *bs,
+                                              uint64_t offset,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              uint64_t *fingerprint)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *d = s->dedup;
+    Qcow2DedupEntry *e;
+    uint64_t host_offset = 0, guest_offset = 0;
+    uint8_t *data, *buf = NULL;
+    bool pinned = false;
+    int ret;
+
+    assert(!offset_into_cluster(s, offset));
+
+    data = qemu_blockalign(bs, s->cluster_size);
+    qemu_iovec_to_buf(qiov, qiov_offset, data, s->cluster_size);
+
+    ret = qcow2_co_fingerprint(bs, data, s->cluster_size, fingerprint);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    e = g_hash_table_lookup(d->fingerprints, fingerprint);
+    if (e && e->guest_offset != offset &&
+        !qcow2_dedup_write_in_flight(s, e->host_offset))
+    {
+        host_offset = e->host_offset;
+        guest_offset = e->guest_offset;
+        ret = qcow2_pin_cluster(bs, guest_offset, host_offset);
+        if (ret == -EAGAIN) {
+            /* The cluster was rewritten or freed since */
+            qcow2_dedup_remove(d, e);
+            ret = 0;
+        } else if (ret == 0) {
+            pinned = true;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!pinned) {
+        goto out;
+    }
+
+    /* The fingerprint is not enough, the data must be the same */
+    buf = qemu_blockalign(bs, s->cluster_size);
+    ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size, buf, 0);
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret == 0 && !memcmp(buf, data, s->cluster_size)) {
+        ret = qcow2_dedup_can_remap(bs, offset);
+        if (ret > 0) {
+            ret = qcow2_link_shared_cluster(bs, offset, host_offset);
+            if (ret == 0) {
+                qcow2_dedup_add_sharer(d, host_offset, guest_offset);
+                qcow2_dedup_add_sharer(d, host_offset, offset);
+                pinned = false;
+                ret = 1;
+            }
+        }
+    }
+    if (pinned) {
+        int unpin_ret = qcow2_unpin_cluster(bs, guest_offset, host_offset);
+
+        if (ret >= 0) {
+            ret = unpin_ret;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+out:
+    trace_qcow2_dedup_write_cluster(qemu_coroutine_self(), offset,
+                                    *fingerprint, host_offset, ret);
+    if (ret == 1) {
+        d->hits++;
+    } else if (ret == 0) {
+        d->misses++;
+    }
+    qemu_vfree(buf);
+    qemu_vfree(data);
+    return ret;
+}
+
+/*
+ * Add the cluster at guest offset @offset, which was just written normally
+ * with data of fingerprint @fingerprint, to the index.
+ */
+void coroutine_fn qcow2_dedup_co_record(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t fingerprint)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCow2SubclusterType type;
+    unsigned int bytes = s->cluster_size;
+    uint64_t host_offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
+    if (ret == 0 && type == QCOW2_SUBCLUSTER_NORMAL) {
+        qcow2_dedup_insert(s->dedup, fingerprint, host_offset, offset);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
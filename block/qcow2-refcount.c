@@ -1193,6 +1193,9 @@ void qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
         } else {
             qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
                                 s->cluster_size, type);
+            if (s->dedup) {
+                qcow2_dedup_cluster_released(bs, l2_entry & L2E_OFFSET_MASK);
+            }
         }
         break;
     case QCOW2_CLUSTER_ZERO_PLAIN:
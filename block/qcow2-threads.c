@@ -1,5 +1,5 @@
 /*
- * Threaded data processing for Qcow2: compression, encryption
+ * Threaded data processing for Qcow2: compression, encryption, deduplication
  *
  * Copyright (c) 2004-2006 Fabrice Bellard
  * Copyright (c) 2018 Virtuozzo International GmbH. All rights reserved.
@@ -36,13 +36,14 @@
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
     while (s->nb_threads >= QCOW2_MAX_THREADS) {
@@ -525,3 +526,58 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+
+/*
+ * Deduplication
+ */
+
+typedef struct Qcow2FingerprintData {
+    const void *buf;
+    size_t len;
+    uint64_t fingerprint;
+} Qcow2FingerprintData;
+
+static int qcow2_fingerprint_pool_func(void *opaque)
+{
+    Qcow2FingerprintData *data = opaque;
+    uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, data->buf, data->len,
+                           &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+
+    assert(result_len >= sizeof(data->fingerprint));
+    data->fingerprint = ldq_be_p(result);
+    g_free(result);
+
+    return 0;
+}
+
+/*
+ * qcow2_co_fingerprint()
+ *
+ * Compute a 64-bit fingerprint of @len bytes of data, used to find
+ * clusters that can be deduplicated.  Equal fingerprints make equal data
+ * very likely, but callers must still compare the data itself.
+ *
+ * Returns: 0 on success
+ *          a negative error code on failure
+ */
+int coroutine_fn
+qcow2_co_fingerprint(BlockDriverState *bs, const void *buf, size_t len,
+                     uint64_t *fingerprint)
+{
+    Qcow2FingerprintData arg = {
+        .buf = buf,
+        .len = len,
+    };
+    int ret;
+
+    ret = qcow2_co_process(bs, qcow2_fingerprint_pool_func, &arg);
+    *fingerprint = arg.fingerprint;
+
+    return ret;
+}
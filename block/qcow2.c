@@ -697,6 +697,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DEDUP_INDEX_SIZE,
     NULL
 };
 
@@ -808,6 +809,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DEDUP_INDEX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cluster deduplication index "
+                    "(0 to disable deduplication)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -826,14 +833,36 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
 };
 
-static void cache_clean_timer_cb(void *opaque)
+static void coroutine_fn cache_clean_co(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
     qcow2_cache_clean_unused(s->l2_table_cache);
     qcow2_cache_clean_unused(s->refcount_block_cache);
+    qemu_co_mutex_unlock(&s->lock);
+
     timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               (int64_t) s->cache_clean_interval * 1000);
+    bdrv_dec_in_flight(bs);
+}
+
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co;
+
+    /*
+     * The caches may be in use by requests running in other threads when
+     * the node is served by several iothreads, so they must be cleaned
+     * under s->lock.  The in-flight reference keeps the timer alive until
+     * the coroutine has rearmed it: the timer is only deleted in a drained
+     * section.
+     */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(cache_clean_co, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
 }
 
 static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
@@ -969,6 +998,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t dedup_index_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1070,6 +1100,29 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    r->dedup_index_size = qemu_opt_get_size(opts, QCOW2_OPT_DEDUP_INDEX_SIZE,
+                                            0);
+    if (r->dedup_index_size) {
+        /*
+         * Shared clusters must have the same data for every guest offset
+         * that maps to them, and must be readable from the image file.
+         */
+        if (s->crypt_method_header != QCOW_CRYPT_NONE ||
+            (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE) ||
+            has_subclusters(s))
+        {
+            error_setg(errp, QCOW2_OPT_DEDUP_INDEX_SIZE " is not supported "
+                       "with encryption, external data files or subclusters");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (r->dedup_index_size > SIZE_MAX / 2) {
+            error_setg(errp, "Deduplication index size too big");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1225,6 +1278,23 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    /*
+     * The node is drained, so no write depends on the old index.  Keep
+     * tracking the shared clusters if deduplication stays enabled;
+     * qcow2_reopen_prepare() fixed their flags if it is disabled.
+     */
+    if (s->dedup_index_size != r->dedup_index_size) {
+        s->dedup_index_size = r->dedup_index_size;
+        if (!s->dedup_index_size) {
+            qcow2_dedup_free(s->dedup);
+            s->dedup = NULL;
+        } else if (s->dedup) {
+            qcow2_dedup_resize(s->dedup, s->dedup_index_size);
+        } else {
+            s->dedup = qcow2_dedup_new(s->dedup_index_size);
+        }
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1858,6 +1928,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_dedup_free(s->dedup);
+    s->dedup = NULL;
     return ret;
 }
 
@@ -1911,6 +1983,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     return qoc.ret;
 }
 
+static int qcow2_compress_batch_clusters(BDRVQcow2State *s)
+{
+    return MAX(1, MIN(QCOW2_COMPRESS_BATCH,
+                      QCOW2_COMPRESS_BATCH_SIZE / s->cluster_size));
+}
+
 static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1921,6 +1999,10 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
     }
     bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
+    if (!has_data_file(bs)) {
+        bs->bl.max_pwrite_compressed = qcow2_compress_batch_clusters(s) *
+                                       s->cluster_size;
+    }
 }
 
 static int qcow2_reopen_prepare(BDRVReopenState *state,
@@ -1939,6 +2021,16 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    /* Clusters that stop being shared later won't be noticed any more */
+    if (!r->dedup_index_size || !(state->flags & BDRV_O_RDWR)) {
+        ret = qcow2_dedup_fix_copied(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to set the copied flag of "
+                             "clusters that are no longer shared");
+            goto fail;
+        }
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -2577,6 +2669,9 @@ out_unlocked:
 
 out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
+    if (s->dedup) {
+        qcow2_dedup_write_end(s, host_offset, bytes);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     qemu_vfree(crypt_buf);
@@ -2595,7 +2690,7 @@ static coroutine_fn int qcow2_co_pwritev_task_entry(AioTask *task)
                                  t->l2meta);
 }
 
-static coroutine_fn int qcow2_co_pwritev_part(
+static coroutine_fn int qcow2_co_do_pwritev_part(
         BlockDriverState *bs, uint64_t offset, uint64_t bytes,
         QEMUIOVector *qiov, size_t qiov_offset, int flags)
 {
@@ -2636,6 +2731,11 @@ static coroutine_fn int qcow2_co_pwritev_part(
             goto out_locked;
         }
 
+        /* Ended by qcow2_co_pwritev_task() */
+        if (s->dedup) {
+            qcow2_dedup_write_begin(s, host_offset, cur_bytes);
+        }
+
         qemu_co_mutex_unlock(&s->lock);
 
         if (!aio && cur_bytes != bytes) {
@@ -2677,6 +2777,117 @@ fail_nometa:
     return ret;
 }
 
+/*
+ * Write @nb_clusters full clusters that could not be deduplicated, and add
+ * them to the deduplication index.
+ */
+static coroutine_fn int qcow2_co_pwritev_dedup_run(
+        BlockDriverState *bs, uint64_t offset, uint64_t nb_clusters,
+        QEMUIOVector *qiov, size_t qiov_offset, int flags,
+        const uint64_t *fingerprints)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    if (!nb_clusters) {
+        return 0;
+    }
+
+    ret = qcow2_co_do_pwritev_part(bs, offset, nb_clusters << s->cluster_bits,
+                                   qiov, qiov_offset, flags);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        qcow2_dedup_co_record(bs, offset + (i << s->cluster_bits),
+                              fingerprints[i]);
+    }
+    return 0;
+}
+
+static coroutine_fn int qcow2_co_pwritev_part(
+        BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+        QEMUIOVector *qiov, size_t qiov_offset, int flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end, nb_clusters, run_start, i;
+    uint64_t *fingerprints;
+    int ret;
+
+    if (!s->dedup) {
+        return qcow2_co_do_pwritev_part(bs, offset, bytes, qiov, qiov_offset,
+                                        flags);
+    }
+
+    /* Only full clusters can be deduplicated */
+    start = ROUND_UP(offset, s->cluster_size);
+    end = QEMU_ALIGN_DOWN(offset + bytes, s->cluster_size);
+    if (start >= end) {
+        return qcow2_co_do_pwritev_part(bs, offset, bytes, qiov, qiov_offset,
+                                        flags);
+    }
+
+    if (start > offset) {
+        ret = qcow2_co_do_pwritev_part(bs, offset, start - offset,
+                                       qiov, qiov_offset, flags);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /*
+     * Clusters that are not deduplicated are collected into runs starting
+     * at index run_start, which are written with a single request.
+     */
+    nb_clusters = (end - start) >> s->cluster_bits;
+    fingerprints = g_new(uint64_t, nb_clusters);
+    run_start = 0;
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t cluster_offset = start + (i << s->cluster_bits);
+
+        ret = qcow2_dedup_co_write_cluster(bs, cluster_offset, qiov,
+                                           qiov_offset + cluster_offset -
+                                           offset,
+                                           &fingerprints[i]);
+        if (ret < 0) {
+            goto out;
+        } else if (ret == 0) {
+            continue;
+        }
+
+        ret = qcow2_co_pwritev_dedup_run(bs,
+                                         start + (run_start << s->cluster_bits),
+                                         i - run_start, qiov,
+                                         qiov_offset + start - offset +
+                                         (run_start << s->cluster_bits),
+                                         flags, &fingerprints[run_start]);
+        if (ret < 0) {
+            goto out;
+        }
+        run_start = i + 1;
+    }
+
+    ret = qcow2_co_pwritev_dedup_run(bs, start + (run_start << s->cluster_bits),
+                                     nb_clusters - run_start, qiov,
+                                     qiov_offset + start - offset +
+                                     (run_start << s->cluster_bits),
+                                     flags, &fingerprints[run_start]);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (end < offset + bytes) {
+        ret = qcow2_co_do_pwritev_part(bs, end, offset + bytes - end, qiov,
+                                       qiov_offset + end - offset, flags);
+    }
+
+out:
+    g_free(fingerprints);
+    return ret;
+}
+
 static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2691,6 +2902,13 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_dedup_fix_copied(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to set the copied flag of clusters that are no "
+                     "longer shared: %s", strerror(-ret));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2731,6 +2949,9 @@ static void qcow2_close(BlockDriverState *bs)
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
 
+    qcow2_dedup_free(s->dedup);
+    s->dedup = NULL;
+
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
@@ -4145,10 +4366,16 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
             goto fail;
         }
 
+        if (s->dedup) {
+            qcow2_dedup_write_begin(s, host_offset, cur_bytes);
+        }
         qemu_co_mutex_unlock(&s->lock);
         ret = bdrv_co_copy_range_to(src, src_offset, s->data_file, host_offset,
                                     cur_bytes, read_flags, write_flags);
         qemu_co_mutex_lock(&s->lock);
+        if (s->dedup) {
+            qcow2_dedup_write_end(s, host_offset, cur_bytes);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -4550,80 +4777,173 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2CompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    uint64_t bytes;
+    uint8_t *out_buf;
+    ssize_t *out_len;
+} Qcow2CompressTask;
+
+static coroutine_fn int qcow2_co_compress_task_entry(AioTask *task)
+{
+    Qcow2CompressTask *t = container_of(task, Qcow2CompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint8_t *buf;
+
+    buf = qemu_blockalign(t->bs, s->cluster_size);
+    if (t->bytes < s->cluster_size) {
+        /* Zero-pad last write if image size is not cluster aligned */
+        memset(buf + t->bytes, 0, s->cluster_size - t->bytes);
+    }
+    qemu_iovec_to_buf(t->qiov, t->qiov_offset, buf, t->bytes);
+
+    *t->out_len = qcow2_co_compress(t->bs, t->out_buf, s->cluster_size - 1,
+                                    buf, s->cluster_size);
+    qemu_vfree(buf);
+
+    /* -ENOMEM means incompressible, the cluster is written normally */
+    if (*t->out_len < 0 && *t->out_len != -ENOMEM) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Write a batch of at most qcow2_compress_batch_clusters() clusters
+ * compressed.
+ *
+ * All clusters are compressed in parallel first.  They are then allocated
+ * one after the other with a single s->lock section, which packs them in
+ * guest order into the same host clusters and updates their L2 entries
+ * together.  Finally the compressed data is written with one request per
+ * contiguous host range instead of one request per cluster.
+ */
 static coroutine_fn int
-qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
-                                 uint64_t offset, uint64_t bytes,
-                                 QEMUIOVector *qiov, size_t qiov_offset)
+qcow2_co_pwritev_compressed_batch(BlockDriverState *bs,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
-    ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
+    int nb_clusters = DIV_ROUND_UP(bytes, s->cluster_size);
+    uint8_t *out_buf[QCOW2_COMPRESS_BATCH] = { NULL };
+    ssize_t out_len[QCOW2_COMPRESS_BATCH];
+    uint64_t host_offset[QCOW2_COMPRESS_BATCH];
+    AioTaskPool *aio = NULL;
+    QEMUIOVector hd_qiov;
+    int i, j, k, ret = 0;
 
-    assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
-           (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
+    assert(nb_clusters <= qcow2_compress_batch_clusters(s));
 
-    buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes < s->cluster_size) {
-        /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+    if (nb_clusters > 1) {
+        aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
 
-    out_buf = g_malloc(s->cluster_size);
+    for (i = 0; i < nb_clusters && aio_task_pool_status(aio) == 0; i++) {
+        Qcow2CompressTask local_task;
+        Qcow2CompressTask *t = aio ? g_new(Qcow2CompressTask, 1) : &local_task;
+        uint64_t cluster_bytes = MIN(bytes - i * s->cluster_size,
+                                     s->cluster_size);
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
-                                buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
-        if (ret < 0) {
-            goto fail;
+        out_buf[i] = g_malloc(s->cluster_size);
+        *t = (Qcow2CompressTask) {
+            .task.func = qcow2_co_compress_task_entry,
+            .bs = bs,
+            .qiov = qiov,
+            .qiov_offset = qiov_offset + i * s->cluster_size,
+            .bytes = cluster_bytes,
+            .out_buf = out_buf[i],
+            .out_len = &out_len[i],
+        };
+
+        if (!aio) {
+            ret = qcow2_co_compress_task_entry(&t->task);
+        } else {
+            aio_task_pool_start_task(aio, &t->task);
         }
-        goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        g_free(aio);
+    }
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
         goto fail;
     }
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
+    trace_qcow2_compressed_batch(qemu_coroutine_self(), offset, nb_clusters);
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        if (out_len[i] < 0) {
+            continue;
+        }
+        ret = qcow2_alloc_compressed_cluster_offset(bs,
+                                                    offset + i * s->cluster_size,
+                                                    out_len[i],
+                                                    &host_offset[i]);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto fail;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0, host_offset[i], out_len[i],
+                                            true);
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto fail;
+        }
     }
+    qemu_co_mutex_unlock(&s->lock);
 
-    BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
+    for (i = 0; i < nb_clusters; i = j) {
+        if (out_len[i] < 0) {
+            /* could not compress: write normal cluster */
+            ret = qcow2_co_pwritev_part(bs, offset + i * s->cluster_size,
+                                        MIN(bytes - i * s->cluster_size,
+                                            s->cluster_size),
+                                        qiov, qiov_offset + i * s->cluster_size,
+                                        0);
+            if (ret < 0) {
+                goto fail;
+            }
+            j = i + 1;
+            continue;
+        }
+
+        for (j = i + 1; j < nb_clusters; j++) {
+            if (out_len[j] < 0 ||
+                host_offset[j] != host_offset[j - 1] + out_len[j - 1])
+            {
+                break;
+            }
+        }
+
+        qemu_iovec_init(&hd_qiov, j - i);
+        for (k = i; k < j; k++) {
+            qemu_iovec_add(&hd_qiov, out_buf[k], out_len[k]);
+        }
+
+        BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(s->data_file, host_offset[i], hd_qiov.size,
+                              &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        if (ret < 0) {
+            goto fail;
+        }
     }
-success:
     ret = 0;
+
 fail:
-    qemu_vfree(buf);
-    g_free(out_buf);
+    for (i = 0; i < nb_clusters; i++) {
+        g_free(out_buf[i]);
+    }
     return ret;
 }
 
-static coroutine_fn int qcow2_co_pwritev_compressed_task_entry(AioTask *task)
-{
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
-
-    assert(!t->subcluster_type && !t->l2meta);
-
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
-}
-
 /*
  * XXX: put compressed sectors first, then all the cluster aligned
  * tables to avoid losing bytes in alignment
@@ -4634,7 +4954,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    AioTaskPool *aio = NULL;
     int ret = 0;
 
     if (has_data_file(bs)) {
@@ -4663,15 +4982,13 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    while (bytes && aio_task_pool_status(aio) == 0) {
-        uint64_t chunk_size = MIN(bytes, s->cluster_size);
-
-        if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-        }
+    while (bytes) {
+        uint64_t chunk_size = MIN(bytes,
+                                  (uint64_t)qcow2_compress_batch_clusters(s) *
+                                  s->cluster_size);
 
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+        ret = qcow2_co_pwritev_compressed_batch(bs, offset, chunk_size,
+                                                qiov, qiov_offset);
         if (ret < 0) {
             break;
         }
@@ -4680,14 +4997,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         bytes -= chunk_size;
     }
 
-    if (aio) {
-        aio_task_pool_wait_all(aio);
-        if (ret == 0) {
-            ret = aio_task_pool_status(aio);
-        }
-        g_free(aio);
-    }
-
     return ret;
 }
 
@@ -5203,6 +5512,25 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new0(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->u.qcow2.refcount_cache);
+    if (s->dedup) {
+        stats->u.qcow2.dedup = g_new0(Qcow2DedupStats, 1);
+        qcow2_dedup_get_stats(s->dedup, stats->u.qcow2.dedup);
+    }
+
+    return stats;
+}
+
 static int qcow2_has_zero_init(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -5965,12 +6293,15 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .is_format                  = true,
     .supports_backing           = true,
+    .supports_multiqueue        = true,
+    .supports_block_status_cache = true,
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
@@ -71,6 +71,13 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/*
+ * Maximum number of clusters, and their total size, that are compressed
+ * concurrently and then allocated and written as one batch
+ */
+#define QCOW2_COMPRESS_BATCH 64
+#define QCOW2_COMPRESS_BATCH_SIZE (4 * MiB)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -150,6 +157,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DEDUP_INDEX_SIZE "dedup-index-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -324,6 +332,8 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+typedef struct Qcow2DedupIndex Qcow2DedupIndex;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -357,6 +367,13 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Protects the L1 table, the L2 and refcount block caches, the
+     * refcount table, cluster allocation (free_cluster_index,
+     * free_byte_offset) and the list of in-flight cluster allocations.
+     * Guest data I/O is done with the lock released, but all metadata
+     * updates, including allocating new clusters, are serialized on it.
+     */
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -420,6 +437,10 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /* Cluster deduplication, NULL if disabled; protected by lock */
+    Qcow2DedupIndex *dedup;
+    uint64_t dedup_index_size;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -916,6 +937,14 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                           uint64_t *host_offset);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+int qcow2_pin_cluster(BlockDriverState *bs, uint64_t offset,
+                      uint64_t host_offset);
+int qcow2_set_cluster_copied(BlockDriverState *bs, uint64_t offset,
+                             uint64_t host_offset);
+int qcow2_unpin_cluster(BlockDriverState *bs, uint64_t offset,
+                        uint64_t host_offset);
+int qcow2_link_shared_cluster(BlockDriverState *bs, uint64_t offset,
+                              uint64_t host_offset);
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, enum qcow2_discard_type type,
@@ -959,6 +988,8 @@ int qcow2_cache_destroy(Qcow2Cache *c);
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
 int qcow2_cache_write(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_write_range(BlockDriverState *bs, Qcow2Cache *c,
+                            uint64_t offset, uint64_t bytes);
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency);
 void qcow2_cache_depends_on_flush(Qcow2Cache *c);
@@ -973,6 +1004,7 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1010,5 +1042,27 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+int coroutine_fn
+qcow2_co_fingerprint(BlockDriverState *bs, const void *buf, size_t len,
+                     uint64_t *fingerprint);
+
+/* qcow2-dedup.c functions */
+Qcow2DedupIndex *qcow2_dedup_new(uint64_t index_size);
+void qcow2_dedup_resize(Qcow2DedupIndex *d, uint64_t index_size);
+void qcow2_dedup_free(Qcow2DedupIndex *d);
+void qcow2_dedup_get_stats(Qcow2DedupIndex *d, Qcow2DedupStats *stats);
+void qcow2_dedup_write_begin(BDRVQcow2State *s, uint64_t host_offset,
+                             uint64_t bytes);
+void qcow2_dedup_write_end(BDRVQcow2State *s, uint64_t host_offset,
+                           uint64_t bytes);
+int coroutine_fn qcow2_dedup_co_write_cluster(BlockDriverState *bs,
+                                              uint64_t offset,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              uint64_t *fingerprint);
+void coroutine_fn qcow2_dedup_co_record(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t fingerprint);
+void qcow2_dedup_cluster_released(BlockDriverState *bs, uint64_t host_offset);
+int qcow2_dedup_fix_copied(BlockDriverState *bs);
 
 #endif
@@ -1616,6 +1616,7 @@ static BlockDriver bdrv_qed = {
     .create_opts              = &qed_create_opts,
     .is_format                = true,
     .supports_backing         = true,
+    .supports_block_status_cache = true,
 
     .bdrv_probe               = bdrv_qed_probe,
     .bdrv_open                = bdrv_qed_open,
@@ -568,6 +568,39 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static bool coroutine_fn raw_co_can_sendfile(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes)
+{
+    if (raw_adjust_offset(bs, (uint64_t *)&offset, bytes, false)) {
+        return false;
+    }
+    return bdrv_co_can_sendfile(bs->file, offset, bytes);
+}
+
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, int out_fd)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, (uint64_t *)&offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_co_sendfile(bs->file, offset, bytes, out_fd);
+}
+
+static int coroutine_fn raw_co_readahead(BlockDriverState *bs, int64_t offset,
+                                         int64_t bytes)
+{
+    int ret;
+
+    ret = raw_adjust_offset(bs, (uint64_t *)&offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_co_readahead(bs->file, offset, bytes);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -597,10 +630,14 @@ BlockDriver bdrv_raw = {
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_co_can_sendfile = &raw_co_can_sendfile,
+    .bdrv_co_sendfile     = &raw_co_sendfile,
+    .bdrv_co_readahead    = &raw_co_readahead,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_getlength       = &raw_getlength,
     .is_format            = true,
     .has_variable_length  = true,
+    .supports_multiqueue  = true,
     .bdrv_measure         = &raw_measure,
     .bdrv_get_info        = &raw_get_info,
     .bdrv_refresh_limits  = &raw_refresh_limits,
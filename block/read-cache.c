@@ -0,0 +1,906 @@
+/*
+ * Persistent read cache filter
+ *
+ * Caches the data read from a slow image (typically on the network) in a
+ * local cache file, typically on an SSD.  The cache is bounded in size and
+ * evicts blocks with the CLOCK algorithm.  Its index is saved in the cache
+ * file when the node is closed cleanly, so that the cache is still warm
+ * after a restart.
+ *
+ * Writes go to the image and drop the cached blocks they overlap, so the
+ * image must only be modified through this filter.
+ *
+ * Layout of the cache file (all fields big-endian):
+ *
+ *   0:            header (ReadCacheHeader)
+ *   index_offset: one 64-bit entry per slot, 0 for an empty slot or
+ *                 (guest block number + 1)
+ *   data_offset:  one block of data per slot
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define READ_CACHE_MAGIC        0x5152434143484500ULL /* "QRCACHE\0" */
+#define READ_CACHE_VERSION      1
+
+/* The cache file was closed cleanly, its index is valid */
+#define READ_CACHE_FLAG_CLEAN   (1 << 0)
+
+#define READ_CACHE_HEADER_SIZE  4096
+
+/* Chunk size used to load and save the index */
+#define READ_CACHE_INDEX_CHUNK  (1 * MiB)
+
+#define READ_CACHE_MIN_BLOCK_SIZE   (4 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE   (2 * MiB)
+
+/* Number of concurrent sequential streams that are detected */
+#define READ_CACHE_STREAMS      8
+
+typedef struct QEMU_PACKED ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t block_size;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+} ReadCacheHeader;
+
+typedef struct ReadCacheStream {
+    uint64_t end;               /* end of the last read of the stream */
+    uint64_t len;               /* number of bytes read sequentially */
+} ReadCacheStream;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache_file;
+
+    uint64_t block_size;
+    int block_bits;
+    uint64_t nb_slots;
+    uint64_t sequential_cutoff;
+    uint64_t image_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+
+    /* Protects all fields below; never held across I/O */
+    QemuMutex lock;
+
+    /* Guest block number cached in each slot, if the slot is valid */
+    uint64_t *tags;
+    unsigned long *valid;
+    /* CLOCK reference bits */
+    unsigned long *referenced;
+    /* Number of requests reading or filling each slot */
+    uint32_t *users;
+    uint64_t clock_hand;
+    uint64_t nb_used;
+
+    /* Maps a guest block number to its entry in @tags */
+    GHashTable *blocks;
+
+    /*
+     * Incremented by every write.  Blocks read from the image while a write
+     * was in flight are not admitted, they might be stale.
+     */
+    uint64_t write_gen;
+
+    ReadCacheStream streams[READ_CACHE_STREAMS];
+    int next_stream;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bypassed;
+    uint64_t evictions;
+    uint64_t invalidations;
+} BDRVReadCacheState;
+
+#define READ_CACHE_OPT_CACHE_SIZE           "cache-size"
+#define READ_CACHE_OPT_BLOCK_SIZE           "block-size"
+#define READ_CACHE_OPT_SEQUENTIAL_CUTOFF    "sequential-cutoff"
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of data to cache",
+        },
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache, default 64k",
+        },
+        {
+            .name = READ_CACHE_OPT_SEQUENTIAL_CUTOFF,
+            .type = QEMU_OPT_SIZE,
+            .help = "Do not cache sequential streams longer than this, "
+                    "default 4M",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s, uint64_t slot)
+{
+    return s->data_offset + slot * s->block_size;
+}
+
+/* Forget all cached blocks.  Called with s->lock held or before any I/O. */
+static void read_cache_reset(BDRVReadCacheState *s)
+{
+    g_hash_table_remove_all(s->blocks);
+    bitmap_zero(s->valid, s->nb_slots);
+    bitmap_zero(s->referenced, s->nb_slots);
+    s->nb_used = 0;
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, uint64_t slot,
+                              uint64_t block)
+{
+    s->tags[slot] = block;
+    set_bit(slot, s->valid);
+    g_hash_table_insert(s->blocks, &s->tags[slot], &s->tags[slot]);
+    s->nb_used++;
+}
+
+static void read_cache_remove(BDRVReadCacheState *s, uint64_t slot)
+{
+    g_hash_table_remove(s->blocks, &s->tags[slot]);
+    clear_bit(slot, s->valid);
+    clear_bit(slot, s->referenced);
+    s->nb_used--;
+}
+
+/* Called with s->lock held.  Returns the slot caching @block, or -1. */
+static int64_t read_cache_find(BDRVReadCacheState *s, uint64_t block)
+{
+    uint64_t *tag = g_hash_table_lookup(s->blocks, &block);
+
+    return tag ? tag - s->tags : -1;
+}
+
+/*
+ * Called with s->lock held.  Returns a free slot, evicting a block that was
+ * not referenced since the clock hand last passed if needed, or -1 if all
+ * slots are in use by requests.
+ */
+static int64_t read_cache_get_free_slot(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        uint64_t slot = s->clock_hand;
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+        if (s->users[slot]) {
+            continue;
+        }
+        if (!test_bit(slot, s->valid)) {
+            return slot;
+        }
+        if (test_and_clear_bit(slot, s->referenced)) {
+            continue;
+        }
+
+        read_cache_remove(s, slot);
+        s->evictions++;
+        return slot;
+    }
+
+    return -1;
+}
+
+/*
+ * Returns whether the blocks of a read may be admitted into the cache: reads
+ * that continue a sequential stream longer than sequential-cutoff are scans
+ * that would only evict useful data.
+ */
+static bool read_cache_admit(BDRVReadCacheState *s, uint64_t offset,
+                             uint64_t bytes)
+{
+    ReadCacheStream *stream = NULL;
+    int i;
+
+    if (!s->sequential_cutoff) {
+        return true;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    for (i = 0; i < READ_CACHE_STREAMS; i++) {
+        if (s->streams[i].end == offset) {
+            stream = &s->streams[i];
+            stream->len += bytes;
+            break;
+        }
+    }
+    if (!stream) {
+        stream = &s->streams[s->next_stream];
+        s->next_stream = (s->next_stream + 1) % READ_CACHE_STREAMS;
+        stream->len = bytes;
+    }
+    stream->end = offset + bytes;
+
+    return stream->len <= s->sequential_cutoff;
+}
+
+/*
+ * Store the blocks that [@offset, @offset + @bytes) covers entirely, which
+ * were just read from the image into @qiov, in the cache.  A partial block
+ * at the end of the image is never cached.  Errors are not fatal, the
+ * blocks are simply not cached.
+ */
+static void coroutine_fn read_cache_fill(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         QEMUIOVector *qiov, size_t qiov_offset,
+                                         uint64_t write_gen)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = ROUND_UP(offset, s->block_size);
+    uint64_t end = offset + bytes;
+
+    while (start + s->block_size <= end) {
+        uint64_t block = start >> s->block_bits;
+        int64_t slot;
+        int ret;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (s->write_gen != write_gen) {
+                return;
+            }
+            slot = read_cache_find(s, block) < 0 ?
+                   read_cache_get_free_slot(s) : -1;
+            if (slot >= 0) {
+                s->users[slot]++;
+            }
+        }
+
+        if (slot >= 0) {
+            ret = bdrv_co_pwritev_part(s->cache_file,
+                                       read_cache_slot_offset(s, slot),
+                                       s->block_size, qiov,
+                                       qiov_offset + (start - offset), 0);
+            trace_read_cache_fill(bs, block, slot, ret);
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                s->users[slot]--;
+                if (ret == 0 && s->write_gen == write_gen &&
+                    read_cache_find(s, block) < 0)
+                {
+                    read_cache_insert(s, slot, block);
+                }
+            }
+        }
+
+        start += s->block_size;
+    }
+}
+
+static int coroutine_fn read_cache_co_preadv_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    bool admit = read_cache_admit(s, offset, bytes);
+    int ret;
+
+    while (bytes) {
+        uint64_t block = offset >> s->block_bits;
+        uint64_t n = MIN(bytes, ((block + 1) << s->block_bits) - offset);
+        uint64_t write_gen;
+        int64_t slot;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            slot = read_cache_find(s, block);
+            if (slot >= 0) {
+                s->users[slot]++;
+                set_bit(slot, s->referenced);
+            }
+        }
+
+        if (slot >= 0) {
+            ret = bdrv_co_preadv_part(s->cache_file,
+                                      read_cache_slot_offset(s, slot) +
+                                      (offset - (block << s->block_bits)),
+                                      n, qiov, qiov_offset, 0);
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                s->users[slot]--;
+                if (ret < 0 && test_bit(slot, s->valid)) {
+                    /* Do not try this slot again, read from the image */
+                    read_cache_remove(s, slot);
+                } else if (ret == 0) {
+                    s->hits++;
+                }
+            }
+            if (ret == 0) {
+                offset += n;
+                qiov_offset += n;
+                bytes -= n;
+                continue;
+            }
+            trace_read_cache_read_error(bs, block, slot, ret);
+        }
+
+        /* Read the whole run of blocks that are not cached at once */
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            while (n < bytes &&
+                   read_cache_find(s, (offset + n) >> s->block_bits) < 0)
+            {
+                n += MIN(bytes - n, s->block_size);
+            }
+            write_gen = s->write_gen;
+        }
+
+        ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                  flags);
+        if (ret < 0) {
+            return ret;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (admit) {
+                s->misses += DIV_ROUND_UP(n, s->block_size);
+            } else {
+                s->bypassed += DIV_ROUND_UP(n, s->block_size);
+            }
+        }
+        if (admit) {
+            read_cache_fill(bs, offset, n, qiov, qiov_offset, write_gen);
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the cached blocks that [@offset, @offset + @bytes) overlaps.  Called
+ * once the image was written, so that blocks that were admitted while the
+ * write was in flight are dropped too.
+ */
+static void read_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = offset >> s->block_bits;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, s->block_size);
+    uint64_t block, slot;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    s->write_gen++;
+
+    if (end - start > s->nb_used) {
+        for (slot = 0; slot < s->nb_slots; slot++) {
+            if (test_bit(slot, s->valid) &&
+                s->tags[slot] >= start && s->tags[slot] < end)
+            {
+                read_cache_remove(s, slot);
+                s->invalidations++;
+            }
+        }
+        return;
+    }
+
+    for (block = start; block < end; block++) {
+        int64_t found = read_cache_find(s, block);
+
+        if (found >= 0) {
+            read_cache_remove(s, found);
+            s->invalidations++;
+        }
+    }
+}
+
+static int coroutine_fn read_cache_co_pwritev_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset, bool exact,
+                                               PreallocMode prealloc,
+                                               BdrvRequestFlags flags,
+                                               Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t old_size = s->image_size;
+    uint64_t new_size = offset;
+    uint64_t start;
+    int64_t len;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    /*
+     * Drop the blocks past the new end and the block that the new end cuts
+     * in two.  When growing, nothing past the old end can be cached, but
+     * this still keeps reads that race with the resize from admitting
+     * their data.
+     */
+    start = QEMU_ALIGN_DOWN(MIN(old_size, new_size), s->block_size);
+    read_cache_invalidate(bs, start, MAX(old_size, new_size) - start);
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len >= 0) {
+        s->image_size = len;
+    }
+
+    return ret;
+}
+
+static int read_cache_write_header(BlockDriverState *bs, bool clean)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header = {
+        .magic          = cpu_to_be64(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be32(clean ? READ_CACHE_FLAG_CLEAN : 0),
+        .block_size     = cpu_to_be64(s->block_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .image_size     = cpu_to_be64(s->image_size),
+        .index_offset   = cpu_to_be64(s->index_offset),
+        .data_offset    = cpu_to_be64(s->data_offset),
+    };
+    int ret;
+
+    ret = bdrv_pwrite(s->cache_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(s->cache_file->bs);
+}
+
+/*
+ * Grow the cache file to hold all slots, so that writing the header, the
+ * index and the data of any slot stays within the file.  Called before
+ * anything is written to a cache file that was just activated.
+ */
+static int read_cache_grow(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t size = s->data_offset + s->nb_slots * s->block_size;
+    int64_t len;
+    int ret;
+
+    len = bdrv_getlength(s->cache_file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the cache file length");
+        return len;
+    }
+    if (len >= size) {
+        return 0;
+    }
+
+    ret = bdrv_truncate(s->cache_file, size, false, PREALLOC_MODE_OFF, 0,
+                        errp);
+    if (ret < 0) {
+        error_prepend(errp, "Could not grow the cache file: ");
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Load the index saved in the cache file, if it was closed cleanly with the
+ * same geometry, and mark the cache file as in use.
+ */
+static int read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    uint64_t *entries = NULL;
+    uint64_t slot, i, n;
+    bool loaded = false;
+    int64_t len;
+    int ret;
+
+    read_cache_reset(s);
+
+    len = bdrv_getlength(s->cache_file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the cache file length");
+        return len;
+    }
+    if (len < (int64_t)sizeof(header)) {
+        goto done;
+    }
+
+    ret = bdrv_pread(s->cache_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != READ_CACHE_MAGIC ||
+        be32_to_cpu(header.version) != READ_CACHE_VERSION ||
+        !(be32_to_cpu(header.flags) & READ_CACHE_FLAG_CLEAN) ||
+        be64_to_cpu(header.block_size) != s->block_size ||
+        be64_to_cpu(header.nb_slots) != s->nb_slots ||
+        be64_to_cpu(header.image_size) != s->image_size ||
+        be64_to_cpu(header.index_offset) != s->index_offset ||
+        be64_to_cpu(header.data_offset) != s->data_offset)
+    {
+        goto done;
+    }
+
+    entries = g_malloc(READ_CACHE_INDEX_CHUNK);
+    for (slot = 0; slot < s->nb_slots; slot += n) {
+        n = MIN(s->nb_slots - slot, READ_CACHE_INDEX_CHUNK / sizeof(uint64_t));
+        ret = bdrv_pread(s->cache_file, s->index_offset + slot * 8, entries,
+                         n * 8);
+        if (ret < 0) {
+            /* Start with an empty cache rather than failing */
+            read_cache_reset(s);
+            goto done;
+        }
+
+        for (i = 0; i < n; i++) {
+            uint64_t entry = be64_to_cpu(entries[i]);
+
+            if (entry && ((entry - 1) << s->block_bits) < s->image_size &&
+                read_cache_find(s, entry - 1) < 0)
+            {
+                read_cache_insert(s, slot + i, entry - 1);
+            }
+        }
+    }
+    loaded = true;
+
+done:
+    g_free(entries);
+    trace_read_cache_load(bs, loaded, s->nb_used);
+
+    ret = read_cache_grow(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = read_cache_write_header(bs, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+    return 0;
+}
+
+/* Save the index into the cache file and mark it as clean */
+static int read_cache_save(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t *entries;
+    uint64_t slot, i, n;
+    int ret = 0;
+
+    entries = g_malloc(READ_CACHE_INDEX_CHUNK);
+    for (slot = 0; slot < s->nb_slots; slot += n) {
+        n = MIN(s->nb_slots - slot, READ_CACHE_INDEX_CHUNK / sizeof(uint64_t));
+        for (i = 0; i < n; i++) {
+            entries[i] = test_bit(slot + i, s->valid) ?
+                         cpu_to_be64(s->tags[slot + i] + 1) : 0;
+        }
+        ret = bdrv_pwrite(s->cache_file, s->index_offset + slot * 8, entries,
+                          n * 8);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_flush(s->cache_file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = read_cache_write_header(bs, true);
+
+out:
+    g_free(entries);
+    trace_read_cache_save(bs, s->nb_used, ret);
+    return ret;
+}
+
+static void read_cache_free(BDRVReadCacheState *s)
+{
+    if (!s->blocks) {
+        return;
+    }
+
+    g_hash_table_destroy(s->blocks);
+    s->blocks = NULL;
+    g_free(s->tags);
+    g_free(s->valid);
+    g_free(s->referenced);
+    g_free(s->users);
+    qemu_mutex_destroy(&s->lock);
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t cache_size;
+    int64_t image_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CACHE_SIZE, 0);
+    s->block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                      64 * KiB);
+    s->sequential_cutoff = qemu_opt_get_size(opts,
+                                             READ_CACHE_OPT_SEQUENTIAL_CUTOFF,
+                                             4 * MiB);
+
+    if (!is_power_of_2(s->block_size) ||
+        s->block_size < READ_CACHE_MIN_BLOCK_SIZE ||
+        s->block_size > READ_CACHE_MAX_BLOCK_SIZE)
+    {
+        error_setg(errp, "block-size must be a power of two between 4 KiB "
+                   "and 2 MiB");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (cache_size < s->block_size) {
+        error_setg(errp, "cache-size must be at least block-size");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* The cache is written even if the image is read-only */
+    if (!qdict_get_try_str(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY, "off");
+    }
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_of_bds, BDRV_CHILD_METADATA, false,
+                                    errp);
+    if (!s->cache_file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        error_setg_errno(errp, -image_size, "Could not get the image length");
+        ret = image_size;
+        goto fail;
+    }
+
+    s->image_size = image_size;
+    s->block_bits = ctz64(s->block_size);
+    s->nb_slots = cache_size / s->block_size;
+    s->index_offset = READ_CACHE_HEADER_SIZE;
+    s->data_offset = ROUND_UP(s->index_offset + s->nb_slots * 8,
+                              s->block_size);
+
+    qemu_mutex_init(&s->lock);
+    s->tags = g_new(uint64_t, s->nb_slots);
+    s->valid = bitmap_new(s->nb_slots);
+    s->referenced = bitmap_new(s->nb_slots);
+    s->users = g_new0(uint32_t, s->nb_slots);
+    s->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    /*
+     * An inactive image may still be modified by the migration source, the
+     * cache is only loaded once it is activated.
+     */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = read_cache_load(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        read_cache_free(s);
+        if (s->cache_file) {
+            bdrv_unref_child(bs, s->cache_file);
+            s->cache_file = NULL;
+        }
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        if (read_cache_save(bs) < 0) {
+            warn_report("read-cache: could not save the cache index, the "
+                        "cache will start empty next time");
+        }
+    }
+
+    read_cache_free(s);
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    return read_cache_save(bs);
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    /*
+     * The image was written by the migration source, none of the blocks
+     * cached in this cache file can be trusted.
+     */
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    read_cache_reset(s);
+    ret = read_cache_grow(bs, errp);
+    if (ret < 0) {
+        return;
+    }
+
+    ret = read_cache_write_header(bs, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+    }
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (!(role & BDRV_CHILD_FILTERED)) {
+        /* The cache file is ours alone, and is grown when activated */
+        *nperm = BLK_PERM_CONSISTENT_READ;
+        if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+            *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+        }
+        *nshared = BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Writes that bypass the filter would leave stale data in the cache */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificReadCache *rc = g_new(BlockStatsSpecificReadCache, 1);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        *rc = (BlockStatsSpecificReadCache) {
+            .size           = s->nb_slots,
+            .used           = s->nb_used,
+            .hits           = s->hits,
+            .misses         = s->misses,
+            .bypassed       = s->bypassed,
+            .evictions      = s->evictions,
+            .invalidations  = s->invalidations,
+        };
+    }
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = rc;
+
+    return stats;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_CACHE_SIZE,
+    READ_CACHE_OPT_BLOCK_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                = "read-cache",
+    .instance_size              = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                  = read_cache_open,
+    .bdrv_close                 = read_cache_close,
+    .bdrv_child_perm            = read_cache_child_perm,
+    .bdrv_inactivate            = read_cache_inactivate,
+    .bdrv_co_invalidate_cache   = read_cache_co_invalidate_cache,
+
+    .bdrv_getlength             = read_cache_getlength,
+    .bdrv_get_specific_stats    = read_cache_get_specific_stats,
+
+    .bdrv_co_preadv_part        = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part       = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = read_cache_co_pdiscard,
+    .bdrv_co_truncate           = read_cache_co_truncate,
+
+    .is_filter                  = true,
+    .strong_runtime_opts        = read_cache_strong_runtime_opts,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -0,0 +1,585 @@
+/*
+ * Readahead filter
+ *
+ * Detects sequential read streams and, for each of them, reads the data
+ * that follows the stream from the image ahead of time, asynchronously, so
+ * that the next reads of the stream are served from memory.  This hides the
+ * latency of slow (typically network) images whose reads are otherwise
+ * issued one at a time, at the size of the guest requests: when booting
+ * from them, or when a block job streams or commits a backing chain that
+ * contains them.
+ *
+ * The prefetch window of a stream starts small and doubles each time the
+ * stream consumes half of it, up to window-size.  Prefetched data is kept
+ * in buffers until it is read, overwritten or evicted; their total size is
+ * bounded by buffer-size.
+ *
+ * Writes go to the image and drop the buffers they overlap, and so does
+ * shrinking the image for the buffers past its new end, so the image must
+ * only be modified through this filter.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define READAHEAD_MIN_WINDOW_SIZE   (64 * KiB)
+#define READAHEAD_MAX_WINDOW_SIZE   (256 * MiB)
+
+/* Size of the first prefetch of a stream, if its reads are smaller */
+#define READAHEAD_INITIAL_WINDOW    (128 * KiB)
+
+/* Number of concurrent sequential streams that are detected */
+#define READAHEAD_STREAMS           8
+
+typedef struct ReadaheadBuffer {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *buf;
+
+    /* Result of the prefetch, valid once @done is set */
+    int ret;
+    bool done;
+
+    /* Whether the buffer is in the list of buffers and may serve reads */
+    bool listed;
+
+    /* Number of requests reading from or waiting for the buffer */
+    unsigned int users;
+    uint64_t consumed;
+
+    CoQueue waiters;
+    QTAILQ_ENTRY(ReadaheadBuffer) next;
+} ReadaheadBuffer;
+
+typedef struct ReadaheadStream {
+    uint64_t end;               /* end of the last read of the stream */
+    uint64_t prefetch_end;      /* end of the data prefetched for it */
+    uint64_t window;            /* size of the next prefetch, 0 if none yet */
+} ReadaheadStream;
+
+typedef struct BDRVReadaheadState {
+    uint64_t window_size;
+    uint64_t buffer_size;
+
+    /* Protects all fields below; never held across I/O */
+    QemuMutex lock;
+
+    /* Buffers that may serve reads, oldest first */
+    QTAILQ_HEAD(, ReadaheadBuffer) buffers;
+    /* Size of all allocated buffers, listed or not */
+    uint64_t buffered;
+
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    int next_stream;
+
+    uint64_t prefetched;
+    uint64_t hits;
+    uint64_t unused;
+} BDRVReadaheadState;
+
+#define READAHEAD_OPT_WINDOW_SIZE   "window-size"
+#define READAHEAD_OPT_BUFFER_SIZE   "buffer-size"
+
+static QemuOptsList runtime_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READAHEAD_OPT_WINDOW_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of data prefetched ahead of a sequential "
+                    "stream, default 2M",
+        },
+        {
+            .name = READAHEAD_OPT_BUFFER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of memory used for prefetched data, "
+                    "default 16M",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* Called with s->lock held */
+static void readahead_maybe_free(BDRVReadaheadState *s, ReadaheadBuffer *b)
+{
+    if (b->listed || !b->done || b->users) {
+        return;
+    }
+
+    if (b->ret == 0 && b->consumed < b->bytes) {
+        s->unused += b->bytes - b->consumed;
+    }
+    s->buffered -= b->bytes;
+    qemu_vfree(b->buf);
+    g_free(b);
+}
+
+/*
+ * Called with s->lock held.  The buffer stops serving reads, and is freed
+ * as soon as its prefetch has completed and no request uses it anymore.
+ */
+static void readahead_unlist(BDRVReadaheadState *s, ReadaheadBuffer *b)
+{
+    assert(b->listed);
+    QTAILQ_REMOVE(&s->buffers, b, next);
+    b->listed = false;
+    readahead_maybe_free(s, b);
+}
+
+/*
+ * Called with s->lock held.  Returns the buffer that contains @offset, or
+ * NULL; in the latter case, *@bytes is reduced so that [@offset, @offset +
+ * *@bytes) does not overlap any buffer.
+ */
+static ReadaheadBuffer *readahead_find(BDRVReadaheadState *s, uint64_t offset,
+                                       uint64_t *bytes)
+{
+    ReadaheadBuffer *b;
+
+    QTAILQ_FOREACH(b, &s->buffers, next) {
+        if (b->offset <= offset && offset < b->offset + b->bytes) {
+            return b;
+        }
+        if (b->offset > offset && b->offset < offset + *bytes) {
+            *bytes = b->offset - offset;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called with s->lock held.  Makes room for @bytes more of prefetched data
+ * by evicting the oldest buffers that are ready and unused, and returns
+ * whether it succeeded.
+ */
+static bool readahead_make_room(BDRVReadaheadState *s, uint64_t bytes)
+{
+    ReadaheadBuffer *b, *next_b;
+
+    QTAILQ_FOREACH_SAFE(b, &s->buffers, next, next_b) {
+        if (s->buffered + bytes <= s->buffer_size) {
+            break;
+        }
+        if (b->done && !b->users) {
+            readahead_unlist(s, b);
+        }
+    }
+    return s->buffered + bytes <= s->buffer_size;
+}
+
+static void coroutine_fn readahead_co_prefetch(void *opaque)
+{
+    ReadaheadBuffer *b = opaque;
+    BlockDriverState *bs = b->bs;
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pread(bs->file, b->offset, b->bytes, b->buf, 0);
+    trace_readahead_prefetch_done(bs, b->offset, b->bytes, ret);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        b->ret = ret;
+        b->done = true;
+        qemu_co_queue_restart_all(&b->waiters);
+        if (ret < 0 && b->listed) {
+            /* Let the reads go to the image and report the error */
+            readahead_unlist(s, b);
+        } else {
+            readahead_maybe_free(s, b);
+        }
+    }
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called with s->lock held.  Allocates a buffer for [@offset, @offset +
+ * @bytes) and adds it to the list, or returns NULL if there is no room.
+ */
+static ReadaheadBuffer *readahead_new_buffer(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadBuffer *b;
+    uint8_t *buf;
+
+    if (!readahead_make_room(s, bytes)) {
+        return NULL;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (!buf) {
+        return NULL;
+    }
+
+    b = g_new(ReadaheadBuffer, 1);
+    *b = (ReadaheadBuffer) {
+        .bs     = bs,
+        .offset = offset,
+        .bytes  = bytes,
+        .buf    = buf,
+        .listed = true,
+    };
+    qemu_co_queue_init(&b->waiters);
+    QTAILQ_INSERT_TAIL(&s->buffers, b, next);
+    s->buffered += bytes;
+
+    return b;
+}
+
+/*
+ * Account a read of [@offset, @offset + @bytes) to its sequential stream,
+ * and start prefetching the data that follows the stream if less than half
+ * of its window is left ahead of it.
+ */
+static void coroutine_fn readahead_update_stream(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *stream = NULL;
+    ReadaheadBuffer *b = NULL;
+    int64_t size = bdrv_getlength(bs);
+    uint64_t start = 0, len = 0;
+    int i;
+
+    if (size < 0) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < READAHEAD_STREAMS; i++) {
+            if (s->streams[i].end == offset) {
+                stream = &s->streams[i];
+                break;
+            }
+        }
+        if (!stream) {
+            /* Only prefetch once the stream proves to be sequential */
+            stream = &s->streams[s->next_stream];
+            s->next_stream = (s->next_stream + 1) % READAHEAD_STREAMS;
+            *stream = (ReadaheadStream) { .end = offset + bytes };
+            return;
+        }
+
+        stream->end = offset + bytes;
+        if (!stream->window) {
+            stream->window = MIN(MAX(READAHEAD_INITIAL_WINDOW, 2 * bytes),
+                                 s->window_size);
+        }
+        stream->prefetch_end = MAX(stream->prefetch_end, stream->end);
+
+        start = stream->prefetch_end;
+        if (start - stream->end >= stream->window / 2 || start >= size) {
+            return;
+        }
+
+        /* Do not prefetch data that another stream already prefetched */
+        len = MIN(stream->window, size - start);
+        b = readahead_find(s, start, &len);
+        if (b) {
+            stream->prefetch_end = b->offset + b->bytes;
+            return;
+        }
+
+        b = readahead_new_buffer(bs, start, len);
+        if (!b) {
+            return;
+        }
+
+        stream->prefetch_end += len;
+        stream->window = MIN(stream->window * 2, s->window_size);
+        s->prefetched += len;
+    }
+
+    trace_readahead_prefetch(bs, start, len);
+
+    /* The coroutine runs once the current request yields */
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(readahead_co_prefetch, b));
+}
+
+static int coroutine_fn readahead_co_preadv_part(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int ret;
+
+    readahead_update_stream(bs, offset, bytes);
+
+    while (bytes) {
+        ReadaheadBuffer *b;
+        uint64_t n = bytes;
+        bool hit = false;
+
+        qemu_mutex_lock(&s->lock);
+        b = readahead_find(s, offset, &n);
+        if (b) {
+            n = MIN(bytes, b->offset + b->bytes - offset);
+            b->users++;
+            while (!b->done) {
+                qemu_co_queue_wait(&b->waiters, &s->lock);
+            }
+
+            /* An unlisted buffer was overwritten or failed */
+            if (b->listed) {
+                qemu_iovec_from_buf(qiov, qiov_offset,
+                                    b->buf + (offset - b->offset), n);
+                b->consumed += n;
+                s->hits += n;
+                hit = true;
+            }
+
+            b->users--;
+            if (b->listed && offset + n == b->offset + b->bytes) {
+                /* The stream is done with this buffer */
+                readahead_unlist(s, b);
+            } else {
+                readahead_maybe_free(s, b);
+            }
+        }
+        qemu_mutex_unlock(&s->lock);
+
+        if (!hit) {
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      flags);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the buffers that [@offset, @offset + @bytes) overlaps.  Called once
+ * the image was written, so that prefetches that were in flight during the
+ * write are dropped too.
+ */
+static void readahead_invalidate(BlockDriverState *bs, uint64_t offset,
+                                 uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadBuffer *b, *next_b;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    QTAILQ_FOREACH_SAFE(b, &s->buffers, next, next_b) {
+        if (b->offset < offset + bytes && offset < b->offset + b->bytes) {
+            trace_readahead_invalidate(bs, b->offset, b->bytes);
+            readahead_unlist(s, b);
+        }
+    }
+}
+
+static int coroutine_fn readahead_co_pwritev_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    readahead_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    readahead_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    readahead_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_truncate(BlockDriverState *bs,
+                                              int64_t offset, bool exact,
+                                              PreallocMode prealloc,
+                                              BdrvRequestFlags flags,
+                                              Error **errp)
+{
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    /* Data past the new end must not be served if the image grows again */
+    readahead_invalidate(bs, offset, INT64_MAX - offset);
+    return ret;
+}
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->window_size = qemu_opt_get_size(opts, READAHEAD_OPT_WINDOW_SIZE,
+                                       2 * MiB);
+    s->buffer_size = qemu_opt_get_size(opts, READAHEAD_OPT_BUFFER_SIZE,
+                                       16 * MiB);
+
+    if (s->window_size < READAHEAD_MIN_WINDOW_SIZE ||
+        s->window_size > READAHEAD_MAX_WINDOW_SIZE)
+    {
+        error_setg(errp, "window-size must be between 64 KiB and 256 MiB");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->buffer_size < s->window_size) {
+        error_setg(errp, "buffer-size must be at least window-size");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    qemu_mutex_init(&s->lock);
+    QTAILQ_INIT(&s->buffers);
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadBuffer *b, *next_b;
+
+    /* The node is drained, all prefetches have completed */
+    QTAILQ_FOREACH_SAFE(b, &s->buffers, next, next_b) {
+        assert(b->done && !b->users);
+        readahead_unlist(s, b);
+    }
+    assert(!s->buffered);
+
+    qemu_mutex_destroy(&s->lock);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void readahead_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 BdrvChildRole role,
+                                 BlockReopenQueue *reopen_queue,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Writes that bypass the filter would leave stale prefetched data */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockStatsSpecific *readahead_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificReadahead *ra = g_new(BlockStatsSpecificReadahead, 1);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        *ra = (BlockStatsSpecificReadahead) {
+            .prefetched = s->prefetched,
+            .hits       = s->hits,
+            .unused     = s->unused,
+            .buffered   = s->buffered,
+        };
+    }
+
+    stats->driver = BLOCKDEV_DRIVER_READAHEAD;
+    stats->u.readahead = ra;
+
+    return stats;
+}
+
+static const char *const readahead_strong_runtime_opts[] = {
+    NULL
+};
+
+static BlockDriver bdrv_readahead = {
+    .format_name                = "readahead",
+    .instance_size              = sizeof(BDRVReadaheadState),
+
+    .bdrv_open                  = readahead_open,
+    .bdrv_close                 = readahead_close,
+    .bdrv_child_perm            = readahead_child_perm,
+
+    .bdrv_getlength             = readahead_getlength,
+    .bdrv_get_specific_stats    = readahead_get_specific_stats,
+
+    .bdrv_co_preadv_part        = readahead_co_preadv_part,
+    .bdrv_co_pwritev_part       = readahead_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = readahead_co_pdiscard,
+    .bdrv_co_truncate           = readahead_co_truncate,
+
+    .is_filter                  = true,
+    .strong_runtime_opts        = readahead_strong_runtime_opts,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
@@ -250,6 +250,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -EBUSY;
     }
 
+    bdrv_block_status_cache_clear(bs);
+
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
         if (ret < 0) {
@@ -432,6 +434,7 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
+        bdrv_block_status_cache_clear(bs);
         return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
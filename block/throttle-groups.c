@@ -62,6 +62,13 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * While no request of a given type is queued or waiting for a timer in the
+ * group, the room left in its buckets is handed out as credits to the
+ * members (see throttle_grant_credits()).  Requests are accounted with
+ * those credits without taking the lock, until they run out; the next
+ * request then goes through the usual path, which reclaims the credits
+ * and accounts for them in the ThrottleState.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,11 +77,12 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    unsigned pending_reqs[2]; /* sum of the members' pending_reqs */
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
@@ -349,6 +357,38 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/* Take back the credits of the group, for both types of operations, so
+ * that its ThrottleState is up to date.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_reclaim_credits(ThrottleGroup *tg)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        throttle_reclaim_credits(&tg->ts, i);
+    }
+}
+
+/* Hand out credits for requests of one type if none is queued or waiting
+ * for a timer in the group, so that the next ones can skip the lock.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_credits(ThrottleGroup *tg, bool is_write)
+{
+    if (tg->pending_reqs[is_write] || tg->any_timer_armed[is_write]) {
+        return;
+    }
+
+    throttle_reclaim_credits(&tg->ts, is_write);
+    throttle_grant_credits(&tg->ts, is_write,
+                           qemu_clock_get_ns(tg->clock_type));
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -367,8 +407,16 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    /* Fast path: the group is far from its limits and nothing is queued */
+    if (throttle_try_consume_credits(tgm->throttle_state, is_write, bytes)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* Account for the requests that used the credits before going on */
+    throttle_group_reclaim_credits(tg);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -376,6 +424,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
         tgm->pending_reqs[is_write]++;
+        tg->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -383,14 +432,19 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tg->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
+    throttle_group_reclaim_credits(tg);
     throttle_account(tgm->throttle_state, is_write, bytes);
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* Let the next requests skip the lock if there is room for them */
+    throttle_group_grant_credits(tg, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -474,6 +528,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
+    throttle_group_reclaim_credits(tg);
     throttle_config(ts, tg->clock_type, cfg);
     qemu_mutex_unlock(&tg->lock);
 
@@ -492,6 +547,7 @@ void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
+    throttle_group_reclaim_credits(tg);
     throttle_get_config(ts, cfg);
     qemu_mutex_unlock(&tg->lock);
 }
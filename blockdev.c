@@ -55,6 +55,7 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/iothread.h"
 #include "block/block_int.h"
+#include "block/backup-top.h"
 #include "block/trace.h"
 #include "sysemu/arch_init.h"
 #include "sysemu/runstate.h"
@@ -1682,7 +1683,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
 {
     DriveBackupState *state = DO_UPCAST(DriveBackupState, common, common);
     DriveBackup *backup;
-    BlockDriverState *bs;
+    BlockDriverState *bs, *backup_bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
     AioContext *aio_context;
@@ -1718,13 +1719,19 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
     /* Paired with .clean() */
     bdrv_drained_begin(bs);
 
+    /*
+     * If @bs is already being backed up, the new backup shares the filter
+     * of the running one and copies from the node below it.
+     */
+    backup_bs = bdrv_backup_top_cluster_size(bs) ? bdrv_filter_bs(bs) : bs;
+
     if (!backup->has_format) {
         backup->format = backup->mode == NEW_IMAGE_MODE_EXISTING ?
-                         NULL : (char *) bs->drv->format_name;
+                         NULL : (char *) backup_bs->drv->format_name;
     }
 
     /* Early check to avoid creating target */
-    if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
+    if (bdrv_op_is_blocked(backup_bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         goto out;
     }
 
@@ -1747,7 +1754,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
         }
     }
     if (backup->sync == MIRROR_SYNC_MODE_NONE) {
-        source = bs;
+        source = backup_bs;
         flags |= BDRV_O_NO_BACKING;
         set_backing_hd = true;
     }
@@ -2972,10 +2979,12 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_copy_mode, MirrorCopyMode copy_mode,
                                    bool has_auto_finalize, bool auto_finalize,
                                    bool has_auto_dismiss, bool auto_dismiss,
+                                   MirrorPerf *x_perf,
                                    Error **errp)
 {
     BlockDriverState *unfiltered_bs;
     int job_flags = JOB_DEFAULT;
+    MirrorPerf perf = { .max_in_flight = MIRROR_DEFAULT_MAX_IN_FLIGHT };
 
     if (!has_speed) {
         speed = 0;
@@ -3001,6 +3010,14 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_copy_mode) {
         copy_mode = MIRROR_COPY_MODE_BACKGROUND;
     }
+    if (x_perf) {
+        if (x_perf->has_max_in_flight) {
+            perf.max_in_flight = x_perf->max_in_flight;
+        }
+        if (x_perf->has_max_chunk) {
+            perf.max_chunk = x_perf->max_chunk;
+        }
+    }
     if (has_auto_finalize && !auto_finalize) {
         job_flags |= JOB_MANUAL_FINALIZE;
     }
@@ -3079,7 +3096,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                  has_replaces ? replaces : NULL, job_flags,
                  speed, granularity, buf_size, sync, backing_mode, zero_target,
                  on_source_error, on_target_error, unmap, filter_node_name,
-                 copy_mode, errp);
+                 copy_mode, &perf, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3233,7 +3250,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_copy_mode, arg->copy_mode,
                            arg->has_auto_finalize, arg->auto_finalize,
                            arg->has_auto_dismiss, arg->auto_dismiss,
-                           errp);
+                           arg->x_perf, errp);
     bdrv_unref(target_bs);
 out:
     aio_context_release(aio_context);
@@ -3255,6 +3272,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          bool has_copy_mode, MirrorCopyMode copy_mode,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
+                         bool has_x_perf, MirrorPerf *x_perf,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3303,7 +3321,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_copy_mode, copy_mode,
                            has_auto_finalize, auto_finalize,
                            has_auto_dismiss, auto_dismiss,
-                           errp);
+                           has_x_perf ? x_perf : NULL, errp);
 out:
     aio_context_release(aio_context);
 }
@@ -335,6 +335,9 @@ BlockJobInfo *block_job_query(BlockJob *job, Error **errp)
                         g_strdup(error_get_pretty(job->job.err)) :
                         g_strdup(strerror(-job->job.ret));
     }
+    if (block_job_driver(job)->query) {
+        block_job_driver(job)->query(job, info);
+    }
     return info;
 }
 
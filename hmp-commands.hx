@@ -1734,12 +1734,17 @@ SRST
   Start a round of dirty rate measurement with the period specified in *second*.
   The result of the dirty rate measurement may be observed with ``info
   dirty_rate`` command.
+  Use -r to measure the dirty rate of each vCPU from the KVM dirty ring, or
+  -b to measure the exact dirty rate of each RAMBlock and of its hottest
+  regions from the dirty log bitmap.
 ERST
 
     {
         .name       = "calc_dirty_rate",
-        .args_type  = "second:l,sample_pages_per_GB:l?",
-        .params     = "second [sample_pages_per_GB]",
-        .help       = "start a round of guest dirty rate measurement",
+        .args_type  = "dirty_ring:-r,dirty_bitmap:-b,second:l,sample_pages_per_GB:l?",
+        .params     = "[-r] [-b] second [sample_pages_per_GB]",
+        .help       = "start a round of guest dirty rate measurement (using -r to"
+                      "\n\t\t\t specify dirty ring as the method of calculation and"
+                      "\n\t\t\t -b to specify dirty bitmap as method of calculation)",
         .cmd        = hmp_calc_dirty_rate,
     },
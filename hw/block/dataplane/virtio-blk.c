@@ -43,8 +43,84 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * With the iothreads property, virtqueue i is serviced by the iothread
+     * iothreads[i % num_iothreads].  The first one is also the home
+     * iothread of the BlockBackend (@iothread and @ctx above).
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext **vq_ctx;
 };
 
+static AioContext *virtio_blk_data_plane_vq_ctx(VirtIOBlockDataPlane *s,
+                                                unsigned i)
+{
+    return s->vq_ctx ? s->vq_ctx[i] : s->ctx;
+}
+
+/* Context: QEMU global mutex held */
+static bool virtio_blk_data_plane_parse_iothreads(VirtIOBlockDataPlane *s,
+                                                  VirtIOBlkConf *conf,
+                                                  Error **errp)
+{
+    g_auto(GStrv) ids = g_strsplit(conf->iothreads, ":", -1);
+    unsigned i;
+
+    s->num_iothreads = g_strv_length(ids);
+    if (!s->num_iothreads) {
+        error_setg(errp, "iothreads must list at least one iothread");
+        return false;
+    }
+    if (s->num_iothreads > conf->num_queues) {
+        error_setg(errp, "iothreads lists more iothreads (%u) than there are "
+                   "virtqueues (%u)", s->num_iothreads, conf->num_queues);
+        return false;
+    }
+
+    s->iothreads = g_new0(IOThread *, s->num_iothreads);
+    for (i = 0; i < s->num_iothreads; i++) {
+        IOThread *iothread = iothread_by_id(ids[i]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            return false;
+        }
+        s->iothreads[i] = iothread;
+        object_ref(OBJECT(iothread));
+    }
+
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_ctx[i] =
+            iothread_get_aio_context(s->iothreads[i % s->num_iothreads]);
+    }
+
+    return true;
+}
+
+static void virtio_blk_data_plane_free(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->num_iothreads; i++) {
+        if (s->iothreads[i]) {
+            object_unref(OBJECT(s->iothreads[i]));
+        }
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_ctx);
+    g_free(s->batch_notify_vqs);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    g_free(s);
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
@@ -91,7 +167,12 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothreads) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -111,6 +192,11 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
             return false;
         }
     }
+    if (conf->iothreads && !blk_supports_multiqueue(conf->conf.blk)) {
+        error_setg(errp, "iothreads is not supported by the block nodes "
+                   "of this device");
+        return false;
+    }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
         return false;
@@ -120,7 +206,15 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (conf->iothreads) {
+        if (!virtio_blk_data_plane_parse_iothreads(s, conf, errp)) {
+            virtio_blk_data_plane_free(s);
+            return false;
+        }
+        s->iothread = s->iothreads[0];
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
@@ -146,12 +240,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
-    }
-    g_free(s);
+    virtio_blk_data_plane_free(s);
 }
 
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
@@ -184,7 +273,12 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /*
+     * The batch notification BH lives in the home iothread; with several
+     * iothreads, each one notifies the guest for its own virtqueues.
+     */
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) &&
+        s->num_iothreads <= 1) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -246,6 +340,19 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     /* Process queued requests before the ones in vring */
     virtio_blk_process_queued_requests(vblk, false);
 
+    if (s->num_iothreads > 1) {
+        /*
+         * The queued requests complete in the home iothread, whatever their
+         * virtqueue: wait for them before handing out the virtqueues.
+         */
+        aio_context_acquire(s->ctx);
+        blk_drain(s->conf->conf.blk);
+        aio_context_release(s->ctx);
+
+        blk_set_multiqueue(s->conf->conf.blk, true);
+        qatomic_set(&vblk->multiqueue, true);
+    }
+
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
@@ -254,14 +361,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_vq_ctx(s, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_aio_context:
@@ -290,19 +398,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues that
+ * are serviced by the current IOThread.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (virtio_blk_data_plane_vq_ctx(s, i) == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -329,6 +441,14 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 1; i < s->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
@@ -338,6 +458,12 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
 
     aio_context_release(s->ctx);
 
+    /* The drain above waited for the requests of all virtqueues */
+    if (s->num_iothreads > 1) {
+        qatomic_set(&vblk->multiqueue, false);
+        blk_set_multiqueue(s->conf->conf.blk, false);
+    }
+
     /*
      * Batch all the host notifiers in a single transaction to avoid
      * quadratic time complexity in address_space_update_ioeventfds().
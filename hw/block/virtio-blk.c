@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/iov.h"
+#include "qemu/lockable.h"
 #include "qemu/module.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -72,6 +73,33 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/*
+ * When the virtqueues are serviced by several iothreads, requests are
+ * processed and completed in the iothread of their virtqueue without the
+ * AioContext lock: taking it would serialize the iothreads again.
+ *
+ * Returns the AioContext that must be passed to virtio_blk_release().
+ */
+static AioContext *virtio_blk_acquire(VirtIOBlock *s)
+{
+    AioContext *ctx;
+
+    if (qatomic_read(&s->multiqueue)) {
+        return NULL;
+    }
+
+    ctx = blk_get_aio_context(s->conf.conf.blk);
+    aio_context_acquire(ctx);
+    return ctx;
+}
+
+static void virtio_blk_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -100,8 +128,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
-        req->next = s->rq;
-        s->rq = req;
+        WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+            req->next = s->rq;
+            s->rq = req;
+        }
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         if (acct_failed) {
@@ -119,8 +149,9 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    AioContext *ctx;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_acquire(s);
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -153,15 +184,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         block_acct_done(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_release(ctx);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_acquire(s);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -173,7 +205,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_release(ctx);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
@@ -182,8 +214,9 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     VirtIOBlock *s = req->dev;
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
+    AioContext *ctx;
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_acquire(s);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -197,7 +230,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_release(ctx);
 }
 
 #ifdef __linux__
@@ -215,6 +248,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
+    AioContext *ctx;
 
     scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
 
@@ -244,10 +278,10 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_acquire(s);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_release(ctx);
     g_free(ioctl_req);
 }
 
@@ -773,8 +807,9 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     MultiReqBuffer mrb = {};
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
+    AioContext *ctx;
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
+    ctx = virtio_blk_acquire(s);
     blk_io_plug(s->blk);
 
     do {
@@ -801,7 +836,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    virtio_blk_release(ctx);
     return progress;
 }
 
@@ -828,10 +863,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
 void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh)
 {
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
 
-    s->rq = NULL;
+    WITH_QEMU_LOCK_GUARD(&s->rq_lock) {
+        req = s->rq;
+        s->rq = NULL;
+    }
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (req) {
@@ -1216,6 +1254,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
+    qemu_mutex_init(&s->rq_lock);
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
@@ -1229,6 +1268,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
             virtio_del_queue(vdev, i);
         }
         virtio_cleanup(vdev);
+        qemu_mutex_destroy(&s->rq_lock);
         return;
     }
 
@@ -1261,6 +1301,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
+    qemu_mutex_destroy(&s->rq_lock);
 }
 
 static void virtio_blk_instance_init(Object *obj)
@@ -1301,6 +1342,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BOOL("report-discard-granularity", VirtIOBlock,
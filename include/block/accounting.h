@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -78,6 +79,29 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/*
+ * Latency histogram that is always enabled, with log-linear buckets: each
+ * power of two of nanoseconds is split into BLOCK_LOG_HIST_SUB_BUCKETS
+ * buckets of the same size, so that a bucket is at most 1/8 as wide as the
+ * latencies it counts.  Latencies from 2^BLOCK_LOG_HIST_MAX_BITS ns (about
+ * 137 s) on are counted in the last bucket.
+ *
+ * Each thread counts in one of BLOCK_LOG_HIST_SHARDS shards, which are
+ * allocated on first use and only updated without locks.  The
+ * shards are summed up when the histogram is read.
+ */
+#define BLOCK_LOG_HIST_SUB_BITS     3
+#define BLOCK_LOG_HIST_SUB_BUCKETS  (1 << BLOCK_LOG_HIST_SUB_BITS)
+#define BLOCK_LOG_HIST_MAX_BITS     37
+#define BLOCK_LOG_HIST_BUCKETS \
+    ((BLOCK_LOG_HIST_MAX_BITS - BLOCK_LOG_HIST_SUB_BITS + 1) * \
+     BLOCK_LOG_HIST_SUB_BUCKETS)
+#define BLOCK_LOG_HIST_SHARDS       8
+
+typedef struct BlockLatencyLogHistogram {
+    Stat64 *shards[BLOCK_LOG_HIST_SHARDS];
+} BlockLatencyLogHistogram;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -91,6 +115,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockLatencyLogHistogram latency_log_histogram[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -120,4 +145,10 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+void block_latency_log_account(BlockLatencyLogHistogram *hist,
+                               int64_t latency_ns);
+bool block_latency_log_read(BlockLatencyLogHistogram *hist, uint64_t *bins);
+uint64_t block_latency_log_bucket_start(int bucket);
+void block_latency_log_cleanup(BlockLatencyLogHistogram *hist);
+
 #endif
@@ -235,6 +235,20 @@ struct AioContext {
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
+    /* io_uring parameters, used when the ring is set up */
+    int64_t io_uring_queue_depth;   /* number of ring entries, 0: default */
+    bool io_uring_sqpoll;           /* use a kernel submission queue thread */
+    bool io_uring_iopoll;           /* poll for completions */
+
+    /*
+     * Number of users whose completions are not signalled through a file
+     * descriptor and must be busy polled, such as an io_uring ring set up
+     * with IORING_SETUP_IOPOLL that has requests in flight.  While it is
+     * non-zero, aio_poll() never blocks and runs the ->io_poll() handlers at
+     * least once per iteration.  Only accessed from the event loop thread.
+     */
+    int busy_poll_cnt;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -767,4 +781,47 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @queue_depth: number of entries of the io_uring ring, 0 means that the
+ *               default is used
+ * @sqpoll: whether a kernel thread polls the submission queue, which saves
+ *          the io_uring_enter() system call on submission
+ * @iopoll: whether completions are polled from the device instead of being
+ *          signalled by an interrupt; only O_DIRECT reads and writes can be
+ *          submitted to such a ring
+ *
+ * The parameters are applied when the io_uring ring of @ctx is set up, that
+ * is the first time a block node using aio=io_uring is attached to @ctx.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t queue_depth,
+                                     bool sqpoll, bool iopoll, Error **errp);
+
+/**
+ * aio_context_inc_busy_poll:
+ * @ctx: the aio context
+ *
+ * Keep aio_poll() from blocking, and make it call the ->io_poll() handlers
+ * of @ctx on every iteration, until aio_context_dec_busy_poll() is called.
+ * This is for event sources that do not signal their file descriptor.
+ * Must be called from the thread of @ctx.
+ */
+static inline void aio_context_inc_busy_poll(AioContext *ctx)
+{
+    ctx->busy_poll_cnt++;
+}
+
+/**
+ * aio_context_dec_busy_poll:
+ * @ctx: the aio context
+ *
+ * Undo aio_context_inc_busy_poll().
+ */
+static inline void aio_context_dec_busy_poll(AioContext *ctx)
+{
+    assert(ctx->busy_poll_cnt > 0);
+    ctx->busy_poll_cnt--;
+}
+
 #endif
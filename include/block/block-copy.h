@@ -23,6 +23,7 @@
 typedef void (*BlockCopyAsyncCallbackFunc)(void *opaque);
 typedef struct BlockCopyState BlockCopyState;
 typedef struct BlockCopyCallState BlockCopyCallState;
+typedef struct BlockCopyGroup BlockCopyGroup;
 
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      int64_t cluster_size, bool use_copy_range,
@@ -88,7 +89,35 @@ void block_copy_kick(BlockCopyCallState *call_state);
  */
 void block_copy_call_cancel(BlockCopyCallState *call_state);
 
+/*
+ * Block-copy states with the same source and cluster size may be put in a
+ * group: the data a task reads from the source is then also written to the
+ * targets of the other states of the group that still need it, so that it
+ * is read only once.  Each state keeps its own dirty bitmap, progress and
+ * errors: a failed write to the target of another state only leaves the
+ * area dirty in that state.
+ *
+ * Groups may only be changed while the source is drained, and a state must
+ * be removed from its group before it is freed.
+ */
+BlockCopyGroup *block_copy_group_new(void);
+void block_copy_group_free(BlockCopyGroup *group);
+void block_copy_group_add(BlockCopyGroup *group, BlockCopyState *s);
+void block_copy_group_remove(BlockCopyState *s);
+
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/*
+ * While @s is paused, background copies of the other states of its group
+ * do not write to its target.  Copy-before-write requests still do.
+ */
+void block_copy_set_paused(BlockCopyState *s, bool paused);
+
+/*
+ * Only copy-before-write requests write to the target of a @cbw_only
+ * state, background copies of the other states of its group don't.
+ */
+void block_copy_set_cbw_only(BlockCopyState *s, bool cbw_only);
+
 #endif /* BLOCK_COPY_H */
@@ -562,6 +562,7 @@ void bdrv_next_cleanup(BdrvNextIterator *it);
 
 BlockDriverState *bdrv_next_monitor_owned(BlockDriverState *bs);
 bool bdrv_supports_compressed_writes(BlockDriverState *bs);
+bool bdrv_supports_multiqueue(BlockDriverState *bs);
 void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
                          void *opaque, bool read_only);
 const char *bdrv_get_node_name(const BlockDriverState *bs);
@@ -657,6 +658,15 @@ bool bdrv_debug_is_suspended(BlockDriverState *bs, const char *tag);
  */
 AioContext *bdrv_get_aio_context(BlockDriverState *bs);
 
+/**
+ * bdrv_get_request_aio_context:
+ *
+ * Returns: the #AioContext of the calling thread, in which a request to a
+ * multiqueue node runs, or the bound #AioContext of @bs if the calling thread
+ * has none (e.g. a worker thread, or a vCPU thread without the BQL)
+ */
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs);
+
 /**
  * Move the current coroutine to the AioContext of @bs and return the old
  * AioContext of the coroutine. Increase bs->in_flight so that draining @bs
@@ -855,6 +865,58 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                     int64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
 
+/**
+ * bdrv_co_can_sendfile:
+ *
+ * Check whether [@offset, @offset + @bytes) of @child can be sent with
+ * bdrv_co_sendfile().  This is only possible if no driver on the way
+ * transforms the data.  Callers that need to commit to sending the data
+ * before it is read, for example by sending a header, should check this
+ * first.
+ *
+ * Returns: true if bdrv_co_sendfile() is expected to succeed.  It may still
+ * return -ENOTSUP if the graph or the image file changed in the meantime,
+ * or the first time that the host file system turns out not to support it.
+ **/
+bool coroutine_fn bdrv_co_can_sendfile(BdrvChild *child, int64_t offset,
+                                       int64_t bytes);
+
+/**
+ * bdrv_co_sendfile:
+ *
+ * Send data of @child directly to a socket, without copying it through a
+ * user space buffer (e.g. with sendfile(2)).
+ *
+ * @child: Child to read data from
+ * @offset: offset in @child to read data
+ * @bytes: number of bytes to send
+ * @out_fd: file descriptor of the non-blocking socket to send the data to
+ *
+ * Returns: the number of bytes sent, which is less than @bytes (and may be
+ * 0) if the socket does not take more data without blocking; the caller
+ * must then wait for it to become writable and send the rest.  -ENOTSUP if
+ * the data cannot be sent this way, in which case nothing has been sent.
+ * Any other negative error code means that part of the data may have been
+ * sent.
+ **/
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd);
+
+/**
+ * bdrv_co_readahead:
+ *
+ * Read [@offset, @offset + @bytes) of @child into the host page cache, so
+ * that a following bdrv_co_sendfile() of the range does not have to wait
+ * for the disk.  Callers that hold a lock while sending use this to read
+ * the data before taking it.
+ *
+ * Returns: 0 once the data has been read, -ENOTSUP if the data would not
+ * be cached (e.g. with cache.direct=on) or cannot be read ahead, or
+ * another negative error code.
+ **/
+int coroutine_fn bdrv_co_readahead(BdrvChild *child, int64_t offset,
+                                   int64_t bytes);
+
 void bdrv_cancel_in_flight(BlockDriverState *bs);
 
 #endif
@@ -154,6 +154,23 @@ struct BlockDriver {
      */
     bool supports_backing;
 
+    /*
+     * Set if the driver can take requests for the same node from several
+     * threads at once, each thread submitting in its own AioContext.  Such
+     * a driver must not rely on the AioContext lock, must submit to the
+     * Linux AIO/io_uring/thread pool instance of the current AioContext,
+     * and gets its .bdrv_io_plug/.bdrv_io_unplug callbacks called for every
+     * (nested) plug and unplug so it can track them per thread.
+     */
+    bool supports_multiqueue;
+
+    /*
+     * Set if the allocation status returned by .bdrv_co_block_status only
+     * changes through requests to this node, so that the block layer may
+     * cache it as long as nobody else is allowed to write to the node.
+     */
+    bool supports_block_status_cache;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -332,6 +349,25 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Send [offset, offset + bytes) to the socket @out_fd without copying
+     * the data through a buffer, either by mapping the range onto a child
+     * and invoking bdrv_co_sendfile() on it, or directly if @bs is the leaf.
+     * .bdrv_co_can_sendfile checks whether this is possible the same way
+     * with bdrv_co_can_sendfile(), without sending anything.
+     *
+     * See the comments of bdrv_co_sendfile and bdrv_co_can_sendfile for the
+     * return value semantics.
+     */
+    bool coroutine_fn (*bdrv_co_can_sendfile)(BlockDriverState *bs,
+                                              int64_t offset, int64_t bytes);
+    int coroutine_fn (*bdrv_co_sendfile)(BlockDriverState *bs,
+                                         int64_t offset, int64_t bytes,
+                                         int out_fd);
+    /* See bdrv_co_readahead(); maps the range like .bdrv_co_sendfile */
+    int coroutine_fn (*bdrv_co_readahead)(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -702,6 +738,16 @@ typedef struct BlockLimits {
      */
     uint64_t max_hw_transfer;
 
+    /* Number of bytes, a multiple of the cluster size, that the driver
+     * compresses in one go when a compressed write covers several
+     * clusters.  Callers such as qemu-img convert and block-copy size their
+     * compressed writes up to this length; it is not enforced by the block
+     * layer, and a driver that sets it must accept longer requests too.
+     * If it is 0 or one cluster, callers must write one cluster per
+     * request, since that is all some drivers accept.
+     * Not inherited from children. */
+    uint64_t max_pwrite_compressed;
+
     /* memory alignment, in bytes so that no bounce buffer is needed */
     size_t min_mem_alignment;
 
@@ -839,6 +885,22 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+/*
+ * Cache of the allocation status reported by a driver's
+ * .bdrv_co_block_status, see bdrv_co_block_status() in block/io.c.
+ */
+typedef struct BdrvBlockStatusCache {
+    QemuMutex lock;
+    /* Non-overlapping extents sorted by offset, NULL if empty */
+    GTree *extents;
+    /* Incremented by every invalidation */
+    uint64_t gen;
+    /* Invalidations are rounded out to this, see bdrv_co_write_req_finish() */
+    int64_t granularity;
+    /* Updated when the permissions change, read with atomics */
+    bool enabled;
+} BdrvBlockStatusCache;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -973,6 +1035,12 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Latency of the requests submitted to this node, indexed by
+     * BlockAcctType.  Only reads, writes, flushes and discards are counted.
+     */
+    BlockLatencyLogHistogram latency_log_histogram[BLOCK_MAX_IOTYPE];
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -999,6 +1067,8 @@ struct BlockDriverState {
 
     unsigned int write_gen;               /* Current data generation */
 
+    BdrvBlockStatusCache block_status_cache;
+
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
@@ -1213,6 +1283,10 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                               const char *filter_node_name,
                               BlockCompletionFunc *cb, void *opaque,
                               bool auto_complete, Error **errp);
+
+/* Default cap for the number of parallel requests of the mirror job */
+#define MIRROR_DEFAULT_MAX_IN_FLIGHT 64
+
 /*
  * mirror_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -1236,6 +1310,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @perf: Caps for the adaptive limits of the background copy.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1252,7 +1327,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, MirrorPerf *perf, Error **errp);
 
 /*
  * backup_job_create:
@@ -1352,6 +1427,12 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs,
+                                        int64_t offset, int64_t bytes);
+void bdrv_block_status_cache_clear(BlockDriverState *bs);
+void bdrv_block_status_cache_update(BlockDriverState *bs,
+                                    uint64_t shared_perm);
+
 void blockdev_close_all_bdrv_states(void);
 
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
@@ -301,6 +301,10 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @dirty_pages: Number of pages collected so far from the per-vCPU dirty
+ *    ring; used to compute the dirty page rate of this vCPU.
+ * @throttle_us_per_full: Time in microseconds this vCPU sleeps each time its
+ *    dirty ring gets full, used by the vCPU dirty page rate limit.
  *
  * State of one CPU core or thread.
  */
@@ -378,6 +382,8 @@ struct CPUState {
     struct kvm_run *kvm_run;
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
+    uint64_t dirty_pages;
+    int64_t throttle_us_per_full;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -36,6 +36,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -53,6 +54,7 @@ struct VirtIOBlockReq;
 struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
+    QemuMutex rq_lock; /* protects rq */
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
@@ -61,6 +63,7 @@ struct VirtIOBlock {
     VMChangeStateEntry *change;
     bool dataplane_disabled;
     bool dataplane_started;
+    bool multiqueue; /* virtqueues are serviced by several iothreads */
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
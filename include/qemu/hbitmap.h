@@ -33,6 +33,10 @@ typedef struct HBitmapIter HBitmapIter;
  */
 #define HBITMAP_LEVELS         ((HBITMAP_LOG_MAX_SIZE / BITS_PER_LEVEL) + 1)
 
+/* Number of words of the last level in a chunk */
+#define HBITMAP_CHUNK_SHIFT    9
+#define HBITMAP_CHUNK_LONGS    (1 << HBITMAP_CHUNK_SHIFT)
+
 struct HBitmapIter {
     const HBitmap *hb;
 
@@ -272,6 +276,16 @@ void hbitmap_deserialize_finish(HBitmap *hb);
  */
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
 
+/**
+ * hbitmap_allocated_chunks:
+ * @hb: HBitmap to operate on.
+ *
+ * Returns the number of chunks of the last level that are allocated.  Each
+ * chunk holds HBITMAP_CHUNK_LONGS words and is only allocated while some of
+ * its bits are set.
+ */
+uint64_t hbitmap_allocated_chunks(const HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
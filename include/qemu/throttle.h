@@ -97,6 +97,11 @@ typedef struct ThrottleConfig {
 typedef struct ThrottleState {
     ThrottleConfig cfg;       /* configuration */
     int64_t previous_leak;    /* timestamp of the last leak done */
+
+    /* Lock-free accounting, see throttle_grant_credits() */
+    uint64_t credits[2];          /* credits left, accessed atomically */
+    uint64_t granted_credits[2];  /* credits handed out */
+    uint64_t credit_op_size;      /* cfg.op_size, accessed atomically */
 } ThrottleState;
 
 typedef struct ThrottleTimers {
@@ -152,6 +157,12 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              bool is_write);
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+/* lock-free accounting */
+void throttle_grant_credits(ThrottleState *ts, bool is_write, int64_t now);
+void throttle_reclaim_credits(ThrottleState *ts, bool is_write);
+bool throttle_try_consume_credits(ThrottleState *ts, bool is_write,
+                                  uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -25,6 +25,7 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *queue_ctx; /* NULL if the kicks run in VuServer->ctx */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -32,7 +33,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, except for the
+ * kicks of virtqueues that are assigned an AioContext of their own.
  */
 typedef struct {
     QIONetListener *listener;
@@ -41,6 +43,16 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    /*
+     * AioContext of each virtqueue, NULL entries (or a NULL array) stand
+     * for @ctx.  Virtqueues in other AioContexts are paused while messages
+     * are processed.
+     */
+    AioContext **queue_ctx;
+    bool queues_paused;
+    unsigned int in_flight; /* atomic */
+    Coroutine *wait_idle_co; /* atomic */
+
     /* Protected by ctx lock */
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
@@ -54,11 +66,15 @@ bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp);
 
 void vhost_user_server_stop(VuServer *server);
 
+void vhost_user_server_inc_in_flight(VuServer *server);
+void vhost_user_server_dec_in_flight(VuServer *server);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
@@ -111,6 +111,8 @@ void blk_get_perm(BlockBackend *blk, uint64_t *perm, uint64_t *shared_perm);
 void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow);
 void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow);
 void blk_set_disable_request_queuing(BlockBackend *blk, bool disable);
+void blk_set_multiqueue(BlockBackend *blk, bool enable);
+bool blk_supports_multiqueue(BlockBackend *blk);
 void blk_iostatus_enable(BlockBackend *blk);
 bool blk_iostatus_is_enabled(const BlockBackend *blk);
 BlockDeviceIoStatus blk_iostatus(const BlockBackend *blk);
@@ -269,6 +271,12 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    BlockBackend *blk_out, int64_t off_out,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
+bool coroutine_fn blk_co_can_sendfile(BlockBackend *blk, int64_t offset,
+                                      unsigned int bytes);
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 unsigned int bytes, int out_fd);
+int coroutine_fn blk_co_readahead(BlockBackend *blk, int64_t offset,
+                                  unsigned int bytes);
 
 const BdrvChild *blk_root(BlockBackend *blk);
 
@@ -0,0 +1,85 @@
+/*
+ * vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_DIRTYLIMIT_H
+#define SYSEMU_DIRTYLIMIT_H
+
+#include "hw/core/cpu.h"
+
+/*
+ * Period of the dirty page rate measurement, and thus of the throttle
+ * adjustment, in milliseconds.
+ */
+#define DIRTYLIMIT_CALC_PERIOD_MS       1000
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: the vCPU whose dirty ring just became full
+ *
+ * Called from the vCPU thread, without the BQL, each time the dirty ring
+ * of @cpu filled up.  Sleeps for the amount of time computed by the dirty
+ * limit logic so that @cpu does not exceed its dirty page rate quota.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if a dirty page rate limit is set on at least one vCPU.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_vcpu_index_valid:
+ * @cpu_index: index of a vCPU
+ *
+ * Returns: %true if @cpu_index refers to an existing vCPU.
+ */
+bool dirtylimit_vcpu_index_valid(int cpu_index);
+
+/**
+ * dirtylimit_set_vcpu:
+ * @cpu_index: index of the vCPU to (un)limit
+ * @quota: dirty page rate quota, in pages per second
+ * @enable: %true to set the limit, %false to lift it
+ *
+ * Must be called with the BQL held.  The BQL is dropped for a while when
+ * the last limit is lifted, to stop the thread measuring the dirty rates.
+ */
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable);
+
+/**
+ * dirtylimit_set_all:
+ * @quota: dirty page rate quota, in pages per second
+ * @enable: %true to set the limit, %false to lift it
+ *
+ * Same as dirtylimit_set_vcpu(), for every vCPU of the machine.
+ * Must be called with the BQL held.
+ */
+void dirtylimit_set_all(uint64_t quota, bool enable);
+
+/**
+ * dirtylimit_migration_start:
+ * @quota: dirty page rate quota, in pages per second
+ *
+ * Limit the vCPUs that do not have a limit set by the user to @quota, on
+ * behalf of migration.  Does nothing if migration already did so.  Setting
+ * or cancelling the limit of a vCPU with dirtylimit_set_vcpu() makes it the
+ * user's.  Must be called with the BQL held.
+ */
+void dirtylimit_migration_start(uint64_t quota);
+
+/**
+ * dirtylimit_migration_stop:
+ *
+ * Lift the limits set by dirtylimit_migration_start(), leaving those set by
+ * the user in place.  Must be called with the BQL held, which may be
+ * dropped like in dirtylimit_set_vcpu().
+ */
+void dirtylimit_migration_stop(void);
+
+#endif /* SYSEMU_DIRTYLIMIT_H */
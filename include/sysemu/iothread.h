@@ -40,6 +40,11 @@ struct IOThread {
 
     /* AioContext AIO engine parameters */
     int64_t aio_max_batch;
+
+    /* AioContext io_uring parameters */
+    int64_t io_uring_queue_depth;
+    bool io_uring_sqpoll;
+    bool io_uring_iopoll;
 };
 typedef struct IOThread IOThread;
 
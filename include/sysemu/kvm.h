@@ -534,6 +534,16 @@ int kvm_get_one_reg(CPUState *cs, uint64_t id, void *target);
 struct ppc_radix_page_info *kvm_get_radix_page_info(void);
 int kvm_get_max_memslots(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether the per-vCPU dirty ring is in use
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_size - return the number of entries of each vCPU dirty ring
+ */
+uint32_t kvm_dirty_ring_size(void);
+
 /* Notify resamplefd for EOI of specific interrupts. */
 void kvm_resample_fd_notify(int gsi);
 
@@ -168,6 +168,15 @@ static void iothread_set_aio_context_params(IOThread *iothread, Error **errp)
     aio_context_set_aio_params(iothread->ctx,
                                iothread->aio_max_batch,
                                errp);
+    if (*errp) {
+        return;
+    }
+
+    aio_context_set_io_uring_params(iothread->ctx,
+                                    iothread->io_uring_queue_depth,
+                                    iothread->io_uring_sqpoll,
+                                    iothread->io_uring_iopoll,
+                                    errp);
 }
 
 static void iothread_complete(UserCreatable *obj, Error **errp)
@@ -229,6 +238,9 @@ static PollParamInfo poll_shrink_info = {
 static PollParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(IOThread, aio_max_batch),
 };
+static PollParamInfo io_uring_queue_depth_info = {
+    "io-uring-queue-depth", offsetof(IOThread, io_uring_queue_depth),
+};
 
 static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
@@ -311,6 +323,77 @@ static void iothread_set_aio_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_get_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+
+    iothread_get_param(obj, v, name, opaque, errp);
+}
+
+static void iothread_set_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (!iothread_set_param(obj, v, name, opaque, errp)) {
+        return;
+    }
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_queue_depth,
+                                        iothread->io_uring_sqpoll,
+                                        iothread->io_uring_iopoll,
+                                        errp);
+    }
+}
+
+static bool iothread_get_io_uring_sqpoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_sqpoll;
+}
+
+static void iothread_set_io_uring_sqpoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->io_uring_sqpoll = value;
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_queue_depth,
+                                        iothread->io_uring_sqpoll,
+                                        iothread->io_uring_iopoll,
+                                        errp);
+    }
+}
+
+static bool iothread_get_io_uring_iopoll(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->io_uring_iopoll;
+}
+
+static void iothread_set_io_uring_iopoll(Object *obj, bool value,
+                                         Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->io_uring_iopoll = value;
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_queue_depth,
+                                        iothread->io_uring_sqpoll,
+                                        iothread->io_uring_iopoll,
+                                        errp);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -332,6 +415,16 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_aio_param,
                               iothread_set_aio_param,
                               NULL, &aio_max_batch_info);
+    object_class_property_add(klass, "io-uring-queue-depth", "int",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, &io_uring_queue_depth_info);
+    object_class_property_add_bool(klass, "io-uring-sqpoll",
+                                   iothread_get_io_uring_sqpoll,
+                                   iothread_set_io_uring_sqpoll);
+    object_class_property_add_bool(klass, "io-uring-iopoll",
+                                   iothread_get_io_uring_iopoll,
+                                   iothread_set_io_uring_iopoll);
 }
 
 static const TypeInfo iothread_info = {
@@ -382,6 +475,9 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->aio_max_batch;
+    info->io_uring_queue_depth = iothread->io_uring_queue_depth;
+    info->io_uring_sqpoll = iothread->io_uring_sqpoll;
+    info->io_uring_iopoll = iothread->io_uring_iopoll;
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
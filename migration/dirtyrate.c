@@ -14,9 +14,18 @@
 #include <zlib.h>
 #include "qapi/error.h"
 #include "cpu.h"
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
 #include "qemu/rcu_queue.h"
+#include "qapi/clone-visitor.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "sysemu/kvm.h"
+#include "migration/blocker.h"
+#include "migration/misc.h"
 #include "ram.h"
 #include "trace.h"
 #include "dirtyrate.h"
@@ -27,6 +36,9 @@
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
 
+/* Keeps migration from starting during a dirty-bitmap measurement */
+static Error *dirty_bitmap_migration_blocker;
+
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
     int64_t current_time;
@@ -68,36 +80,83 @@ static int dirtyrate_set_state(int *state, int old_state, int new_state)
     }
 }
 
+/*
+ * Dirty rate in MB/s of @pages distinct pages written in @msec milliseconds.
+ */
+static int64_t do_calculate_dirtyrate(uint64_t pages, int64_t msec)
+{
+    return (pages * TARGET_PAGE_SIZE * 1000 / msec) >> 20;
+}
+
+/* Called with the BQL held */
 static struct DirtyRateInfo *query_dirty_rate_info(void)
 {
     int64_t dirty_rate = DirtyStat.dirty_rate;
     struct DirtyRateInfo *info = g_malloc0(sizeof(DirtyRateInfo));
+    int i;
 
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+
+        if (DirtyStat.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate = QAPI_CLONE(DirtyRateVcpuList,
+                                               DirtyStat.vcpu_dirty_rate);
+        } else if (DirtyStat.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+            uint64List **tail = &info->region_histogram;
+
+            info->has_ramblock_dirty_rate = true;
+            info->ramblock_dirty_rate =
+                QAPI_CLONE(DirtyRateRamBlockList,
+                           DirtyStat.ramblock_dirty_rate);
+            info->has_hot_regions = true;
+            info->hot_regions = QAPI_CLONE(DirtyRateRegionList,
+                                           DirtyStat.hot_regions);
+            info->has_region_histogram = true;
+            for (i = 0; i < DIRTYRATE_REGION_HISTOGRAM_BUCKETS; i++) {
+                QAPI_LIST_APPEND(tail, DirtyStat.region_histogram[i]);
+            }
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
     info->sample_pages = DirtyStat.sample_pages;
+    info->mode = DirtyStat.mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
     return info;
 }
 
-static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
-                                uint64_t sample_pages)
+static void init_dirtyrate_stat(int64_t start_time,
+                                struct DirtyRateConfig config)
 {
     DirtyStat.total_dirty_samples = 0;
     DirtyStat.total_sample_count = 0;
     DirtyStat.total_block_mem_MB = 0;
     DirtyStat.dirty_rate = -1;
     DirtyStat.start_time = start_time;
-    DirtyStat.calc_time = calc_time;
-    DirtyStat.sample_pages = sample_pages;
+    DirtyStat.calc_time = config.sample_period_seconds;
+    DirtyStat.sample_pages = config.sample_pages_per_gigabytes;
+    DirtyStat.mode = config.mode;
+    memset(DirtyStat.region_histogram, 0, sizeof(DirtyStat.region_histogram));
+}
+
+/*
+ * Called with the BQL held, while no measurement is in progress, so that
+ * query_dirty_rate_info() never looks at freed results.
+ */
+static void cleanup_dirtyrate_stat(void)
+{
+    qapi_free_DirtyRateVcpuList(DirtyStat.vcpu_dirty_rate);
+    DirtyStat.vcpu_dirty_rate = NULL;
+    qapi_free_DirtyRateRamBlockList(DirtyStat.ramblock_dirty_rate);
+    DirtyStat.ramblock_dirty_rate = NULL;
+    qapi_free_DirtyRateRegionList(DirtyStat.hot_regions);
+    DirtyStat.hot_regions = NULL;
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -334,14 +393,13 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
     int64_t msec = 0;
     int64_t initial_time;
 
-    rcu_register_thread();
     rcu_read_lock();
     initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
@@ -364,6 +422,235 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
 out:
     rcu_read_unlock();
     free_ramblock_dirty_info(block_dinfo, block_count);
+}
+
+typedef struct VcpuDirtyPages {
+    int cpu_index;
+    uint64_t start_pages;
+} VcpuDirtyPages;
+
+/*
+ * Measure the dirty rate of each vCPU from the number of pages collected
+ * from its dirty ring during the period.
+ */
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    VcpuDirtyPages *vcpus;
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    CPUState *cpu;
+    uint64_t total_pages = 0;
+    int64_t initial_time, msec;
+    int nvcpu = 0, i;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+
+    /* Collect the pages dirtied so far so that they are not accounted */
+    memory_global_dirty_log_sync();
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    CPU_FOREACH(cpu) {
+        nvcpu++;
+    }
+    vcpus = g_new0(VcpuDirtyPages, nvcpu);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        vcpus[i].cpu_index = cpu->cpu_index;
+        vcpus[i].start_pages = qatomic_read(&cpu->dirty_pages);
+        i++;
+    }
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+
+    for (i = 0; i < nvcpu; i++) {
+        DirtyRateVcpu *rate;
+        uint64_t pages;
+
+        cpu = qemu_get_cpu(vcpus[i].cpu_index);
+        if (!cpu) {
+            /* Unplugged during the measurement */
+            continue;
+        }
+
+        pages = qatomic_read(&cpu->dirty_pages) - vcpus[i].start_pages;
+        total_pages += pages;
+
+        rate = g_new0(DirtyRateVcpu, 1);
+        rate->id = vcpus[i].cpu_index;
+        rate->dirty_rate = do_calculate_dirtyrate(pages, msec);
+        trace_dirtyrate_calculate_vcpu(rate->id, rate->dirty_rate);
+        QAPI_LIST_APPEND(tail, rate);
+    }
+
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(total_pages, msec);
+    DirtyStat.vcpu_dirty_rate = head;
+    qemu_mutex_unlock_iothread();
+
+    g_free(vcpus);
+}
+
+typedef struct DirtyRegion {
+    RAMBlock *block;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t dirty_pages;
+} DirtyRegion;
+
+static gint dirty_region_cmp(gconstpointer a, gconstpointer b)
+{
+    const DirtyRegion *ra = a, *rb = b;
+
+    /* Hottest first */
+    if (ra->dirty_pages == rb->dirty_pages) {
+        return 0;
+    }
+    return ra->dirty_pages > rb->dirty_pages ? -1 : 1;
+}
+
+/*
+ * Count the distinct pages written during the period in each region of
+ * DIRTYRATE_REGION_SIZE of each RAMBlock, using the migration client of
+ * the dirty log bitmap.  Called with the BQL held.
+ */
+static void record_dirtyrate_regions(int64_t msec)
+{
+    DirtyRateRamBlockList *blocks = NULL, **blocks_tail = &blocks;
+    DirtyRateRegionList *regions = NULL, **regions_tail = &regions;
+    GArray *hot = g_array_new(false, false, sizeof(DirtyRegion));
+    uint64_t total_pages = 0;
+    RAMBlock *block;
+    int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        DirtyRateRamBlock *info;
+        uint64_t used_length = qemu_ram_get_used_length(block);
+        uint64_t block_pages = 0;
+        uint64_t offset;
+
+        for (offset = 0; offset < used_length;
+             offset += DIRTYRATE_REGION_SIZE) {
+            DirtyRegion region = {
+                .block = block,
+                .offset = offset,
+                .size = MIN(DIRTYRATE_REGION_SIZE, used_length - offset),
+            };
+            uint64_t region_pages = region.size >> TARGET_PAGE_BITS;
+            int bucket;
+
+            region.dirty_pages = cpu_physical_memory_count_dirty(
+                block->offset + offset, region.size, DIRTY_MEMORY_MIGRATION);
+            block_pages += region.dirty_pages;
+
+            bucket = region_pages ? region.dirty_pages *
+                     DIRTYRATE_REGION_HISTOGRAM_BUCKETS / region_pages : 0;
+            bucket = MIN(bucket, DIRTYRATE_REGION_HISTOGRAM_BUCKETS - 1);
+            DirtyStat.region_histogram[bucket]++;
+
+            if (region.dirty_pages) {
+                g_array_append_val(hot, region);
+            }
+        }
+
+        info = g_new0(DirtyRateRamBlock, 1);
+        info->idstr = g_strdup(qemu_ram_get_idstr(block));
+        info->size = used_length;
+        info->dirty_pages = block_pages;
+        info->dirty_rate = do_calculate_dirtyrate(block_pages, msec);
+        trace_dirtyrate_calculate_ramblock(info->idstr, info->dirty_pages);
+        QAPI_LIST_APPEND(blocks_tail, info);
+
+        total_pages += block_pages;
+    }
+
+    g_array_sort(hot, dirty_region_cmp);
+    for (i = 0; i < MIN(hot->len, DIRTYRATE_HOT_REGIONS_MAX); i++) {
+        DirtyRegion *region = &g_array_index(hot, DirtyRegion, i);
+        DirtyRateRegion *info = g_new0(DirtyRateRegion, 1);
+
+        info->idstr = g_strdup(qemu_ram_get_idstr(region->block));
+        info->offset = region->offset;
+        info->size = region->size;
+        info->dirty_pages = region->dirty_pages;
+        info->dirty_rate = do_calculate_dirtyrate(region->dirty_pages, msec);
+        QAPI_LIST_APPEND(regions_tail, info);
+    }
+    g_array_free(hot, true);
+
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(total_pages, msec);
+    DirtyStat.ramblock_dirty_rate = blocks;
+    DirtyStat.hot_regions = regions;
+}
+
+/*
+ * Measure the exact number of distinct pages written during the period
+ * with the dirty log bitmap.  This uses (and clears) the migration client
+ * of the bitmap, so it must not run concurrently with migration.
+ */
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    int64_t initial_time, msec;
+    RAMBlock *block;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+
+    /* Start from a clean bitmap, so that only this period is accounted */
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            cpu_physical_memory_test_and_clear_dirty(block->offset,
+                                                     block->used_length,
+                                                     DIRTY_MEMORY_MIGRATION);
+        }
+    }
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+    record_dirtyrate_regions(msec);
+
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+
+    migrate_del_blocker(dirty_bitmap_migration_blocker);
+    error_free(dirty_bitmap_migration_blocker);
+    dirty_bitmap_migration_blocker = NULL;
+    qemu_mutex_unlock_iothread();
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    rcu_register_thread();
+
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        calculate_dirtyrate_dirty_ring(config);
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        calculate_dirtyrate_dirty_bitmap(config);
+        break;
+    default:
+        calculate_dirtyrate_sample_vm(config);
+        break;
+    }
+
     rcu_unregister_thread();
 }
 
@@ -372,8 +659,6 @@ void *get_dirtyrate_thread(void *arg)
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
     int ret;
     int64_t start_time;
-    int64_t calc_time;
-    uint64_t sample_pages;
 
     ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_UNSTARTED,
                               DIRTY_RATE_STATUS_MEASURING);
@@ -383,9 +668,7 @@ void *get_dirtyrate_thread(void *arg)
     }
 
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
-    calc_time = config.sample_period_seconds;
-    sample_pages = config.sample_pages_per_gigabytes;
-    init_dirtyrate_stat(start_time, calc_time, sample_pages);
+    init_dirtyrate_stat(start_time, config);
 
     calculate_dirtyrate(config);
 
@@ -398,7 +681,8 @@ void *get_dirtyrate_thread(void *arg)
 }
 
 void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
-                         int64_t sample_pages, Error **errp)
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -407,7 +691,8 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
     /*
      * If the dirty rate is already being measured, don't attempt to start.
      */
-    if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURING) {
+    if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURING ||
+        dirty_bitmap_migration_blocker) {
         error_setg(errp, "the dirty rate is already being measured.");
         return;
     }
@@ -430,6 +715,23 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "mode dirty-ring requires the KVM dirty ring "
+                   "to be enabled.");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP && !migration_is_idle()) {
+        error_setg(errp, "mode dirty-bitmap cannot be used while migration "
+                   "is running.");
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -439,9 +741,25 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         error_setg(errp, "init dirty rate calculation state failed.");
         return;
     }
+    cleanup_dirtyrate_stat();
+
+    /*
+     * The BQL is dropped during the measurement, so migration must be
+     * kept from starting until it is over.
+     */
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        error_setg(&dirty_bitmap_migration_blocker,
+                   "the dirty rate is being measured with mode dirty-bitmap");
+        if (migrate_add_blocker(dirty_bitmap_migration_blocker, errp) < 0) {
+            error_free(dirty_bitmap_migration_blocker);
+            dirty_bitmap_migration_blocker = NULL;
+            return;
+        }
+    }
 
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -463,13 +781,63 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
                    info->sample_pages);
     monitor_printf(mon, "Period: %"PRIi64" (sec)\n",
                    info->calc_time);
+    monitor_printf(mon, "Mode: %s\n",
+                   DirtyRateMeasureMode_str(info->mode));
     monitor_printf(mon, "Dirty rate: ");
     if (info->has_dirty_rate) {
         monitor_printf(mon, "%"PRIi64" (MB/s)\n", info->dirty_rate);
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
-    g_free(info);
+
+    if (info->has_vcpu_dirty_rate) {
+        DirtyRateVcpuList *rate;
+
+        for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+            monitor_printf(mon, "vcpu[%"PRIi64"], Dirty rate: %"PRIi64
+                           " (MB/s)\n", rate->value->id,
+                           rate->value->dirty_rate);
+        }
+    }
+
+    if (info->has_ramblock_dirty_rate) {
+        DirtyRateRamBlockList *block;
+
+        for (block = info->ramblock_dirty_rate; block; block = block->next) {
+            monitor_printf(mon, "RAMBlock %s: %"PRIu64" dirty pages, "
+                           "Dirty rate: %"PRIi64" (MB/s)\n",
+                           block->value->idstr, block->value->dirty_pages,
+                           block->value->dirty_rate);
+        }
+    }
+
+    if (info->has_hot_regions) {
+        DirtyRateRegionList *region;
+
+        monitor_printf(mon, "Hot regions:\n");
+        for (region = info->hot_regions; region; region = region->next) {
+            monitor_printf(mon, "  %s @ 0x%"PRIx64" (%"PRIu64" MiB): "
+                           "%"PRIu64" dirty pages, %"PRIi64" (MB/s)\n",
+                           region->value->idstr, region->value->offset,
+                           region->value->size >> 20,
+                           region->value->dirty_pages,
+                           region->value->dirty_rate);
+        }
+    }
+
+    if (info->has_region_histogram) {
+        uint64List *bucket;
+        int i = 0;
+
+        monitor_printf(mon, "Regions by fraction of dirtied pages:\n");
+        for (bucket = info->region_histogram; bucket; bucket = bucket->next) {
+            monitor_printf(mon, "  %3d%% - %3d%%: %"PRIu64"\n",
+                           i * 10, (i + 1) * 10, bucket->value);
+            i++;
+        }
+    }
+
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
@@ -477,6 +845,9 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
     int64_t sec = qdict_get_try_int(qdict, "second", 0);
     int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
     bool has_sample_pages = (sample_pages != -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
     Error *err = NULL;
 
     if (!sec) {
@@ -484,7 +855,25 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (dirty_ring && dirty_bitmap) {
+        monitor_printf(mon, "Either dirty ring or dirty bitmap "
+                       "can be specified!\n");
+        return;
+    }
+
+    if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    } else if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    }
+
+    if (has_sample_pages && mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        monitor_printf(mon, "sample_pages_per_GB is only used in "
+                       "page-sampling mode!\n");
+        return;
+    }
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true, mode, &err);
     if (err) {
         hmp_handle_error(mon, err);
         return;
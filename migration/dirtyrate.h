@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "qapi/qapi-types-migration.h"
+
 /*
  * Sample 512 pages per GB as default.
  */
@@ -40,9 +42,23 @@
 #define MIN_SAMPLE_PAGE_COUNT                     128
 #define MAX_SAMPLE_PAGE_COUNT                     16384
 
+/*
+ * Size of the regions of a RAMBlock whose dirty rates are reported in
+ * dirty-bitmap mode, and number of the hottest regions reported.
+ */
+#define DIRTYRATE_REGION_SIZE                     (64 * MiB)
+#define DIRTYRATE_HOT_REGIONS_MAX                 16
+
+/*
+ * Number of buckets of the region histogram, each bucket covering 10% of
+ * the pages of a region.
+ */
+#define DIRTYRATE_REGION_HISTOGRAM_BUCKETS        10
+
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* mechanism used for the measurement */
 };
 
 /*
@@ -69,6 +85,11 @@ struct DirtyRateStat {
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
     uint64_t sample_pages; /* sample pages per GB */
+    DirtyRateMeasureMode mode; /* mechanism used for the measurement */
+    DirtyRateVcpuList *vcpu_dirty_rate; /* dirty-ring mode results */
+    DirtyRateRamBlockList *ramblock_dirty_rate; /* dirty-bitmap mode results */
+    DirtyRateRegionList *hot_regions; /* dirty-bitmap mode results */
+    uint64_t region_histogram[DIRTYRATE_REGION_HISTOGRAM_BUCKETS];
 };
 
 void *get_dirtyrate_thread(void *arg);
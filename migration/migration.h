@@ -45,6 +45,22 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Channels RAM pages can be sent over.  With postcopy-preempt, the pages
+ * requested by the destination during postcopy go over their own channel.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
+/*
+ * Number of buckets of the postcopy page fault latency histogram; bucket i
+ * counts the requests served in [2^i, 2^(i+1)) microseconds.
+ */
+#define POSTCOPY_LATENCY_BUCKETS          24
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -81,8 +97,20 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary pages that are later 'placed', one per channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* RAMBlock of the last page received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+
+    /* Channel the urgent pages come over with postcopy-preempt */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted when postcopy_qemufile_dst is set, or when we give up on it */
+    QemuSemaphore postcopy_qemufile_dst_sem;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool      preempt_thread_quit;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -110,7 +138,10 @@ struct MigrationIncomingState {
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 
-    /* A tree of pages that we requested to the source VM */
+    /*
+     * A tree of pages that we requested to the source VM, along with the
+     * time (QEMU_CLOCK_REALTIME, in us) we did so
+     */
     GTree *page_requested;
     /* For debugging purpose only, but would be nice to keep */
     int page_requested_count;
@@ -126,6 +157,11 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+    /*
+     * Histogram of the time it took for the requested pages to be placed,
+     * protected by page_request_mutex
+     */
+    uint64_t page_latency_histogram[POSTCOPY_LATENCY_BUCKETS];
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -156,6 +192,14 @@ struct MigrationState {
     QEMUBH *cleanup_bh;
     /* Protected by qemu_file_lock */
     QEMUFile *to_dst_file;
+    /*
+     * Channel for the pages requested by the destination during postcopy,
+     * only with postcopy-preempt.  Protected by qemu_file_lock, only used
+     * by the migration thread.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once postcopy_qemufile_src is connected, or failed to */
+    QemuSemaphore postcopy_qemufile_src_sem;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file/from_dst_file pointers.  We need to make sure we
@@ -332,6 +376,7 @@ bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
+bool migrate_dirty_limit(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
@@ -357,6 +402,8 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_postcopy_multifd(void);
 bool migrate_background_snapshot(void);
 
 /* Sending on the return path - generic and then for each message type */
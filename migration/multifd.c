@@ -19,6 +19,7 @@
 #include "qapi/error.h"
 #include "ram.h"
 #include "migration.h"
+#include "postcopy-ram.h"
 #include "socket.h"
 #include "tls.h"
 #include "qemu-file.h"
@@ -339,6 +340,12 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if ((p->flags & MULTIFD_FLAG_POSTCOPY) && !migrate_postcopy_multifd()) {
+        error_setg(errp, "multifd: received postcopy packet "
+                   "but postcopy-multifd is not enabled");
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
@@ -355,6 +362,24 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+        /* Each page is placed on its own, it has to be a whole host page */
+        if (qemu_ram_pagesize(block) != qemu_target_page_size()) {
+            error_setg(errp, "multifd: postcopy packet for ram block %s "
+                       "with page size %zu", block->idstr,
+                       qemu_ram_pagesize(block));
+            return -1;
+        }
+        if (p->postcopy_buf_pages < p->pages->used) {
+            qemu_vfree(p->postcopy_buf);
+            p->postcopy_buf_pages = p->pages->allocated;
+            p->postcopy_buf = qemu_memalign(qemu_target_page_size(),
+                                            p->postcopy_buf_pages *
+                                            qemu_target_page_size());
+        }
+    }
+    p->pages->block = block;
+
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -364,7 +389,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->used_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * qemu_target_page_size();
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
@@ -446,6 +477,9 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
@@ -582,6 +616,10 @@ void multifd_send_sync_main(QEMUFile *f)
     if (!migrate_use_multifd()) {
         return;
     }
+    if (migration_in_postcopy() && !multifd_send_active()) {
+        /* The channels were stopped by a postcopy network failure */
+        return;
+    }
     if (multifd_send_state->pages->used) {
         if (multifd_send_pages(f) < 0) {
             error_report("%s: multifd_send_pages fail", __func__);
@@ -619,6 +657,46 @@ void multifd_send_sync_main(QEMUFile *f)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Whether the multifd channels can still carry pages.  They stop on
+ * errors, and when postcopy pauses, as the recovery does not reconnect
+ * them.
+ */
+bool multifd_send_active(void)
+{
+    return migrate_use_multifd() &&
+           !qatomic_read(&multifd_send_state->exiting);
+}
+
+/*
+ * Called by the migration thread when postcopy pauses on a network
+ * failure.  Only the main channel is brought back on recovery, so stop
+ * the multifd channels: the pages they lost were not placed by the
+ * destination, which reports them as not received, so the recovery sends
+ * them again over the main channel.
+ */
+void multifd_send_postcopy_pause(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    trace_multifd_send_postcopy_pause();
+
+    multifd_send_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        /* Don't leave the threads stuck writing to a broken socket */
+        qemu_mutex_lock(&p->mutex);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -925,6 +1003,10 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* set once the destination listens for postcopy page faults */
+    QemuEvent postcopy_listen;
+    /* set once the channels were stopped by a postcopy network failure */
+    bool postcopy_paused;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_recv_state;
@@ -961,6 +1043,8 @@ static void multifd_recv_terminate_threads(Error *err)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+    /* Threads could be waiting to place postcopy pages */
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -1002,8 +1086,12 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        qemu_vfree(p->postcopy_buf);
+        p->postcopy_buf = NULL;
+        p->postcopy_buf_pages = 0;
         multifd_recv_state->ops->recv_cleanup(p);
     }
+    qemu_event_destroy(&multifd_recv_state->postcopy_listen);
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
@@ -1020,6 +1108,10 @@ void multifd_recv_sync_main(void)
     if (!migrate_use_multifd()) {
         return;
     }
+    if (qatomic_read(&multifd_recv_state->postcopy_paused)) {
+        /* The source no longer syncs the stopped channels */
+        return;
+    }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1040,6 +1132,88 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Called by the destination once it registered the guest memory with
+ * userfaultfd: from then on the channels can place postcopy pages.
+ */
+void multifd_recv_postcopy_listen(void)
+{
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
+}
+
+/*
+ * Called by the destination when postcopy pauses on a network failure.
+ * The recovery only reconnects the main channel, so stop the multifd
+ * ones for the rest of the migration; the pages they did not place are
+ * not marked as received, and the source sends them again.
+ */
+void multifd_recv_postcopy_pause(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    trace_multifd_recv_postcopy_pause();
+
+    qatomic_set(&multifd_recv_state->postcopy_paused, true);
+    multifd_recv_terminate_threads(NULL);
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        /* Wake up the threads waiting for a sync that won't come */
+        qemu_sem_post(&p->sem_sync);
+    }
+}
+
+/**
+ * multifd_recv_postcopy_place: place the pages of a postcopy packet
+ *
+ * During postcopy the guest memory is registered with userfaultfd, so
+ * the pages can't be read in place: they are read into postcopy_buf and
+ * copied atomically into the guest, waking up any thread waiting for
+ * them.  The source only sends them once postcopy started, but they can
+ * overtake the discard of the dirty pages on the main channel, so wait
+ * for the destination to listen before placing anything.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int multifd_recv_postcopy_place(MultiFDRecvParams *p, uint32_t used,
+                                       Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+    int ret;
+
+    qemu_event_wait(&multifd_recv_state->postcopy_listen);
+    if (p->quit) {
+        return 0;
+    }
+
+    for (i = 0; i < used; i++) {
+        ret = postcopy_place_page(mis, block->host + p->pages->offset[i],
+                                  p->postcopy_buf + i * page_size, block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd %d: failed to place page "
+                             "at offset 0x" RAM_ADDR_FMT " of ram block %s",
+                             p->id, p->pages->offset[i], block->idstr);
+            return -1;
+        }
+    }
+    trace_multifd_recv_postcopy_place(p->id, block->idstr, used);
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1088,6 +1262,12 @@ static void *multifd_recv_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            if (flags & MULTIFD_FLAG_POSTCOPY) {
+                ret = multifd_recv_postcopy_place(p, used, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
         }
 
         if (flags & MULTIFD_FLAG_SYNC) {
@@ -1100,6 +1280,15 @@ static void *multifd_recv_thread(void *opaque)
         multifd_recv_terminate_threads(local_err);
         error_free(local_err);
     }
+    if (migration_incoming_get_current()->state ==
+        MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        /*
+         * The network failed during postcopy.  Don't let the main thread
+         * wait for this channel to sync, it has to notice the failure
+         * on the main channel and pause.
+         */
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
     qemu_mutex_lock(&p->mutex);
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
@@ -1124,6 +1313,7 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listen, false);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -20,7 +20,11 @@ int multifd_load_cleanup(Error **errp);
 bool multifd_recv_all_channels_created(void);
 bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
+void multifd_recv_postcopy_listen(void);
+void multifd_recv_postcopy_pause(void);
 void multifd_send_sync_main(QEMUFile *f);
+bool multifd_send_active(void);
+void multifd_send_postcopy_pause(void);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 
 /* Multifd Compression flags */
@@ -33,6 +37,9 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 
+/* The pages of this packet have to be placed atomically (postcopy) */
+#define MULTIFD_FLAG_POSTCOPY (1 << 4)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -145,6 +152,10 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* pages of postcopy packets are received here before being placed */
+    uint8_t *postcopy_buf;
+    /* number of pages postcopy_buf can hold */
+    uint32_t postcopy_buf_pages;
     /* used for de-compression methods */
     void *data;
 } MultiFDRecvParams;
@@ -21,10 +21,14 @@
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
 #include "savevm.h"
+#include "socket.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
+#include "qemu/host-utils.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
 #include "sysemu/sysemu.h"
@@ -157,10 +161,25 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
     return list;
 }
 
+static uint64List *get_page_latency_histogram(MigrationIncomingState *mis)
+{
+    uint64List *list = NULL;
+    int i;
+
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        for (i = POSTCOPY_LATENCY_BUCKETS - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(list, mis->page_latency_histogram[i]);
+        }
+    }
+
+    return list;
+}
+
 /*
  * This function just populates MigrationInfo from postcopy's
- * blocktime context. It will not populate MigrationInfo,
- * unless postcopy-blocktime capability was set.
+ * page latency histogram, once postcopy started, and from its
+ * blocktime context. The latter is not populated unless
+ * postcopy-blocktime capability was set.
  *
  * @info: pointer to MigrationInfo to populate
  */
@@ -169,6 +188,11 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    if (postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        info->has_postcopy_latency_histogram = true;
+        info->postcopy_latency_histogram = get_page_latency_histogram(mis);
+    }
+
     if (!bc) {
         return;
     }
@@ -530,8 +554,35 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * When postcopy went fine, the source ends the preempt channel
+         * after its last urgent page, and the thread must place the pages
+         * that are still in flight.  Otherwise, or if the channel was
+         * never connected, kick it out.
+         */
+        if (mis->state != MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+            !qatomic_read(&mis->postcopy_qemufile_dst)) {
+            qatomic_set(&mis->preempt_thread_quit, true);
+            /* It may have been connected in the meantime */
+            if (qatomic_read(&mis->postcopy_qemufile_dst)) {
+                qemu_file_shutdown(mis->postcopy_qemufile_dst);
+            }
+            qemu_sem_post(&mis->postcopy_qemufile_dst_sem);
+        }
+        trace_postcopy_ram_incoming_cleanup_preempt_join();
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -566,9 +617,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1062,8 +1115,37 @@ retry:
     return NULL;
 }
 
+/*
+ * Load the pages the source sends over the postcopy preempt channel, once
+ * it is connected.  A failure is only reported: the main channel notices
+ * the network failures as well, and pauses postcopy.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_sem);
+    while (!ret && !qatomic_read(&mis->preempt_thread_quit)) {
+        ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    }
+    if (ret < 0 && !qatomic_read(&mis->preempt_thread_quit)) {
+        error_report("%s: failed to load urgent pages: %s", __func__,
+                     strerror(-ret));
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1102,14 +1184,19 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (i == RAM_CHANNEL_POSTCOPY && !migrate_postcopy_preempt()) {
+            continue;
+        }
+        mis->postcopy_tmp_pages[i] = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_pages[i] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[i] = NULL;
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
     }
 
     /*
@@ -1128,11 +1215,43 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        memset(mis->page_latency_histogram, 0,
+               sizeof(mis->page_latency_histogram));
+    }
+
+    if (migrate_postcopy_preempt()) {
+        qatomic_set(&mis->preempt_thread_quit, false);
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
+    /* The multifd channels can now place the pages they receive */
+    multifd_recv_postcopy_listen();
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Account the time it took for the page requested at @req_time to be placed
+ * at @host_addr.  Called with page_request_mutex held.
+ */
+static void postcopy_page_latency_account(MigrationIncomingState *mis,
+                                          void *host_addr, int64_t req_time)
+{
+    int64_t latency = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - req_time;
+    int bucket = 0;
+
+    if (latency > 1) {
+        bucket = MIN(63 - clz64(latency), POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+    mis->page_latency_histogram[bucket]++;
+    trace_postcopy_page_req_latency(host_addr, latency);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1154,6 +1273,8 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
+        int64_t *req_time;
+
         qemu_mutex_lock(&mis->page_request_mutex);
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
@@ -1161,7 +1282,9 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        req_time = g_tree_lookup(mis->page_requested, host_addr);
+        if (req_time) {
+            postcopy_page_latency_account(mis, host_addr, *req_time);
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1312,6 +1435,75 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        trace_postcopy_preempt_send_channel_error(
+            error_get_pretty(local_err));
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        trace_postcopy_preempt_send_channel_new();
+        /* Urgent pages are small writes that must not be delayed */
+        qio_channel_set_delay(ioc, false);
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+            s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        }
+    }
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * postcopy_preempt_setup: connect the postcopy preempt channel
+ *
+ * Called by the migration thread at the start of postcopy, once the multifd
+ * channels (if any) are all connected, so that the destination can tell
+ * the preempt channel apart from them.
+ *
+ * Returns 0 on success
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "postcopy-preempt does not support TLS");
+        return -1;
+    }
+    if (!socket_send_channel_available()) {
+        error_setg(errp, "postcopy-preempt requires a socket transport");
+        return -1;
+    }
+
+    trace_postcopy_preempt_setup();
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+
+    if (!s->postcopy_qemufile_src) {
+        error_setg(errp, "failed to connect the postcopy preempt channel");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * postcopy_preempt_new_channel: the postcopy preempt channel got connected
+ *
+ * The pages sent over it are loaded by the postcopy preempt thread.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* The preempt thread does blocking reads, as the listen thread */
+    qemu_file_set_blocking(file, true);
+    qatomic_set(&mis->postcopy_qemufile_dst, file);
+    trace_postcopy_preempt_new_channel();
+    qemu_sem_post(&mis->postcopy_qemufile_dst_sem);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
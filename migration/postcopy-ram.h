@@ -106,6 +106,14 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/*
+ * With postcopy-preempt, connect the channel the pages requested by the
+ * destination are sent over during postcopy.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+/* The postcopy preempt channel got connected on the destination */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 /*
  * To be called once at the start before any device initialisation
  */
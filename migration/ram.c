@@ -51,6 +51,7 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
@@ -307,6 +308,10 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Channel rs->f currently points to, see ram_save_switch_channel() */
+    int channel;
+    /* Last block sent on each channel while rs->f points to another one */
+    RAMBlock *channel_last_sent_block[RAM_CHANNEL_MAX];
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -397,6 +402,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The page was requested by the destination */
+    bool         urgent;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -639,6 +646,21 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/**
+ * migration_dirty_limit_guest: limit the dirty page rate of the vCPUs
+ *
+ * Rather than slowing all the vCPUs down like mig_throttle_guest_down()
+ * does, only throttle the vCPUs that dirty memory faster than the
+ * vcpu-dirty-limit parameter.  Called with the BQL held.
+ */
+static void migration_dirty_limit_guest(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    trace_migration_dirty_limit_guest(s->parameters.vcpu_dirty_limit);
+    dirtylimit_migration_start(s->parameters.vcpu_dirty_limit);
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -961,7 +983,8 @@ static void migration_trigger_throttle(RAMState *rs)
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+    if ((migrate_auto_converge() || migrate_dirty_limit()) &&
+        !blk_mig_bulk_active()) {
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -972,8 +995,12 @@ static void migration_trigger_throttle(RAMState *rs)
             (++rs->dirty_rate_high_cnt >= 2)) {
             trace_migration_throttle();
             rs->dirty_rate_high_cnt = 0;
-            mig_throttle_guest_down(bytes_dirty_period,
-                                    bytes_dirty_threshold);
+            if (migrate_dirty_limit()) {
+                migration_dirty_limit_guest();
+            } else {
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_dirty_threshold);
+            }
         }
     }
 }
@@ -1821,6 +1848,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
          * really rare.
          */
         pss->complete_round = false;
+        pss->urgent = true;
     }
 
     return !!block;
@@ -1965,6 +1993,32 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+/*
+ * Do not use multifd for:
+ * 1. Compression as the first page in the new block should be posted out
+ *    before sending the compressed page
+ * 2. In postcopy, unless postcopy-multifd is enabled, as one whole host page
+ *    should be placed.  Even then, only for the background pages of blocks
+ *    whose host pages are target pages, that the destination can place one
+ *    by one; the pages requested by the destination are sent right away
+ *    instead of waiting for a multifd packet to be filled.  The multifd
+ *    channels are not reconnected when postcopy recovers from a network
+ *    failure, so the main channel carries everything from then on.
+ */
+static bool save_page_use_multifd(RAMState *rs, PageSearchStatus *pss)
+{
+    if (save_page_use_compression(rs) || !migrate_use_multifd()) {
+        return false;
+    }
+
+    if (!migration_in_postcopy()) {
+        return true;
+    }
+
+    return migrate_postcopy_multifd() && multifd_send_active() &&
+           !pss->urgent && pss->block->page_size == TARGET_PAGE_SIZE;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -2003,14 +2057,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (save_page_use_multifd(rs, pss)) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -2079,6 +2126,84 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+static bool postcopy_preempt_active(void)
+{
+    return migrate_postcopy_preempt() && migration_in_postcopy() &&
+           migrate_get_current()->postcopy_qemufile_src;
+}
+
+/*
+ * ram_save_switch_channel: make rs->f point to @f, used for @channel
+ *
+ * RAM_SAVE_FLAG_CONTINUE refers to the last block sent over the same
+ * channel, so each channel keeps track of its own.
+ */
+static void ram_save_switch_channel(RAMState *rs, int channel, QEMUFile *f)
+{
+    if (rs->channel == channel) {
+        return;
+    }
+
+    rs->channel_last_sent_block[rs->channel] = rs->last_sent_block;
+    rs->last_sent_block = rs->channel_last_sent_block[channel];
+    rs->channel = channel;
+    rs->f = f;
+}
+
+/**
+ * ram_save_host_page_urgent: send a host page the destination asked for
+ *
+ * With postcopy-preempt, the pages requested by the destination go over
+ * their own channel so that they do not wait behind the background stream.
+ * Each batch of them is ended with an EOS, see ram_load_postcopy_preempt().
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *f = s->postcopy_qemufile_src;
+    int pages, ret;
+
+    ram_save_switch_channel(rs, RAM_CHANNEL_POSTCOPY, f);
+    pages = ram_save_host_page(rs, pss, last_stage);
+    if (pages > 0) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        ram_counters.transferred += 8;
+        qemu_fflush(f);
+    }
+    ram_save_switch_channel(rs, RAM_CHANNEL_PRECOPY, s->to_dst_file);
+
+    trace_ram_save_host_page_urgent(pss->block->idstr, pss->page, pages);
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        /* Let the migration thread notice it, as for the main channel */
+        qemu_file_set_error(s->to_dst_file, ret);
+        return ret;
+    }
+    return pages;
+}
+
+/*
+ * Tell the destination that no more urgent pages will come over the
+ * postcopy preempt channel, see ram_load_postcopy_preempt().
+ */
+static void ram_save_preempt_end(void)
+{
+    QEMUFile *f = migrate_get_current()->postcopy_qemufile_src;
+
+    if (f) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(f);
+    }
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2115,6 +2240,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
+        pss.urgent = false;
         found = get_queued_page(rs, &pss);
 
         if (!found) {
@@ -2122,7 +2248,9 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        if (pss.urgent && postcopy_preempt_active()) {
+            pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2218,7 +2346,7 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        memory_global_dirty_log_stop();
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2237,6 +2365,8 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    memset(rs->channel_last_sent_block, 0,
+           sizeof(rs->channel_last_sent_block));
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_enabled = false;
@@ -2680,7 +2810,7 @@ static void ram_init_bitmaps(RAMState *rs)
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
     }
@@ -3008,6 +3138,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
+        ram_save_preempt_end();
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -3087,10 +3218,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel @f belongs to
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3117,6 +3251,8 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
+
     return block;
 }
 
@@ -3437,7 +3573,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3449,7 +3585,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3526,19 +3662,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt thread
+ * through ram_load_postcopy_preempt().
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *host_page = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3568,7 +3706,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3667,7 +3805,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3703,6 +3843,36 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load a batch of urgent pages
+ *
+ * Returns 0 for success, 1 when the source ended the channel, or -errno in
+ * case of error
+ *
+ * Called by the postcopy preempt thread, see ram_save_host_page_urgent().
+ *
+ * @f: QEMUFile of the postcopy preempt channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    uint8_t *buf;
+    int ret;
+
+    /* An empty batch ends the channel, see ram_save_preempt_end() */
+    if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) != sizeof(uint64_t)) {
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+        qemu_file_skip(f, sizeof(uint64_t));
+        return 1;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    }
+    return ret;
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -3809,7 +3979,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3986,7 +4157,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -32,6 +32,15 @@ struct SocketOutgoingArgs {
     SocketAddress *saddr;
 } outgoing_args;
 
+/*
+ * Whether further channels can be connected to the destination of the
+ * outgoing migration with socket_send_channel_create()
+ */
+bool socket_send_channel_available(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 void socket_send_channel_create(QIOTaskFunc f, void *data)
 {
     QIOChannelSocket *sioc = qio_channel_socket_new();
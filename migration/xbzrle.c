@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,46 +25,102 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoder walks the buffers alternating between the two kinds of run.
+ * Finding where each run ends is where the time goes, so that is done by
+ * a pair of scanning functions for each instruction set:
+ *  - the zrun scan returns the index of the first byte from @i on that
+ *    differs between @old_buf and @new_buf, or @slen;
+ *  - the nzrun scan returns the index of the first byte from @i on that
+ *    is the same in both buffers, or @slen.
+ * Every variant produces exactly the same encoding.
+ */
+typedef int (*xbzrle_scan_fn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen);
+
+static int zrun_scan_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
             i++;
-            res--;
         }
+    }
+
+    return i;
+}
+
+static int nzrun_scan_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
                 i += sizeof(long);
-                zrun_len += sizeof(long);
             }
+        }
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
+    return i;
+}
+
+static inline QEMU_ALWAYS_INLINE int
+xbzrle_encode_buffer_common(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen,
+                            xbzrle_scan_fn zrun_scan,
+                            xbzrle_scan_fn nzrun_scan)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
         }
 
+        zrun_len = zrun_scan(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
+
         /* buffer unchanged */
         if (zrun_len == slen) {
             return 0;
@@ -76,56 +133,213 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = nzrun_scan(old_buf, new_buf, i, slen) - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
 }
 
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_common(old_buf, new_buf, slen, dst, dlen,
+                                       zrun_scan_int, nzrun_scan_int);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Compare 32 bytes at a time, the sub-vector tail goes the scalar way */
+static int zrun_scan_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i old_v = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i new_v = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(old_v, new_v));
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+
+    return zrun_scan_int(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_scan_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i old_v = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i new_v = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(old_v, new_v));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+
+    return nzrun_scan_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_common(old_buf, new_buf, slen, dst, dlen,
+                                       zrun_scan_avx2, nzrun_scan_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+/* Compare 64 bytes at a time, the sub-vector tail goes the scalar way */
+static int zrun_scan_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    while (i + 64 <= slen) {
+        __m512i old_v = _mm512_loadu_si512(old_buf + i);
+        __m512i new_v = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(old_v, new_v);
+
+        if (eq != UINT64_MAX) {
+            return i + ctz64(~eq);
+        }
+        i += 64;
+    }
+
+    return zrun_scan_int(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_scan_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    while (i + 64 <= slen) {
+        __m512i old_v = _mm512_loadu_si512(old_buf + i);
+        __m512i new_v = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(old_v, new_v);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+        i += 64;
+    }
+
+    return nzrun_scan_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_common(old_buf, new_buf, slen, dst, dlen,
+                                       zrun_scan_avx512, nzrun_scan_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* 0xe6:
+            *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
+            *                    and ZMM16-ZMM31 state are enabled by OS)
+            *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
+            */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX512BW_OPT || CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
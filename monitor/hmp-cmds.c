@@ -355,6 +355,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_postcopy_latency_histogram) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_uint64List(v, NULL, &info->postcopy_latency_histogram,
+                              &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy latency histogram (log2 us): %s\n",
+                       str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -448,6 +460,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
             params->max_cpu_throttle);
+        assert(params->has_vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %" PRIu64 " pages/second\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
         assert(params->has_tls_creds);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_CREDS),
@@ -1303,6 +1319,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_cpu_throttle = true;
         visit_type_uint8(v, param, &p->max_cpu_throttle, &err);
         break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_uint64(v, param, &p->vcpu_dirty_limit, &err);
+        break;
     case MIGRATION_PARAMETER_TLS_CREDS:
         p->has_tls_creds = true;
         p->tls_creds = g_new0(StrOrNull, 1);
@@ -1895,6 +1915,12 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  io-uring-queue-depth=%" PRId64 "\n",
+                       value->io_uring_queue_depth);
+        monitor_printf(mon, "  io-uring-sqpoll=%s\n",
+                       value->io_uring_sqpoll ? "on" : "off");
+        monitor_printf(mon, "  io-uring-iopoll=%s\n",
+                       value->io_uring_iopoll ? "on" : "off");
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -1861,6 +1861,95 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Whether the @size bytes of read data at @offset can be sent straight from
+ * the image file to the socket.  This is not possible when TLS encrypts the
+ * channel, or when the block layer would have to read the data into a
+ * buffer.  The decision is taken before the reply header is sent, so that
+ * read errors are still reported to the client otherwise.
+ *
+ * sendfile() runs with send_lock held, so the data is first read into the
+ * page cache here, while other replies can still be sent.  If that is not
+ * possible (e.g. with cache.direct=on), the data is read into a buffer
+ * before taking send_lock instead.
+ */
+static bool coroutine_fn nbd_client_zero_copy(NBDClient *client,
+                                              uint64_t offset, size_t size)
+{
+    BlockBackend *blk = client->exp->common.blk;
+
+    return client->ioc == QIO_CHANNEL(client->sioc) && size &&
+           blk_co_can_sendfile(blk, offset, size) &&
+           blk_co_readahead(blk, offset, size) == 0;
+}
+
+/*
+ * Send the reply header in @iov followed by @size bytes of the export at
+ * @offset, straight from the image file to the socket.  The caller checked
+ * this with nbd_client_zero_copy(), which also read the data into the page
+ * cache.  The data is sent in parts without blocking, waiting for the
+ * socket to become writable in between.
+ *
+ * As the header is already out, failing to send the data is fatal for the
+ * connection.  Only if the block layer turns out not to be able to send
+ * the data after all (if the graph changed, or the host file system does
+ * not support sendfile()) is the data read into @data instead.
+ */
+static int coroutine_fn nbd_co_send_iov_file(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             uint64_t offset, void *data,
+                                             size_t size, Error **errp)
+{
+    NBDExport *exp = client->exp;
+    struct iovec data_iov = { .iov_base = data, .iov_len = size };
+    size_t progress = 0;
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (ret < 0) {
+        goto out;
+    }
+
+    while (progress < size) {
+        ret = blk_co_sendfile(exp->common.blk, offset + progress,
+                              size - progress, client->sioc->fd);
+        trace_nbd_co_send_iov_file(offset + progress, size - progress, ret);
+        if (ret < 0) {
+            break;
+        }
+        progress += ret;
+        if (progress < size) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+        }
+    }
+
+    if (ret == -ENOTSUP && progress == 0) {
+        ret = blk_pread(exp->common.blk, offset, data, size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+            goto out;
+        }
+        ret = qio_channel_writev_all(client->ioc, &data_iov, 1,
+                                     errp) < 0 ? -EIO : 0;
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "sending data from file failed");
+    } else {
+        ret = 0;
+    }
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1915,12 +2004,17 @@ static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
+/*
+ * If @from_file, the data is sent from the export with nbd_co_send_iov_file()
+ * and @data is only used as a buffer if needed; otherwise it is the data.
+ */
 static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     uint64_t handle,
                                                     uint64_t offset,
                                                     void *data,
                                                     size_t size,
                                                     bool final,
+                                                    bool from_file,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
@@ -1936,6 +2030,9 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
+    if (from_file) {
+        return nbd_co_send_iov_file(client, iov, 1, offset, data, size, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -2011,6 +2108,10 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
+        } else if (nbd_client_zero_copy(client, offset + progress, pnum)) {
+            ret = nbd_co_send_structured_read(client, handle, offset + progress,
+                                              data + progress, pnum, final,
+                                              true, errp);
         } else {
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
@@ -2020,7 +2121,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             }
             ret = nbd_co_send_structured_read(client, handle, offset + progress,
                                               data + progress, pnum, final,
-                                              errp);
+                                              false, errp);
         }
 
         if (ret < 0) {
@@ -2418,6 +2519,25 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (nbd_client_zero_copy(client, request->from, request->len)) {
+        if (client->structured_reply) {
+            return nbd_co_send_structured_read(client, request->handle,
+                                               request->from, data,
+                                               request->len, true, true, errp);
+        } else {
+            NBDSimpleReply reply;
+            struct iovec iov[] = {
+                {.iov_base = &reply, .iov_len = sizeof(reply)},
+            };
+
+            trace_nbd_co_send_simple_reply(request->handle, 0,
+                                           nbd_err_lookup(0), request->len);
+            set_be_simple_reply(&reply, 0, request->handle);
+            return nbd_co_send_iov_file(client, iov, 1, request->from, data,
+                                        request->len, errp);
+        }
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
@@ -2428,7 +2548,8 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         if (request->len) {
             return nbd_co_send_structured_read(client, request->handle,
                                                request->from, data,
-                                               request->len, true, errp);
+                                               request->len, true, false,
+                                               errp);
         } else {
             return nbd_co_send_structured_done(client, request->handle, errp);
         }
@@ -37,9 +37,11 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/rcu.h"
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qom/object_interfaces.h"
@@ -83,6 +85,8 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_RANDOM = 278,
+    OPTION_THREADS = 279,
 };
 
 typedef enum OutputFormat {
@@ -200,6 +204,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--threads' specifies how many threads, each running '-m' coroutines,\n"
+           "       convert ranges of the image in parallel (defaults to 1)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1235,6 +1241,31 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Like is_allocated_sectors, but for compressed images that can only be
+ * written in whole clusters: the returned run is made of clusters that are
+ * either all zero or all contain data.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    int num = MIN(n, cluster_sectors);
+    bool is_zero = buffer_is_zero(buf, num * BDRV_SECTOR_SIZE);
+
+    while (num < n) {
+        int len = MIN(n - num, cluster_sectors);
+
+        if (buffer_is_zero(buf + num * BDRV_SECTOR_SIZE,
+                           len * BDRV_SECTOR_SIZE) != is_zero) {
+            break;
+        }
+        num += len;
+    }
+
+    *pnum = num;
+    return !is_zero;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first
  * sector of each buffer matches, non-zero otherwise.
@@ -1621,9 +1652,38 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
-typedef struct ImgConvertState {
+/* Size of the ranges that worker threads convert with -W */
+#define CONVERT_RANGE_SECTORS (1 * GiB / BDRV_SECTOR_SIZE)
+
+typedef struct ImgConvertState ImgConvertState;
+
+/*
+ * A set of coroutines converting ranges of the image.  With --threads, each
+ * worker runs in a thread of its own, with its own AioContext; otherwise the
+ * only worker runs in the main loop and its range is the whole image.
+ */
+typedef struct ImgConvertWorker {
+    ImgConvertState *s;
+    AioContext *ctx;
+    QemuThread thread;
+    bool stopping;
+
+    /* Protects the current range and its block status cache */
+    CoMutex lock;
+    int64_t sector_num;
+    int64_t range_end;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+
+    Coroutine *co[MAX_COROUTINES];
+    /* Protected by ImgConvertState.lock */
+    int64_t wait_sector_num[MAX_COROUTINES];
+} ImgConvertWorker;
+
+struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
     int *src_alignment;
@@ -1632,9 +1692,8 @@ typedef struct ImgConvertState {
     int64_t allocated_sectors;
     int64_t allocated_done;
     int64_t sector_num;
+    int64_t range_sectors;
     int64_t wr_offs;
-    enum ImgConvertBlockStatus status;
-    int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1650,12 +1709,13 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long num_threads;
+    ImgConvertWorker *workers;
     int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
-    CoMutex lock;
+    /* Protects sector_num, allocated_done, wr_offs and the waiting writers */
+    QemuMutex lock;
     int ret;
-} ImgConvertState;
+};
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
@@ -1669,7 +1729,8 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+static int convert_iteration_sectors(ImgConvertState *s, ImgConvertWorker *w,
+                                     int64_t sector_num)
 {
     int64_t src_cur_offset;
     int ret, n, src_cur;
@@ -1677,8 +1738,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 
     convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
-    assert(s->total_sectors > sector_num);
-    n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
+    assert(w->range_end > sector_num);
+    n = MIN(w->range_end - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->target_backing_sectors >= 0) {
         if (sector_num >= s->target_backing_sectors) {
@@ -1690,7 +1751,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (w->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1735,7 +1796,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
 
         /*
-         * Avoid that s->sector_next_status becomes unaligned to the source
+         * Avoid that w->sector_next_status becomes unaligned to the source
          * request alignment and/or cluster size to avoid unnecessary read
          * cycles.
          */
@@ -1745,18 +1806,18 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+            w->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
         } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
+            w->status = BLK_DATA;
         } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+            w->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
         }
 
-        s->sector_next_status = sector_num + n;
+        w->sector_next_status = sector_num + n;
     }
 
-    n = MIN(n, s->sector_next_status - sector_num);
-    if (s->status == BLK_DATA) {
+    n = MIN(n, w->sector_next_status - sector_num);
+    if (w->status == BLK_DATA) {
         n = MIN(n, s->buf_sectors);
     }
 
@@ -1765,8 +1826,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
      * cluster allocated. */
     if (s->compressed) {
         if (n < s->cluster_sectors) {
-            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
-            s->status = BLK_DATA;
+            n = MIN(s->cluster_sectors, w->range_end - sector_num);
+            w->status = BLK_DATA;
         } else {
             n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
         }
@@ -1852,14 +1913,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write of completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -1924,22 +1985,100 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+static void convert_set_error(ImgConvertState *s, int ret)
+{
+    ImgConvertWorker *w;
+    int i, j;
+
+    qatomic_cmpxchg(&s->ret, -EINPROGRESS, ret);
+
+    /* Writers waiting for their turn would never get it, release them */
+    qemu_mutex_lock(&s->lock);
+    for (i = 0; i < s->num_threads; i++) {
+        w = &s->workers[i];
+        for (j = 0; j < s->num_coroutines; j++) {
+            if (w->wait_sector_num[j] != -1) {
+                w->wait_sector_num[j] = -1;
+                aio_co_enter(w->ctx, w->co[j]);
+            }
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+/* Take the next range of the image, returns false once there is none left */
+static bool convert_next_range(ImgConvertState *s, ImgConvertWorker *w)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (s->sector_num >= s->total_sectors) {
+        return false;
+    }
+
+    w->sector_num = s->sector_num;
+    w->range_end = MIN(s->sector_num + s->range_sectors, s->total_sectors);
+    w->sector_next_status = 0;
+    s->sector_num = w->range_end;
+    return true;
+}
+
+/* With -W not given, wait until all data before @sector_num is written */
+static void coroutine_fn convert_co_wait_turn(ImgConvertState *s,
+                                              ImgConvertWorker *w, int index,
+                                              int64_t sector_num)
+{
+    qemu_mutex_lock(&s->lock);
+    while (s->wr_offs != sector_num && qatomic_read(&s->ret) == -EINPROGRESS) {
+        w->wait_sector_num[index] = sector_num;
+        qemu_mutex_unlock(&s->lock);
+        qemu_coroutine_yield();
+        qemu_mutex_lock(&s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void convert_end_turn(ImgConvertState *s, int64_t wr_offs)
+{
+    ImgConvertWorker *w;
+    int i, j;
+
+    qemu_mutex_lock(&s->lock);
+    s->wr_offs = wr_offs;
+
+    /*
+     * Reenter the coroutine that might have waited for this write to
+     * complete.  The entry is reset here so that it is entered only once.
+     */
+    for (i = 0; i < s->num_threads; i++) {
+        w = &s->workers[i];
+        for (j = 0; j < s->num_coroutines; j++) {
+            if (w->wait_sector_num[j] == wr_offs) {
+                w->wait_sector_num[j] = -1;
+                aio_co_enter(w->ctx, w->co[j]);
+                goto out;
+            }
+        }
+    }
+out:
+    qemu_mutex_unlock(&s->lock);
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
-    ImgConvertState *s = opaque;
+    ImgConvertWorker *w = opaque;
+    ImgConvertState *s = w->s;
     uint8_t *buf = NULL;
     int ret, i;
     int index = -1;
 
     for (i = 0; i < s->num_coroutines; i++) {
-        if (s->co[i] == qemu_coroutine_self()) {
+        if (w->co[i] == qemu_coroutine_self()) {
             index = i;
             break;
         }
     }
     assert(index >= 0);
 
-    s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
@@ -1948,42 +2087,45 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         enum ImgConvertBlockStatus status;
         bool copy_range;
 
-        qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
-            qemu_co_mutex_unlock(&s->lock);
+        qemu_co_mutex_lock(&w->lock);
+        if (qatomic_read(&s->ret) != -EINPROGRESS ||
+            (w->sector_num >= w->range_end && !convert_next_range(s, w))) {
+            qemu_co_mutex_unlock(&w->lock);
             break;
         }
-        n = convert_iteration_sectors(s, s->sector_num);
+        n = convert_iteration_sectors(s, w, w->sector_num);
         if (n < 0) {
-            qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
+            qemu_co_mutex_unlock(&w->lock);
+            convert_set_error(s, n);
             break;
         }
         /* save current sector and allocation status to local variables */
-        sector_num = s->sector_num;
-        status = s->status;
-        if (!s->min_sparse && s->status == BLK_ZERO) {
+        sector_num = w->sector_num;
+        status = w->status;
+        if (!s->min_sparse && w->status == BLK_ZERO) {
             n = MIN(n, s->buf_sectors);
         }
-        /* increment global sector counter so that other coroutines can
+        /* increment the sector counter so that other coroutines can
          * already continue reading beyond this request */
-        s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
+        w->sector_num += n;
+        qemu_co_mutex_unlock(&w->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
-            s->allocated_done += n;
-            qemu_progress_print(100.0 * s->allocated_done /
-                                        s->allocated_sectors, 0);
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                s->allocated_done += n;
+                qemu_progress_print(100.0 * s->allocated_done /
+                                            s->allocated_sectors, 0);
+            }
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                convert_set_error(s, ret);
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
@@ -1992,14 +2134,10 @@ retry:
 
         if (s->wr_in_order) {
             /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
-                qemu_coroutine_yield();
-            }
-            s->wait_sector_num[index] = -1;
+            convert_co_wait_turn(s, w, index, sector_num);
         }
 
-        if (s->ret == -EINPROGRESS) {
+        if (qatomic_read(&s->ret) == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
                 if (ret) {
@@ -2012,40 +2150,57 @@ retry:
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
-                s->ret = ret;
+                convert_set_error(s, ret);
             }
         }
 
         if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
-             * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_end_turn(s, sector_num + n);
         }
     }
 
     qemu_vfree(buf);
-    s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
-        s->ret = 0;
+    if (qatomic_fetch_dec(&s->running_coroutines) == 1) {
+        /* Wake up convert_do_copy() */
+        aio_notify(qemu_get_aio_context());
     }
 }
 
+static void *convert_worker_thread(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(w->ctx);
+
+    while (!qatomic_read(&w->stopping)) {
+        aio_poll(w->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Worker threads submit requests from their own AioContext, which every
+ * node involved must support.
+ */
+static bool convert_supports_threads(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (!blk_supports_multiqueue(s->src[i])) {
+            return false;
+        }
+    }
+    return blk_supports_multiqueue(s->target);
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
-    int ret, i, n;
+    ImgConvertWorker scan = { .s = s };
+    int ret, i, j, n;
     int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -2055,42 +2210,123 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+     * can be copied at a time, unless the target can compress several
+     * clusters in one request. */
     if (s->compressed) {
+        int64_t max_compressed = blk_bs(s->target)->bl.max_pwrite_compressed /
+                                 BDRV_SECTOR_SIZE;
+
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = MAX(QEMU_ALIGN_DOWN(MIN(s->buf_sectors,
+                                                 max_compressed),
+                                             s->cluster_sectors),
+                             s->cluster_sectors);
     }
 
+    scan.range_end = s->total_sectors;
     while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
+        n = convert_iteration_sectors(s, &scan, sector_num);
         if (n < 0) {
             return n;
         }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
+        if (scan.status == BLK_DATA ||
+            (!s->min_sparse && scan.status == BLK_ZERO))
         {
             s->allocated_sectors += n;
         }
         sector_num += n;
     }
 
+    if (s->num_threads > 1 && !convert_supports_threads(s)) {
+        if (!s->quiet) {
+            warn_report("The images cannot be accessed from several threads, "
+                        "converting with a single thread");
+        }
+        s->num_threads = 1;
+    }
+
+    /*
+     * A single worker converts the whole image as one range.  Several
+     * workers take large ranges so that they read and write sequentially,
+     * or single buffers if the writes must be in order: a worker cannot
+     * write the beginning of its range before the previous ranges are done.
+     */
+    if (s->num_threads == 1) {
+        s->range_sectors = s->total_sectors;
+    } else {
+        s->range_sectors = s->wr_in_order ? s->buf_sectors
+                                          : CONVERT_RANGE_SECTORS;
+        if (s->compressed) {
+            s->range_sectors = QEMU_ALIGN_UP(s->range_sectors,
+                                             s->cluster_sectors);
+        }
+        for (i = 0; i < s->src_num; i++) {
+            blk_set_multiqueue(s->src[i], true);
+        }
+        blk_set_multiqueue(s->target, true);
+    }
+
     /* Do the copy */
-    s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
     s->ret = -EINPROGRESS;
+    s->running_coroutines = s->num_threads * s->num_coroutines;
 
-    qemu_co_mutex_init(&s->lock);
-    for (i = 0; i < s->num_coroutines; i++) {
-        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
+    qemu_mutex_init(&s->lock);
+    s->workers = g_new0(ImgConvertWorker, s->num_threads);
+    for (i = 0; i < s->num_threads; i++) {
+        ImgConvertWorker *w = &s->workers[i];
+
+        w->s = s;
+        qemu_co_mutex_init(&w->lock);
+        for (j = 0; j < s->num_coroutines; j++) {
+            w->co[j] = qemu_coroutine_create(convert_co_do_copy, w);
+            w->wait_sector_num[j] = -1;
+        }
+
+        if (s->num_threads == 1) {
+            w->ctx = qemu_get_aio_context();
+        } else {
+            w->ctx = aio_context_new(&error_abort);
+            qemu_thread_create(&w->thread, "convert", convert_worker_thread,
+                               w, QEMU_THREAD_JOINABLE);
+        }
     }
 
-    while (s->running_coroutines) {
+    for (i = 0; i < s->num_threads; i++) {
+        for (j = 0; j < s->num_coroutines; j++) {
+            aio_co_enter(s->workers[i].ctx, s->workers[i].co[j]);
+        }
+    }
+
+    while (qatomic_read(&s->running_coroutines)) {
         main_loop_wait(false);
     }
 
+    if (s->num_threads > 1) {
+        for (i = 0; i < s->num_threads; i++) {
+            ImgConvertWorker *w = &s->workers[i];
+
+            qatomic_set(&w->stopping, true);
+            aio_notify(w->ctx);
+            qemu_thread_join(&w->thread);
+            aio_context_unref(w->ctx);
+        }
+        for (i = 0; i < s->src_num; i++) {
+            blk_set_multiqueue(s->src[i], false);
+        }
+        blk_set_multiqueue(s->target, false);
+    }
+    g_free(s->workers);
+    s->workers = NULL;
+    qemu_mutex_destroy(&s->lock);
+
+    /* the convert job finished successfully if nothing failed */
+    qatomic_cmpxchg(&s->ret, -EINPROGRESS, 0);
+
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
@@ -2208,6 +2444,7 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .num_threads        = 1,
     };
 
     for(;;) {
@@ -2221,6 +2458,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WUr:",
@@ -2352,6 +2590,15 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2379,6 +2626,11 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (rate_limit && s.num_threads > 1) {
+        error_report("Cannot limit the rate when using several threads");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -4231,14 +4483,40 @@ typedef struct BenchData {
     int n;
     int flush_interval;
     bool drain_on_flush;
+    bool random;
     uint8_t *buf;
     QEMUIOVector *qiov;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
+
+    /* Random mode: request slots are numbered from @offset on */
+    uint64_t base_offset;
+    uint64_t nr_slots;
+    uint64_t slot_mask;
+    uint64_t slot;
 } BenchData;
 
+/*
+ * Return the offset of the next request in random mode.
+ *
+ * The step-aligned slots are visited in a pseudo-random order that hits
+ * each of them exactly once per cycle: a linear congruential generator
+ * modulo a power of two has a full period when its increment is odd and
+ * its multiplier is 1 mod 4, and the values beyond the last slot are
+ * skipped.
+ */
+static uint64_t bench_next_random_offset(BenchData *b)
+{
+    do {
+        b->slot = (b->slot * 6364136223846793005ULL +
+                   1442695040888963407ULL) & b->slot_mask;
+    } while (b->slot >= b->nr_slots);
+
+    return b->base_offset + b->slot * b->step;
+}
+
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
     if (ret < 0) {
@@ -4298,8 +4576,12 @@ static void bench_cb(void *opaque, int ret)
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
+        if (b->random) {
+            b->offset = bench_next_random_offset(b);
+        } else {
+            b->offset += b->step;
+            b->offset %= b->image_size;
+        }
         if (b->write) {
             acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
         } else {
@@ -4327,6 +4609,7 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    bool random = false;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4344,6 +4627,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4475,6 +4759,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4521,11 +4808,27 @@ static int img_bench(int argc, char **argv)
         .write          = is_write,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .random         = random,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
+
+    if (random) {
+        if (offset + data.bufsize > image_size) {
+            error_report("Offset and buffer size exceed the image size");
+            ret = -1;
+            goto out;
+        }
+        data.base_offset = offset;
+        data.nr_slots = (image_size - offset - data.bufsize) / data.step + 1;
+        data.slot_mask = pow2ceil(data.nr_slots) - 1;
+        data.slot = data.slot_mask;
+        data.offset = bench_next_random_offset(&data);
+    }
+
+    printf("Sending %d %s%s requests, %d bytes each, %d in parallel "
            "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+           data.n, data.random ? "random " : "",
+           data.write ? "write" : "read", data.bufsize, data.nrreq,
+           random ? data.base_offset : data.offset, data.step);
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
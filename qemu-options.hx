@@ -5305,7 +5305,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch,io-uring-queue-depth=io-uring-queue-depth,io-uring-sqpoll=on|off,io-uring-iopoll=on|off``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5345,6 +5345,23 @@ SRST
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
 
+        The ``io-uring-queue-depth`` parameter is the number of entries of
+        the io_uring ring used by the block devices with ``aio=io_uring``
+        in this IOThread, 0 means that the default (128) is used.  If
+        ``io-uring-sqpoll`` is on, a kernel thread polls the submission
+        queue of the ring so that submitting requests does not need a
+        system call, at the cost of a host CPU spinning while requests
+        are being submitted; this requires Linux 5.11 or newer.  If
+        ``io-uring-iopoll`` is on, completions are polled from the device
+        (e.g. an NVMe drive with poll queues) rather than signalled by an
+        interrupt; only reads and writes of block devices opened with
+        ``cache.direct=on`` go through the ring then, and the IOThread
+        spins while they are in flight.  ``block-latency-histogram-set``
+        can be used to compare the latency of the devices with and
+        without it.  These parameters take effect when the ring is set
+        up, i.e. when the first such block device is attached to the
+        IOThread.
+
         The IOThread parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
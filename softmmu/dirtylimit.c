@@ -0,0 +1,478 @@
+/*
+ * vCPU dirty page rate limit
+ *
+ * Each vCPU with a dirty limit gets its dirty page rate measured from its
+ * KVM dirty ring every DIRTYLIMIT_CALC_PERIOD_MS, and is made to sleep each
+ * time its dirty ring gets full.  The sleep time is adjusted after every
+ * measurement so that the vCPU converges to its quota, leaving the vCPUs
+ * that do not dirty memory (or that are not limited) running at full speed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/memory.h"
+#include "hw/boards.h"
+#include "sysemu/cpus.h"
+#include "sysemu/dirtylimit.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
+
+/*
+ * Do not touch the throttle while the measured dirty page rate is within
+ * this many percent of the quota, to avoid oscillating around it.
+ */
+#define DIRTYLIMIT_TOLERANCE_PCT        5
+
+/* Upper bound for the time a vCPU sleeps each time its dirty ring is full */
+#define DIRTYLIMIT_THROTTLE_MAX_US      G_USEC_PER_SEC
+
+/*
+ * A throttled vCPU sleeps in slices of this length, so that it can still
+ * be stopped or run queued work in a timely manner.
+ */
+#define DIRTYLIMIT_SLEEP_SLICE_US       10000
+
+typedef struct VcpuDirtyLimitState {
+    bool enabled;
+    bool by_migration;          /* the limit was set by migration */
+    uint64_t quota;             /* dirty page rate quota, pages per second */
+    uint64_t dirty_rate;        /* last measured dirty page rate */
+    uint64_t last_dirty_pages;  /* CPUState::dirty_pages at last measure */
+} VcpuDirtyLimitState;
+
+typedef enum DirtyLimitThreadState {
+    DIRTYLIMIT_THREAD_IDLE,
+    DIRTYLIMIT_THREAD_RUNNING,
+    /* the thread is being joined, with the BQL dropped */
+    DIRTYLIMIT_THREAD_STOPPING,
+} DirtyLimitThreadState;
+
+typedef struct DirtyLimitState {
+    VcpuDirtyLimitState *states;
+    int max_cpus;
+    int limited_cpus;           /* number of vCPUs with a limit enabled */
+    bool migration;             /* migration installed its limits */
+    int64_t last_stamp_ms;
+    DirtyLimitThreadState thread_state;
+    QemuCond thread_stopped;    /* signalled when a stop is complete */
+    QemuThread thread;
+    QemuSemaphore sem;
+    bool quit;
+} DirtyLimitState;
+
+/* Protected by the BQL */
+static DirtyLimitState *dirtylimit_state;
+
+static VcpuDirtyLimitState *dirtylimit_vcpu_get(int cpu_index)
+{
+    if (cpu_index < 0 || cpu_index >= dirtylimit_state->max_cpus) {
+        return NULL;
+    }
+    return &dirtylimit_state->states[cpu_index];
+}
+
+/*
+ * Adjust the time @cpu sleeps for each full dirty ring.
+ *
+ * A vCPU fills its dirty ring of ring_size entries in ring_size / rate
+ * seconds, sleep time included.  To go from the measured @current rate to
+ * the @quota rate we have to lengthen (or shorten) each ring-full cycle by
+ * ring_size / quota - ring_size / current.
+ */
+static void dirtylimit_adjust_throttle(CPUState *cpu,
+                                       VcpuDirtyLimitState *vcpu)
+{
+    uint64_t ring_size = kvm_dirty_ring_size();
+    uint64_t quota = vcpu->quota;
+    uint64_t current = vcpu->dirty_rate;
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (current * 100 <= quota * (100 + DIRTYLIMIT_TOLERANCE_PCT) &&
+        current * 100 >= quota * (100 - DIRTYLIMIT_TOLERANCE_PCT)) {
+        return;
+    }
+
+    if (!current) {
+        sleep_us = 0;
+    } else {
+        sleep_us += (int64_t)(ring_size * G_USEC_PER_SEC / quota) -
+                    (int64_t)(ring_size * G_USEC_PER_SEC / current);
+        sleep_us = MAX(sleep_us, 0);
+        sleep_us = MIN(sleep_us, DIRTYLIMIT_THROTTLE_MAX_US);
+    }
+
+    trace_dirtylimit_adjust_throttle(cpu->cpu_index, quota, current, sleep_us);
+    qatomic_set(&cpu->throttle_us_per_full, sleep_us);
+}
+
+/* Called with the BQL held */
+static void dirtylimit_process(void)
+{
+    DirtyLimitState *s = dirtylimit_state;
+    int64_t now, period_ms;
+    CPUState *cpu;
+
+    /* Flush the dirty rings so that CPUState::dirty_pages is up to date */
+    memory_global_dirty_log_sync();
+
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    period_ms = MAX(now - s->last_stamp_ms, 1);
+    s->last_stamp_ms = now;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+        uint64_t dirty_pages = qatomic_read(&cpu->dirty_pages);
+
+        if (!vcpu) {
+            continue;
+        }
+
+        vcpu->dirty_rate = (dirty_pages - vcpu->last_dirty_pages) *
+                           1000 / period_ms;
+        vcpu->last_dirty_pages = dirty_pages;
+        trace_dirtylimit_vcpu_dirty_rate(cpu->cpu_index, vcpu->dirty_rate);
+
+        if (vcpu->enabled) {
+            dirtylimit_adjust_throttle(cpu, vcpu);
+        }
+    }
+}
+
+static void *dirtylimit_thread(void *opaque)
+{
+    DirtyLimitState *s = opaque;
+
+    rcu_register_thread();
+
+    while (!qatomic_read(&s->quit)) {
+        if (qemu_sem_timedwait(&s->sem, DIRTYLIMIT_CALC_PERIOD_MS) == 0) {
+            /* Woken up early: we are asked to quit */
+            continue;
+        }
+
+        qemu_mutex_lock_iothread();
+        dirtylimit_process();
+        qemu_mutex_unlock_iothread();
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void dirtylimit_start(void)
+{
+    DirtyLimitState *s = dirtylimit_state;
+    CPUState *cpu;
+
+    assert(s->thread_state == DIRTYLIMIT_THREAD_IDLE);
+    s->thread_state = DIRTYLIMIT_THREAD_RUNNING;
+    trace_dirtylimit_state(true);
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+
+        if (vcpu) {
+            vcpu->last_dirty_pages = qatomic_read(&cpu->dirty_pages);
+            vcpu->dirty_rate = 0;
+        }
+    }
+    s->last_stamp_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    s->quit = false;
+    qemu_sem_init(&s->sem, 0);
+    qemu_thread_create(&s->thread, "dirtylimit", dirtylimit_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * The BQL is dropped while the thread is joined, so the STOPPING state
+ * keeps dirtylimit_update() from starting it again in the meantime.
+ */
+static void dirtylimit_stop(void)
+{
+    DirtyLimitState *s = dirtylimit_state;
+
+    assert(s->thread_state == DIRTYLIMIT_THREAD_RUNNING);
+    s->thread_state = DIRTYLIMIT_THREAD_STOPPING;
+    trace_dirtylimit_state(false);
+
+    qatomic_set(&s->quit, true);
+    qemu_sem_post(&s->sem);
+
+    /* The thread may be waiting for the BQL to process a last period */
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&s->thread);
+    qemu_mutex_lock_iothread();
+
+    qemu_sem_destroy(&s->sem);
+
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+
+    s->thread_state = DIRTYLIMIT_THREAD_IDLE;
+    qemu_cond_broadcast(&s->thread_stopped);
+}
+
+/*
+ * Start or stop the thread once the limits have been updated, depending
+ * on whether any vCPU is still limited.  Called with the BQL held, after
+ * walking the vCPUs, as the BQL may be dropped.
+ */
+static void dirtylimit_update(void)
+{
+    DirtyLimitState *s = dirtylimit_state;
+
+    if (s->limited_cpus) {
+        /* Wait for a concurrent stop before starting again */
+        while (s->thread_state == DIRTYLIMIT_THREAD_STOPPING) {
+            qemu_cond_wait_iothread(&s->thread_stopped);
+        }
+        if (s->limited_cpus && s->thread_state == DIRTYLIMIT_THREAD_IDLE) {
+            dirtylimit_start();
+        }
+    } else if (s->thread_state == DIRTYLIMIT_THREAD_RUNNING) {
+        dirtylimit_stop();
+    }
+}
+
+static void dirtylimit_state_init(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+
+    if (dirtylimit_state) {
+        return;
+    }
+
+    dirtylimit_state = g_new0(DirtyLimitState, 1);
+    dirtylimit_state->max_cpus = ms->smp.max_cpus;
+    dirtylimit_state->states = g_new0(VcpuDirtyLimitState, ms->smp.max_cpus);
+    qemu_cond_init(&dirtylimit_state->thread_stopped);
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+    int64_t end_us;
+
+    if (sleep_us <= 0) {
+        return;
+    }
+
+    trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+
+    end_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) + sleep_us;
+    while (sleep_us > 0 && !cpu->stop && cpu_work_list_empty(cpu)) {
+        g_usleep(MIN(sleep_us, DIRTYLIMIT_SLEEP_SLICE_US));
+        sleep_us = end_us - qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    }
+}
+
+bool dirtylimit_in_service(void)
+{
+    return dirtylimit_state && dirtylimit_state->limited_cpus;
+}
+
+bool dirtylimit_vcpu_index_valid(int cpu_index)
+{
+    return qemu_get_cpu(cpu_index) != NULL;
+}
+
+/* The caller has to call dirtylimit_update() once done with the vCPUs */
+static void dirtylimit_do_set_vcpu(CPUState *cpu, VcpuDirtyLimitState *vcpu,
+                                   uint64_t quota, bool enable)
+{
+    trace_dirtylimit_set_vcpu(cpu->cpu_index, quota, enable);
+
+    if (enable) {
+        vcpu->quota = quota;
+        if (!vcpu->enabled) {
+            vcpu->enabled = true;
+            dirtylimit_state->limited_cpus++;
+        }
+    } else if (vcpu->enabled) {
+        vcpu->enabled = false;
+        vcpu->quota = 0;
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+        dirtylimit_state->limited_cpus--;
+    }
+}
+
+static void dirtylimit_user_set_vcpu(CPUState *cpu, uint64_t quota,
+                                     bool enable)
+{
+    VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+
+    if (!vcpu) {
+        return;
+    }
+
+    /* The limit belongs to the user from now on */
+    vcpu->by_migration = false;
+    dirtylimit_do_set_vcpu(cpu, vcpu, quota, enable);
+}
+
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable)
+{
+    CPUState *cpu = qemu_get_cpu(cpu_index);
+
+    assert(qemu_mutex_iothread_locked());
+    assert(!enable || quota);
+
+    dirtylimit_state_init();
+    if (!cpu) {
+        return;
+    }
+
+    dirtylimit_user_set_vcpu(cpu, quota, enable);
+    dirtylimit_update();
+}
+
+void dirtylimit_set_all(uint64_t quota, bool enable)
+{
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+    assert(!enable || quota);
+
+    dirtylimit_state_init();
+    CPU_FOREACH(cpu) {
+        dirtylimit_user_set_vcpu(cpu, quota, enable);
+    }
+    dirtylimit_update();
+}
+
+void dirtylimit_migration_start(uint64_t quota)
+{
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+    assert(quota);
+
+    dirtylimit_state_init();
+    if (dirtylimit_state->migration) {
+        return;
+    }
+    dirtylimit_state->migration = true;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+
+        /* Limits set by the user take precedence */
+        if (vcpu && !vcpu->enabled) {
+            vcpu->by_migration = true;
+            dirtylimit_do_set_vcpu(cpu, vcpu, quota, true);
+        }
+    }
+    dirtylimit_update();
+}
+
+void dirtylimit_migration_stop(void)
+{
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+
+    if (!dirtylimit_state || !dirtylimit_state->migration) {
+        return;
+    }
+    dirtylimit_state->migration = false;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+
+        if (vcpu && vcpu->by_migration) {
+            vcpu->by_migration = false;
+            dirtylimit_do_set_vcpu(cpu, vcpu, 0, false);
+        }
+    }
+    dirtylimit_update();
+}
+
+static bool dirtylimit_check(Error **errp)
+{
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty page rate limit requires KVM with the "
+                   "dirty ring enabled (-accel kvm,dirty-ring-size=N)");
+        return false;
+    }
+    return true;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_pages_rate, Error **errp)
+{
+    if (!dirtylimit_check(errp)) {
+        return;
+    }
+
+    if (!dirty_pages_rate) {
+        error_setg(errp, "dirty-pages-rate must be greater than zero");
+        return;
+    }
+
+    if (has_cpu_index) {
+        if (!dirtylimit_vcpu_index_valid(cpu_index)) {
+            error_setg(errp, "invalid cpu-index %" PRId64, cpu_index);
+            return;
+        }
+        dirtylimit_set_vcpu(cpu_index, dirty_pages_rate, true);
+    } else {
+        dirtylimit_set_all(dirty_pages_rate, true);
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    if (!dirtylimit_check(errp)) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        if (!dirtylimit_vcpu_index_valid(cpu_index)) {
+            error_setg(errp, "invalid cpu-index %" PRId64, cpu_index);
+            return;
+        }
+        dirtylimit_set_vcpu(cpu_index, 0, false);
+    } else {
+        dirtylimit_set_all(0, false);
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL;
+    CPUState *cpu;
+
+    if (!dirtylimit_in_service()) {
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *vcpu = dirtylimit_vcpu_get(cpu->cpu_index);
+        DirtyLimitInfo *info;
+
+        if (!vcpu || !vcpu->enabled) {
+            continue;
+        }
+
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = cpu->cpu_index;
+        info->limit_rate = vcpu->quota;
+        info->current_rate = vcpu->dirty_rate;
+        info->throttle_us_per_full = qatomic_read(&cpu->throttle_us_per_full);
+        QAPI_LIST_PREPEND(head, info);
+    }
+
+    return head;
+}
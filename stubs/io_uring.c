@@ -21,7 +21,8 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
     abort();
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned queue_depth, bool sqpoll, bool iopoll,
+                         Error **errp)
 {
     abort();
 }
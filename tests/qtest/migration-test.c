@@ -15,6 +15,8 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -474,6 +476,10 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Postcopy tests only: send the requested pages on their own channel */
+    bool postcopy_preempt;
+    /* Postcopy tests only: push the background pages over multifd */
+    bool postcopy_multifd;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -663,6 +669,8 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
+    bool postcopy_multifd = args->postcopy_multifd;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -673,6 +681,20 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
+    if (postcopy_multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+        migrate_set_capability(from, "postcopy-multifd", true);
+        migrate_set_capability(to, "postcopy-multifd", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -719,13 +741,42 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
-static void test_postcopy_recovery(void)
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_multifd(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_multifd = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void do_test_postcopy_recovery(bool postcopy_multifd)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
     g_autofree char *uri = NULL;
 
     args->hide_stderr = true;
+    args->postcopy_multifd = postcopy_multifd;
 
     if (migrate_postcopy_prepare(&from, &to, args)) {
         return;
@@ -781,6 +832,17 @@ static void test_postcopy_recovery(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_recovery(void)
+{
+    do_test_postcopy_recovery(false);
+}
+
+/* The multifd channels are dropped, the main channel sends what they lost */
+static void test_postcopy_multifd_recovery(void)
+{
+    do_test_postcopy_recovery(true);
+}
+
 static void test_baddest(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -850,6 +912,228 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_unix_common(true);
 }
 
+/* Returns the dirty page rate limit of vCPU @cpu_index, or 0 if none */
+static uint64_t get_vcpu_dirty_limit(QTestState *who, int cpu_index)
+{
+    QDict *rsp;
+    QList *list;
+    QListEntry *entry;
+    uint64_t limit = 0;
+
+    rsp = qtest_qmp(who, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    list = qdict_get_qlist(rsp, "return");
+
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *info = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (qdict_get_int(info, "cpu-index") == cpu_index) {
+            limit = qdict_get_int(info, "limit-rate");
+        }
+    }
+
+    qobject_unref(rsp);
+    return limit;
+}
+
+/*
+ * The dirty-limit capability limits the vCPUs that have no limit yet and
+ * lifts only those limits once the migration is over, leaving the ones set
+ * by the user alone.
+ */
+static void test_migrate_dirty_limit(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    const uint64_t user_limit = 8192, migration_limit = 4096;
+
+    args->use_dirty_ring = true;
+    g_free(args->opts_source);
+    g_free(args->opts_target);
+    args->opts_source = g_strdup("-smp 2");
+    args->opts_target = g_strdup("-smp 2");
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    qtest_qmp_assert_success(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                             "  'arguments': { 'cpu-index': 0,"
+                             "                 'dirty-pages-rate': %" PRIu64
+                             " } }", user_limit);
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "vcpu-dirty-limit", migration_limit);
+
+    /* Make sure the migration does not converge before throttling */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for the migration to limit the vCPU that the user did not */
+    while (get_vcpu_dirty_limit(from, 1) == 0) {
+        usleep(1000);
+        g_assert_false(got_stop);
+    }
+    g_assert_cmpint(get_vcpu_dirty_limit(from, 1), ==, migration_limit);
+    g_assert_cmpint(get_vcpu_dirty_limit(from, 0), ==, user_limit);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    g_assert_cmpint(get_vcpu_dirty_limit(from, 1), ==, 0);
+    g_assert_cmpint(get_vcpu_dirty_limit(from, 0), ==, user_limit);
+
+    test_migrate_end(from, to, true);
+}
+
+static void calc_dirty_rate(QTestState *who, const char *mode)
+{
+    qtest_qmp_assert_success(who, "{ 'execute': 'calc-dirty-rate',"
+                             "  'arguments': { 'calc-time': 1,"
+                             "                 'mode': %s } }", mode);
+}
+
+/* Wait for the measurement to complete and return its result */
+static QDict *wait_for_dirty_rate(QTestState *who)
+{
+    QDict *rsp, *info;
+
+    for (;;) {
+        rsp = qtest_qmp(who, "{ 'execute': 'query-dirty-rate' }");
+        g_assert(qdict_haskey(rsp, "return"));
+        info = qdict_get_qdict(rsp, "return");
+        if (g_str_equal(qdict_get_str(info, "status"), "measured")) {
+            break;
+        }
+        g_assert_false(qdict_haskey(info, "dirty-rate"));
+        qobject_unref(rsp);
+        usleep(1000 * 10);
+    }
+
+    qobject_ref(info);
+    qobject_unref(rsp);
+    return info;
+}
+
+/* The dirty-ring mode reports the dirty rate of each vCPU */
+static void test_dirty_rate_dirty_ring(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *info, *vcpu;
+    QList *list;
+
+    args->use_dirty_ring = true;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    calc_dirty_rate(from, "dirty-ring");
+    info = wait_for_dirty_rate(from);
+
+    g_assert_cmpstr(qdict_get_str(info, "mode"), ==, "dirty-ring");
+    g_assert_cmpint(qdict_get_int(info, "dirty-rate"), >, 0);
+    g_assert_false(qdict_haskey(info, "ramblock-dirty-rate"));
+
+    list = qdict_get_qlist(info, "vcpu-dirty-rate");
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    vcpu = qobject_to(QDict, qlist_peek(list));
+    g_assert_cmpint(qdict_get_int(vcpu, "id"), ==, 0);
+    g_assert_cmpint(qdict_get_int(vcpu, "dirty-rate"), >, 0);
+
+    qobject_unref(info);
+    test_migrate_end(from, to, false);
+}
+
+/*
+ * The dirty-bitmap mode reports the dirty rate of each RAMBlock and its
+ * regions, and keeps migration from starting until the measurement is over
+ */
+static void test_dirty_rate_dirty_bitmap(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *info, *rsp;
+    QList *list;
+    QListEntry *entry;
+    uint64_t dirty_pages = 0, regions = 0;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    calc_dirty_rate(from, "dirty-bitmap");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate',"
+                    "  'arguments': { 'uri': %s } }", uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                    "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    info = wait_for_dirty_rate(from);
+
+    g_assert_cmpstr(qdict_get_str(info, "mode"), ==, "dirty-bitmap");
+    g_assert_cmpint(qdict_get_int(info, "dirty-rate"), >, 0);
+    g_assert_false(qdict_haskey(info, "vcpu-dirty-rate"));
+
+    list = qdict_get_qlist(info, "ramblock-dirty-rate");
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *block = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert_cmpint(qdict_get_int(block, "size"), >, 0);
+        dirty_pages += qdict_get_int(block, "dirty-pages");
+    }
+    g_assert_cmpuint(dirty_pages, >, 0);
+
+    list = qdict_get_qlist(info, "hot-regions");
+    g_assert_false(qlist_empty(list));
+
+    list = qdict_get_qlist(info, "region-histogram");
+    g_assert_cmpint(qlist_size(list), ==, 10);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        regions += qnum_get_uint(qobject_to(QNum, qlist_entry_obj(entry)));
+    }
+    g_assert_cmpuint(regions, >, 0);
+
+    qobject_unref(info);
+
+    /* Migration can start once the measurement is over */
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_qmp(from, uri, "{}");
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1466,6 +1750,10 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt/unix", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/multifd/unix", test_postcopy_multifd);
+    qtest_add_func("/migration/postcopy/multifd/recovery",
+                   test_postcopy_multifd_recovery);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
@@ -1480,6 +1768,8 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/dirty_rate/dirty_bitmap",
+                   test_dirty_rate_dirty_bitmap);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
@@ -1490,6 +1780,9 @@ int main(int argc, char **argv)
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_limit", test_migrate_dirty_limit);
+        qtest_add_func("/migration/dirty_rate/dirty_ring",
+                       test_dirty_rate_dirty_ring);
     }
 
     ret = g_test_run();
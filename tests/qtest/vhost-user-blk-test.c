@@ -754,6 +754,127 @@ static void multiqueue(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+#define MQ_IOTHREADS_NUM_QUEUES 8
+
+/*
+ * Submit requests on all virtqueues of a device at once.  The export
+ * spreads its virtqueues over several iothreads, so they are processed in
+ * parallel.
+ */
+static void multiqueue_iothreads(void *obj, void *data,
+                                 QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev1 = obj;
+    QVirtioPCIDevice *pdev8;
+    QVirtioDevice *dev8;
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QVirtQueue *vq[MQ_IOTHREADS_NUM_QUEUES];
+    uint64_t req_addr[MQ_IOTHREADS_NUM_QUEUES];
+    uint32_t free_head[MQ_IOTHREADS_NUM_QUEUES];
+    QVirtioBlkReq req;
+    uint64_t features;
+    char expected[16];
+    char buf[512];
+    int i, n;
+
+    /* Hotplug a secondary device with 8 queues */
+    qtest_qmp_device_add(qts, "vhost-user-blk-pci", "drv1",
+                         "{'addr': %s, 'chardev': 'char2', 'num-queues': 8}",
+                         stringify(PCI_SLOT_HP) ".0");
+
+    pdev8 = virtio_pci_new(pdev1->pdev->bus,
+                           &(QPCIAddress) {
+                               .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                           });
+    g_assert_nonnull(pdev8);
+    g_assert_cmpint(pdev8->vdev.device_type, ==, VIRTIO_ID_BLOCK);
+
+    qos_object_start_hw(&pdev8->obj);
+
+    dev8 = &pdev8->vdev;
+    features = qvirtio_get_features(dev8);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev8, features);
+
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        vq[i] = qvirtqueue_setup(dev8, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev8);
+
+    /* Write a different sector through each virtqueue */
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        snprintf(req.data, 512, "TEST%d", i);
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev8, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(qts, vq[i], req_addr[i], 16, false,
+                                      true);
+        qvirtqueue_add(qts, vq[i], req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(qts, vq[i], req_addr[i] + 528, 1, true, false);
+        qvirtqueue_kick(qts, dev8, vq[i], free_head[i]);
+    }
+
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        qvirtio_wait_used_elem(qts, dev8, vq[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(qtest_readb(qts, req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* Read each sector back through another virtqueue */
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        n = (i + 1) % MQ_IOTHREADS_NUM_QUEUES;
+
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev8, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(qts, vq[n], req_addr[i], 16, false,
+                                      true);
+        qvirtqueue_add(qts, vq[n], req_addr[i] + 16, 512, true, true);
+        qvirtqueue_add(qts, vq[n], req_addr[i] + 528, 1, true, false);
+        qvirtqueue_kick(qts, dev8, vq[n], free_head[i]);
+    }
+
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        n = (i + 1) % MQ_IOTHREADS_NUM_QUEUES;
+
+        qvirtio_wait_used_elem(qts, dev8, vq[n], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(qtest_readb(qts, req_addr[i] + 528), ==, 0);
+
+        qtest_memread(qts, req_addr[i] + 16, buf, sizeof(buf));
+        snprintf(expected, sizeof(expected), "TEST%d", i);
+        g_assert_cmpstr(buf, ==, expected);
+
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    for (i = 0; i < MQ_IOTHREADS_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev8->bus, vq[i], t_alloc);
+    }
+    qvirtio_pci_device_disable(pdev8);
+    qos_object_destroy(&pdev8->obj);
+
+    /* unplug secondary disk */
+    qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -882,10 +1003,10 @@ static void quit_storage_daemon(void *data)
 }
 
 static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
-                                 int num_queues)
+                                 int num_queues, int num_iothreads)
 {
     const char *vhost_user_blk_bin = qtest_qemu_storage_daemon_binary();
-    int i;
+    int i, j;
     gchar *img_path;
     GString *storage_daemon_command = g_string_new(NULL);
     QemuStorageDaemonState *qsd;
@@ -898,6 +1019,11 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
             " -object memory-backend-memfd,id=mem,size=256M,share=on "
             " -M memory-backend=mem -m 256M ");
 
+    for (i = 0; i < num_iothreads; i++) {
+        g_string_append_printf(storage_daemon_command,
+                               "--object iothread,id=iothread%d ", i);
+    }
+
     for (i = 0; i < vus_instances; i++) {
         int fd;
         char *sock_path = create_listen_socket(&fd);
@@ -907,8 +1033,13 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
         g_string_append_printf(storage_daemon_command,
             "--blockdev driver=file,node-name=disk%d,filename=%s "
             "--export type=vhost-user-blk,id=disk%d,addr.type=unix,addr.path=%s,"
-            "node-name=disk%i,writable=on,num-queues=%d ",
+            "node-name=disk%i,writable=on,num-queues=%d",
             i, img_path, i, sock_path, i, num_queues);
+        for (j = 0; j < num_iothreads; j++) {
+            g_string_append_printf(storage_daemon_command,
+                                   ",iothreads.%d=iothread%d", j, j);
+        }
+        g_string_append_c(storage_daemon_command, ' ');
 
         g_string_append_printf(cmd_line, "-chardev socket,id=char%d,path=%s ",
                                i + 1, sock_path);
@@ -942,7 +1073,7 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
 
 static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 1, 1);
+    start_vhost_user_blk(cmd_line, 1, 1, 0);
     return arg;
 }
 
@@ -956,13 +1087,20 @@ static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 static void *vhost_user_blk_hotplug_test_setup(GString *cmd_line, void *arg)
 {
     /* "-chardev socket,id=char2" is used for pci_hotplug*/
-    start_vhost_user_blk(cmd_line, 2, 1);
+    start_vhost_user_blk(cmd_line, 2, 1, 0);
     return arg;
 }
 
 static void *vhost_user_blk_multiqueue_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 2, 8);
+    start_vhost_user_blk(cmd_line, 2, 8, 0);
+    return arg;
+}
+
+static void *vhost_user_blk_iothreads_test_setup(GString *cmd_line,
+                                                 void *arg)
+{
+    start_vhost_user_blk(cmd_line, 2, 8, 4);
     return arg;
 }
 
@@ -992,6 +1130,10 @@ static void register_vhost_user_blk_test(void)
 
     opts.before = vhost_user_blk_multiqueue_test_setup;
     qos_add_test("multiqueue", "vhost-user-blk-pci", multiqueue, &opts);
+
+    opts.before = vhost_user_blk_iothreads_test_setup;
+    qos_add_test("multiqueue-iothreads", "vhost-user-blk-pci",
+                 multiqueue_iothreads, &opts);
 }
 
 libqos_init(register_vhost_user_blk_test);
@@ -620,7 +620,9 @@ static void test_propagate_mirror(void)
                  MIRROR_SYNC_MODE_NONE, MIRROR_OPEN_BACKING_CHAIN, false,
                  BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
                  false, "filter_node", MIRROR_COPY_MODE_BACKGROUND,
-                 &error_abort);
+                 &(MirrorPerf) {
+                     .max_in_flight = MIRROR_DEFAULT_MAX_IN_FLIGHT,
+                 }, &error_abort);
     job = job_get("job0");
     filter = bdrv_find_node("filter_node");
 
@@ -708,6 +710,98 @@ static void test_attach_second_node(void)
     blk_unref(blk);
 }
 
+/* A multiqueue driver whose reads take a while */
+static AioContext *mq_read_ctx;
+
+static int coroutine_fn bdrv_test_mq_co_preadv(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
+{
+    qatomic_set(&mq_read_ctx, qemu_get_current_aio_context());
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 10000000);
+    return 0;
+}
+
+static BlockDriver bdrv_test_mq = {
+    .format_name            = "test-mq",
+    .instance_size          = 1,
+    .supports_multiqueue    = true,
+
+    .bdrv_co_preadv         = bdrv_test_mq_co_preadv,
+};
+
+typedef struct TestMultiqueueData {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    uint8_t buf[512];
+    bool done;
+} TestMultiqueueData;
+
+static void test_multiqueue_read_cb(void *opaque, int ret)
+{
+    TestMultiqueueData *data = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    qatomic_set(&data->done, true);
+}
+
+static void test_multiqueue_submit(void *opaque)
+{
+    TestMultiqueueData *data = opaque;
+
+    blk_aio_preadv(data->blk, 0, &data->qiov, 0, test_multiqueue_read_cb, data);
+}
+
+static void test_multiqueue_drain(void *opaque)
+{
+    TestMultiqueueData *data = opaque;
+    AioContext *ctx = blk_get_aio_context(data->blk);
+
+    aio_context_acquire(ctx);
+    blk_drain(data->blk);
+    aio_context_release(ctx);
+
+    g_assert_true(qatomic_read(&data->done));
+}
+
+/*
+ * Test that a request submitted to a multiqueue node from another iothread
+ * than the home AioContext of the node runs in the submitting iothread, and
+ * that a drain in the home iothread is woken up when it completes.
+ */
+static void test_multiqueue(void)
+{
+    IOThread *home = iothread_new();
+    IOThread *other = iothread_new();
+    AioContext *home_ctx = iothread_get_aio_context(home);
+    AioContext *other_ctx = iothread_get_aio_context(other);
+    TestMultiqueueData data = {};
+    BlockDriverState *bs;
+
+    data.blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test_mq, "base", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(data.blk, bs, &error_abort);
+    blk_set_aio_context(data.blk, home_ctx, &error_abort);
+    blk_set_multiqueue(data.blk, true);
+    g_assert_true(blk_supports_multiqueue(data.blk));
+    qemu_iovec_init_buf(&data.qiov, data.buf, sizeof(data.buf));
+
+    aio_context_acquire(other_ctx);
+    aio_wait_bh_oneshot(other_ctx, test_multiqueue_submit, &data);
+    aio_context_release(other_ctx);
+    g_assert(qatomic_read(&mq_read_ctx) == other_ctx);
+
+    aio_context_acquire(home_ctx);
+    aio_wait_bh_oneshot(home_ctx, test_multiqueue_drain, &data);
+    blk_set_aio_context(data.blk, qemu_get_aio_context(), &error_abort);
+    aio_context_release(home_ctx);
+
+    bdrv_unref(bs);
+    blk_unref(data.blk);
+}
+
 static void test_attach_preserve_blk_ctx(void)
 {
     IOThread *iothread = iothread_new();
@@ -763,6 +857,7 @@ int main(int argc, char **argv)
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
+    g_test_add_func("/multiqueue/submit_and_drain", test_multiqueue);
 
     return g_test_run();
 }
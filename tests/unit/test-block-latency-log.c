@@ -0,0 +1,166 @@
+/*
+ * Log-linear block latency histogram tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+#include "qemu/thread.h"
+
+#define TEST_THREADS        (2 * BLOCK_LOG_HIST_SHARDS)
+#define TEST_THREAD_COUNT   10000
+
+/* Return the bucket that @latency_ns is counted in */
+static int test_bucket(int64_t latency_ns)
+{
+    BlockLatencyLogHistogram hist = {};
+    uint64_t bins[BLOCK_LOG_HIST_BUCKETS];
+    int bucket = -1;
+    int i;
+
+    block_latency_log_account(&hist, latency_ns);
+    g_assert_true(block_latency_log_read(&hist, bins));
+
+    for (i = 0; i < BLOCK_LOG_HIST_BUCKETS; i++) {
+        if (bins[i]) {
+            g_assert_cmpint(bins[i], ==, 1);
+            g_assert_cmpint(bucket, ==, -1);
+            bucket = i;
+        }
+    }
+    g_assert_cmpint(bucket, >=, 0);
+
+    block_latency_log_cleanup(&hist);
+    return bucket;
+}
+
+static void test_small(void)
+{
+    int i;
+
+    /* Below BLOCK_LOG_HIST_SUB_BUCKETS, each nanosecond has its bucket */
+    for (i = 0; i < BLOCK_LOG_HIST_SUB_BUCKETS; i++) {
+        g_assert_cmpint(block_latency_log_bucket_start(i), ==, i);
+        g_assert_cmpint(test_bucket(i), ==, i);
+    }
+    g_assert_cmpint(test_bucket(BLOCK_LOG_HIST_SUB_BUCKETS), ==,
+                    BLOCK_LOG_HIST_SUB_BUCKETS);
+}
+
+static void test_boundaries(void)
+{
+    uint64_t start, next;
+    int i;
+
+    for (i = 0; i < BLOCK_LOG_HIST_BUCKETS; i++) {
+        start = block_latency_log_bucket_start(i);
+        next = block_latency_log_bucket_start(i + 1);
+
+        g_assert_cmpuint(start, <, next);
+        g_assert_cmpint(test_bucket(start), ==, i);
+        g_assert_cmpint(test_bucket(next - 1), ==, i);
+    }
+}
+
+static void test_width(void)
+{
+    uint64_t start, width;
+    int i;
+
+    /* A bucket is at most 1/8 as wide as the latencies it counts */
+    for (i = BLOCK_LOG_HIST_SUB_BUCKETS; i < BLOCK_LOG_HIST_BUCKETS; i++) {
+        start = block_latency_log_bucket_start(i);
+        width = block_latency_log_bucket_start(i + 1) - start;
+
+        g_assert_cmpuint(width * BLOCK_LOG_HIST_SUB_BUCKETS, <=, start);
+    }
+}
+
+static void test_limits(void)
+{
+    /* Negative latencies (clock going backwards) count as 0 */
+    g_assert_cmpint(test_bucket(-1), ==, 0);
+    g_assert_cmpint(test_bucket(INT64_MIN), ==, 0);
+
+    g_assert_cmpuint(block_latency_log_bucket_start(BLOCK_LOG_HIST_BUCKETS),
+                     ==, 1ULL << BLOCK_LOG_HIST_MAX_BITS);
+    g_assert_cmpint(test_bucket(1LL << BLOCK_LOG_HIST_MAX_BITS), ==,
+                    BLOCK_LOG_HIST_BUCKETS - 1);
+    g_assert_cmpint(test_bucket(INT64_MAX), ==, BLOCK_LOG_HIST_BUCKETS - 1);
+}
+
+static void test_empty(void)
+{
+    BlockLatencyLogHistogram hist = {};
+    uint64_t bins[BLOCK_LOG_HIST_BUCKETS];
+    int i;
+
+    g_assert_false(block_latency_log_read(&hist, bins));
+    for (i = 0; i < BLOCK_LOG_HIST_BUCKETS; i++) {
+        g_assert_cmpint(bins[i], ==, 0);
+    }
+}
+
+static void *test_threads_entry(void *opaque)
+{
+    BlockLatencyLogHistogram *hist = opaque;
+    int i;
+
+    for (i = 0; i < TEST_THREAD_COUNT; i++) {
+        block_latency_log_account(hist, i);
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    BlockLatencyLogHistogram hist = {};
+    QemuThread threads[TEST_THREADS];
+    uint64_t bins[BLOCK_LOG_HIST_BUCKETS];
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        qemu_thread_create(&threads[i], "test", test_threads_entry, &hist,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < TEST_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    /* The shards add up to everything that was counted */
+    g_assert_true(block_latency_log_read(&hist, bins));
+    for (i = 0; i < BLOCK_LOG_HIST_BUCKETS; i++) {
+        total += bins[i];
+    }
+    g_assert_cmpuint(total, ==, TEST_THREADS * TEST_THREAD_COUNT);
+    g_assert_cmpuint(bins[0], ==, TEST_THREADS);
+
+    block_latency_log_cleanup(&hist);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-latency-log/small", test_small);
+    g_test_add_func("/block-latency-log/boundaries", test_boundaries);
+    g_test_add_func("/block-latency-log/width", test_width);
+    g_test_add_func("/block-latency-log/limits", test_limits);
+    g_test_add_func("/block-latency-log/empty", test_empty);
+    g_test_add_func("/block-latency-log/threads", test_threads);
+
+    return g_test_run();
+}
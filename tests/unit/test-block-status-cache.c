@@ -0,0 +1,208 @@
+/*
+ * Block status cache tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+#define TEST_CLUSTER_SIZE   (64 * 1024)
+#define TEST_CLUSTERS       16
+#define TEST_IMAGE_SIZE     (TEST_CLUSTERS * TEST_CLUSTER_SIZE)
+
+typedef struct BDRVTestState {
+    bool allocated[TEST_CLUSTERS];
+    int block_status_calls;
+} BDRVTestState;
+
+static int coroutine_fn bdrv_test_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    qemu_iovec_memset(qiov, 0, 0, bytes);
+    return 0;
+}
+
+/* Like a format driver, writing any part of a cluster allocates all of it */
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVTestState *s = bs->opaque;
+    uint64_t i;
+
+    for (i = offset / TEST_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(offset + bytes, TEST_CLUSTER_SIZE); i++)
+    {
+        s->allocated[i] = true;
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset, int64_t count,
+                                                  int64_t *pnum, int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+    int64_t cluster_end = QEMU_ALIGN_UP(offset + 1, TEST_CLUSTER_SIZE);
+
+    s->block_status_calls++;
+
+    *pnum = MIN(count, cluster_end - offset);
+    *map = offset;
+    *file = bs;
+    return s->allocated[offset / TEST_CLUSTER_SIZE] ?
+           BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID : 0;
+}
+
+static int bdrv_test_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = TEST_CLUSTER_SIZE;
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name                    = "test",
+    .instance_size                  = sizeof(BDRVTestState),
+    .supports_block_status_cache    = true,
+
+    .bdrv_co_preadv                 = bdrv_test_co_preadv,
+    .bdrv_co_pwritev                = bdrv_test_co_pwritev,
+    .bdrv_co_block_status           = bdrv_test_co_block_status,
+    .bdrv_get_info                  = bdrv_test_get_info,
+};
+
+static BlockBackend *test_open(uint64_t shared_perm)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+
+    blk = blk_new(qemu_get_aio_context(),
+                  BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE, shared_perm);
+    bs = bdrv_new_open_driver(&bdrv_test, "base", BDRV_O_RDWR, &error_abort);
+    bs->total_sectors = TEST_IMAGE_SIZE / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    return blk;
+}
+
+static int test_block_status(BlockBackend *blk, int64_t offset, int64_t bytes,
+                             int64_t *pnum)
+{
+    int ret;
+
+    ret = bdrv_block_status(blk_bs(blk), offset, bytes, pnum, NULL, NULL);
+    g_assert_cmpint(ret, >=, 0);
+    return ret & BDRV_BLOCK_DATA;
+}
+
+static int test_calls(BlockBackend *blk)
+{
+    BDRVTestState *s = blk_bs(blk)->opaque;
+
+    return s->block_status_calls;
+}
+
+static void test_hit(void)
+{
+    BlockBackend *blk = test_open(BLK_PERM_ALL & ~BLK_PERM_WRITE);
+    int64_t pnum;
+
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(pnum, ==, TEST_CLUSTER_SIZE);
+    g_assert_cmpint(test_calls(blk), ==, 1);
+
+    /* Answered from the cache, also in the middle of the extent */
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_block_status(blk, 4096, 4096, &pnum), ==, 0);
+    g_assert_cmpint(pnum, ==, 4096);
+    g_assert_cmpint(test_calls(blk), ==, 1);
+
+    blk_unref(blk);
+}
+
+static void test_invalidate_cluster(void)
+{
+    BlockBackend *blk = test_open(BLK_PERM_ALL & ~BLK_PERM_WRITE);
+    uint8_t buf[512] = { 0 };
+    int64_t pnum;
+
+    /* Cache two extents that end in the middle of cluster 0 */
+    g_assert_cmpint(test_block_status(blk, 0, 4096, &pnum), ==, 0);
+    g_assert_cmpint(test_block_status(blk, 4096, 4096, &pnum), ==, 0);
+    g_assert_cmpint(test_calls(blk), ==, 2);
+
+    /* Allocates all of cluster 0, so both extents are stale */
+    g_assert_cmpint(blk_pwrite(blk, 0, buf, sizeof(buf), 0), ==, sizeof(buf));
+
+    g_assert_cmpint(test_block_status(blk, 4096, 4096, &pnum), ==,
+                    BDRV_BLOCK_DATA);
+    g_assert_cmpint(test_calls(blk), ==, 3);
+
+    /* Cluster 1 was not touched */
+    g_assert_cmpint(test_block_status(blk, TEST_CLUSTER_SIZE, 4096, &pnum),
+                    ==, 0);
+    g_assert_cmpint(test_block_status(blk, TEST_CLUSTER_SIZE, 4096, &pnum),
+                    ==, 0);
+    g_assert_cmpint(test_calls(blk), ==, 4);
+
+    blk_unref(blk);
+}
+
+static void test_shared_write(void)
+{
+    BlockBackend *blk = test_open(BLK_PERM_ALL);
+    int64_t pnum;
+
+    /* Others may write to the node, so nothing is cached */
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_calls(blk), ==, 2);
+
+    /* The decision is taken again when the permissions change */
+    blk_set_perm(blk, BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE,
+                 BLK_PERM_ALL & ~BLK_PERM_WRITE, &error_abort);
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_calls(blk), ==, 3);
+
+    blk_set_perm(blk, BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE,
+                 BLK_PERM_ALL, &error_abort);
+    g_assert_cmpint(test_block_status(blk, 0, TEST_CLUSTER_SIZE, &pnum), ==, 0);
+    g_assert_cmpint(test_calls(blk), ==, 4);
+
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-cache/hit", test_hit);
+    g_test_add_func("/block-status-cache/invalidate-cluster",
+                    test_invalidate_cluster);
+    g_test_add_func("/block-status-cache/shared-write", test_shared_write);
+
+    return g_test_run();
+}
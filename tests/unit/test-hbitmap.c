@@ -13,6 +13,8 @@
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
 #include "block/block.h"
+#include "crypto/hash.h"
+#include "qapi/error.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -20,6 +22,9 @@
 #define L2                         (BITS_PER_LONG * L1)
 #define L3                         (BITS_PER_LONG * L2)
 
+/* Bits of the last level in a chunk */
+#define CHUNK                      (HBITMAP_CHUNK_LONGS * BITS_PER_LONG)
+
 typedef struct TestHBitmapData {
     HBitmap       *hb;
     unsigned long *bits;
@@ -1042,6 +1047,133 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void test_hbitmap_chunks_reset(TestHBitmapData *data,
+                                      const void *unused)
+{
+    hbitmap_test_init(data, 4 * CHUNK, 0);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 0);
+
+    /* Chunks are allocated where bits are set, also across a boundary */
+    hbitmap_test_set(data, CHUNK - 10, 20);
+    hbitmap_test_set(data, 3 * CHUNK + 5, 1);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 3);
+
+    /* Resetting the last bits of a chunk frees it */
+    hbitmap_test_reset(data, CHUNK - 10, 10);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+
+    /* ... but not before */
+    hbitmap_test_reset(data, CHUNK, 5);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+    hbitmap_test_reset(data, CHUNK + 5, 5);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 1);
+
+    /* A range larger than the set bits also frees the chunk */
+    hbitmap_test_reset(data, 2 * CHUNK, 2 * CHUNK);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 0);
+
+    /* Freed chunks can be allocated again */
+    hbitmap_test_set(data, 0, 4 * CHUNK);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 4);
+    hbitmap_test_reset_all(data);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 0);
+}
+
+static void test_hbitmap_chunks_deserialize(TestHBitmapData *data,
+                                            const void *unused)
+{
+    hbitmap_test_init(data, 3 * CHUNK, 0);
+    hbitmap_test_set(data, 0, 10);
+
+    /* Zeroes do not allocate chunks */
+    hbitmap_deserialize_zeroes(data->hb, 2 * CHUNK, CHUNK, false);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 1);
+
+    /* Leave an allocated chunk without any bit set behind */
+    hbitmap_deserialize_ones(data->hb, CHUNK, CHUNK, false);
+    hbitmap_deserialize_ones(data->hb, 2 * CHUNK, CHUNK, false);
+    hbitmap_deserialize_zeroes(data->hb, CHUNK, CHUNK, false);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 3);
+
+    /* hbitmap_deserialize_finish() frees it */
+    hbitmap_deserialize_finish(data->hb);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+
+    bitmap_set(data->bits, 2 * CHUNK, CHUNK);
+    hbitmap_test_check(data, 0);
+}
+
+static void test_hbitmap_chunks_merge_self(TestHBitmapData *data,
+                                           const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, 3 * CHUNK, 0);
+    hbitmap_test_set(data, 10, 10);
+
+    b = hbitmap_alloc(3 * CHUNK, 0);
+    hbitmap_set(b, 15, 10);
+    hbitmap_set(b, 2 * CHUNK, 1);
+
+    /* The result is one of the inputs */
+    g_assert_true(hbitmap_merge(data->hb, b, data->hb));
+    bitmap_set(data->bits, 15, 10);
+    bitmap_set(data->bits, 2 * CHUNK, 1);
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+
+    g_assert_true(hbitmap_merge(b, data->hb, data->hb));
+    hbitmap_test_check(data, 0);
+
+    /* Merging a bitmap with itself changes nothing */
+    g_assert_true(hbitmap_merge(data->hb, data->hb, data->hb));
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+
+    /* The other input is unchanged */
+    g_assert_cmpint(hbitmap_count(b), ==, 11);
+    g_assert_cmpint(hbitmap_allocated_chunks(b), ==, 2);
+
+    hbitmap_free(b);
+}
+
+/* Compare the hash of the bitmap with that of the shadow bitmap */
+static void hbitmap_test_check_sha256(TestHBitmapData *data)
+{
+    g_autofree char *hash = NULL;
+    g_autofree char *expected = NULL;
+
+    hash = hbitmap_sha256(data->hb, &error_abort);
+    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, (const char *)data->bits,
+                        hbitmap_test_array_size(data->size) *
+                        sizeof(unsigned long),
+                        &expected, &error_abort);
+    g_assert_cmpstr(hash, ==, expected);
+}
+
+static void test_hbitmap_chunks_sha256(TestHBitmapData *data,
+                                       const void *unused)
+{
+    /* The last chunk is only partially used */
+    hbitmap_test_init(data, 2 * CHUNK + 1000, 0);
+    hbitmap_test_check_sha256(data);
+
+    /* The chunk in the middle is missing */
+    hbitmap_test_set(data, 5, 100);
+    hbitmap_test_set(data, 2 * CHUNK + 900, 100);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+    hbitmap_test_check_sha256(data);
+
+    /* Only the partial chunk is missing */
+    hbitmap_test_set(data, CHUNK, 1);
+    hbitmap_test_reset(data, 2 * CHUNK, 1000);
+    g_assert_cmpint(hbitmap_allocated_chunks(data->hb), ==, 2);
+    hbitmap_test_check_sha256(data);
+
+    hbitmap_test_reset_all(data);
+    hbitmap_test_check_sha256(data);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1245,13 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/chunks/reset", test_hbitmap_chunks_reset);
+    hbitmap_test_add("/hbitmap/chunks/deserialize",
+                     test_hbitmap_chunks_deserialize);
+    hbitmap_test_add("/hbitmap/chunks/merge_self",
+                     test_hbitmap_chunks_merge_self);
+    hbitmap_test_add("/hbitmap/chunks/sha256", test_hbitmap_chunks_sha256);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,177 @@
+/*
+ * Migration page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "../migration/page_cache.h"
+
+#define TEST_PAGE_SIZE  64
+#define TEST_PAGES      16
+/* TEST_PAGES / 4 ways */
+#define TEST_SETS       4
+
+/* Address of the @n-th page that maps to set @set */
+static uint64_t test_addr(int set, int n)
+{
+    return (uint64_t)(set + n * TEST_SETS) * TEST_PAGE_SIZE;
+}
+
+static void test_insert(PageCache *cache, uint64_t addr, uint64_t age)
+{
+    uint8_t page[TEST_PAGE_SIZE];
+
+    memset(page, addr / TEST_PAGE_SIZE, sizeof(page));
+    g_assert_cmpint(cache_insert(cache, addr, page, age), ==, 0);
+}
+
+/* Check that @addr is cached with the data test_insert() gave it */
+static void test_check_cached(PageCache *cache, uint64_t addr)
+{
+    uint8_t *data = get_cached_data(cache, addr);
+    int i;
+
+    g_assert_nonnull(data);
+    for (i = 0; i < TEST_PAGE_SIZE; i++) {
+        g_assert_cmpint(data[i], ==, (uint8_t)(addr / TEST_PAGE_SIZE));
+    }
+}
+
+static void test_init(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+
+    cache = cache_init(TEST_PAGE_SIZE - 1, TEST_PAGE_SIZE, &err);
+    g_assert_null(cache);
+    error_free_or_abort(&err);
+
+    cache = cache_init(3 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, &err);
+    g_assert_null(cache);
+    error_free_or_abort(&err);
+
+    /* A cache smaller than a set has a single set of all pages */
+    cache = cache_init(2 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, &error_abort);
+    test_insert(cache, 0, 0);
+    test_insert(cache, TEST_PAGE_SIZE, 0);
+    test_check_cached(cache, 0);
+    test_check_cached(cache, TEST_PAGE_SIZE);
+    cache_fini(cache);
+}
+
+/* Pages that map to the same set do not evict each other until it is full */
+static void test_set_conflict(void)
+{
+    PageCache *cache;
+    int i;
+
+    cache = cache_init(TEST_PAGES * TEST_PAGE_SIZE, TEST_PAGE_SIZE,
+                       &error_abort);
+
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        test_insert(cache, test_addr(1, i), 0);
+    }
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        g_assert_true(cache_is_cached(cache, test_addr(1, i), 0));
+        test_check_cached(cache, test_addr(1, i));
+    }
+
+    /* The set is full, and none of its pages is old enough to go */
+    g_assert_cmpint(cache_insert(cache, test_addr(1, i), NULL, 1), ==, -1);
+    g_assert_false(cache_is_cached(cache, test_addr(1, i), 1));
+
+    /* Other sets still have all of their slots */
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        test_insert(cache, test_addr(2, i), 1);
+    }
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        test_check_cached(cache, test_addr(1, i));
+        test_check_cached(cache, test_addr(2, i));
+    }
+
+    cache_fini(cache);
+}
+
+/* A full set replaces its least recently used page once it is old enough */
+static void test_replace(void)
+{
+    PageCache *cache;
+    int i;
+
+    cache = cache_init(TEST_PAGES * TEST_PAGE_SIZE, TEST_PAGE_SIZE,
+                       &error_abort);
+
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        test_insert(cache, test_addr(0, i), i);
+    }
+
+    /* Page 1 is the least recently used one once page 0 gets a hit */
+    g_assert_true(cache_is_cached(cache, test_addr(0, 0), 4));
+    test_insert(cache, test_addr(0, 4), 4);
+
+    g_assert_false(cache_is_cached(cache, test_addr(0, 1), 4));
+    g_assert_null(get_cached_data(cache, test_addr(0, 1)));
+    test_check_cached(cache, test_addr(0, 0));
+    test_check_cached(cache, test_addr(0, 2));
+    test_check_cached(cache, test_addr(0, 3));
+    test_check_cached(cache, test_addr(0, 4));
+
+    /* Page 2 is next, but only CACHED_PAGE_LIFETIME generations after 2 */
+    g_assert_cmpint(cache_insert(cache, test_addr(0, 5), NULL, 3), ==, -1);
+    test_insert(cache, test_addr(0, 5), 5);
+    g_assert_false(cache_is_cached(cache, test_addr(0, 2), 5));
+    test_check_cached(cache, test_addr(0, 5));
+
+    cache_fini(cache);
+}
+
+/* Looking a page up finds it in any slot of its set, and only there */
+static void test_lookup(void)
+{
+    uint8_t page[TEST_PAGE_SIZE];
+    PageCache *cache;
+    int i;
+
+    cache = cache_init(TEST_PAGES * TEST_PAGE_SIZE, TEST_PAGE_SIZE,
+                       &error_abort);
+
+    for (i = 0; i < TEST_PAGES / TEST_SETS; i++) {
+        g_assert_false(cache_is_cached(cache, test_addr(3, i), 0));
+        g_assert_null(get_cached_data(cache, test_addr(3, i)));
+        test_insert(cache, test_addr(3, i), 0);
+    }
+
+    /* Pages of the same set that were never inserted are not found */
+    g_assert_false(cache_is_cached(cache, test_addr(3, i), 0));
+    g_assert_null(get_cached_data(cache, test_addr(3, i)));
+
+    /* Nor are pages of the other sets */
+    for (i = 0; i < TEST_SETS - 1; i++) {
+        g_assert_false(cache_is_cached(cache, test_addr(i, 0), 0));
+    }
+
+    /* Inserting a cached page again updates its data in place */
+    memset(page, 0xa5, sizeof(page));
+    g_assert_cmpint(cache_insert(cache, test_addr(3, 2), page, 0), ==, 0);
+    g_assert_cmpmem(get_cached_data(cache, test_addr(3, 2)), TEST_PAGE_SIZE,
+                    page, sizeof(page));
+    test_check_cached(cache, test_addr(3, 0));
+    test_check_cached(cache, test_addr(3, 1));
+    test_check_cached(cache, test_addr(3, 3));
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/init", test_init);
+    g_test_add_func("/page-cache/set_conflict", test_set_conflict);
+    g_test_add_func("/page-cache/replace", test_replace);
+    g_test_add_func("/page-cache/lookup", test_lookup);
+
+    return g_test_run();
+}
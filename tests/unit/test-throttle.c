@@ -671,6 +671,42 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_credits(void)
+{
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_READ].avg = 10000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* no credits until they are granted */
+    g_assert(!throttle_try_consume_credits(&ts, false, 512));
+
+    throttle_grant_credits(&ts, false, ts.previous_leak);
+
+#ifdef CONFIG_ATOMIC64
+    /* the read bucket has room for 1000 bytes */
+    g_assert(throttle_try_consume_credits(&ts, false, 600));
+    g_assert(!throttle_try_consume_credits(&ts, false, 600));
+    g_assert(throttle_try_consume_credits(&ts, false, 400));
+
+    /* no credits were granted for writes */
+    g_assert(!throttle_try_consume_credits(&ts, true, 1));
+
+    /* the consumed credits are accounted for when reclaimed */
+    throttle_reclaim_credits(&ts, false);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 1000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 2));
+
+    /* a full bucket gets no credits */
+    throttle_grant_credits(&ts, false, ts.previous_leak);
+    g_assert(!throttle_try_consume_credits(&ts, false, 1));
+    throttle_reclaim_credits(&ts, false);
+#endif
+
+    g_assert(!throttle_try_consume_credits(&ts, false, 1));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -764,6 +800,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/credits",            test_credits);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -14,6 +14,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
 #include "qemu/rcu.h"
@@ -298,6 +299,20 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
+static void aio_add_poll_handler(AioContext *ctx, AioHandler *node,
+                                 int revents)
+{
+    if (!QLIST_IS_INSERTED(node, node_deleted) &&
+        !QLIST_IS_INSERTED(node, node_poll) &&
+        node->io_poll) {
+        trace_poll_add(ctx, node, node->pfd.fd, revents);
+        if (ctx->poll_started && node->io_poll_begin) {
+            node->io_poll_begin(node->opaque);
+        }
+        QLIST_INSERT_HEAD(&ctx->poll_aio_handlers, node, node_poll);
+    }
+}
+
 static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
 {
     bool progress = false;
@@ -312,15 +327,7 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
      * fdmon_supports_polling(), but only until the fd fires for the first
      * time.
      */
-    if (!QLIST_IS_INSERTED(node, node_deleted) &&
-        !QLIST_IS_INSERTED(node, node_poll) &&
-        node->io_poll) {
-        trace_poll_add(ctx, node, node->pfd.fd, revents);
-        if (ctx->poll_started && node->io_poll_begin) {
-            node->io_poll_begin(node->opaque);
-        }
-        QLIST_INSERT_HEAD(&ctx->poll_aio_handlers, node, node_poll);
-    }
+    aio_add_poll_handler(ctx, node, revents);
 
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
@@ -525,6 +532,15 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
 {
     int64_t max_ns;
 
+    if (ctx->busy_poll_cnt) {
+        AioHandler *node;
+
+        /* Busy polled event sources never fire, so poll every handler */
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            aio_add_poll_handler(ctx, node, 0);
+        }
+    }
+
     if (QLIST_EMPTY_RCU(&ctx->poll_aio_handlers)) {
         return false;
     }
@@ -543,6 +559,18 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
         return true;
     }
 
+    if (ctx->busy_poll_cnt) {
+        /*
+         * Polling timed out or is disabled, but blocking could wait forever.
+         * Poll once more and let the fdmon look at the other handlers
+         * without blocking.
+         */
+        *timeout = 0;
+        return run_poll_handlers_once(ctx,
+                                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+                                      timeout);
+    }
+
     return false;
 }
 
@@ -728,3 +756,20 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
 
     aio_notify(ctx);
 }
+
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t queue_depth,
+                                     bool sqpoll, bool iopoll, Error **errp)
+{
+    /* Maximum number of entries accepted by io_uring_setup() */
+    const int64_t max_queue_depth = 32768;
+
+    if (queue_depth < 0 || queue_depth > max_queue_depth) {
+        error_setg(errp, "io-uring-queue-depth must be in range [0, %" PRId64
+                   "]", max_queue_depth);
+        return;
+    }
+
+    ctx->io_uring_queue_depth = queue_depth;
+    ctx->io_uring_sqpoll = sqpoll;
+    ctx->io_uring_iopoll = iopoll;
+}
@@ -445,3 +445,8 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp)
 {
 }
+
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t queue_depth,
+                                     bool sqpoll, bool iopoll, Error **errp)
+{
+}
@@ -418,7 +418,9 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->io_uring_queue_depth,
+                                      ctx->io_uring_sqpoll,
+                                      ctx->io_uring_iopoll, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -556,6 +558,11 @@ AioContext *aio_context_new(Error **errp)
 
     ctx->aio_max_batch = 0;
 
+    ctx->io_uring_queue_depth = 0;
+    ctx->io_uring_sqpoll = false;
+    ctx->io_uring_iopoll = false;
+    ctx->busy_poll_cnt = 0;
+
     return ctx;
 fail:
     g_source_destroy(&ctx->source);
@@ -50,6 +50,13 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level is by far the largest one, so it is split into chunks of
+ * HBITMAP_CHUNK_LONGS words that are only allocated once a bit is set in
+ * them, and freed again when all their bits are cleared.  The memory used
+ * by a bitmap thus grows with the number of areas that are dirty rather
+ * than with its size; the other levels are together less than 1/(W-1)
+ * of the size of the last one.
  */
 
 struct HBitmap {
@@ -94,13 +101,100 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * The last level is not in levels[], but in chunks[]: a NULL chunk
+     * has all its bits clear.  Use hb_word() and hb_get_word() to access
+     * the words of any level.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long *levels[HBITMAP_LEVELS - 1];
+    unsigned long **chunks;
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static uint64_t hb_nb_chunks(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1], HBITMAP_CHUNK_LONGS);
+}
+
+/* Return the address of word @pos of @level, or NULL if it is part of a
+ * chunk of the last level that is not allocated, i.e. zero.
+ */
+static inline unsigned long *hb_find_word(const HBitmap *hb, int level,
+                                          uint64_t pos)
+{
+    unsigned long *chunk;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    chunk = hb->chunks[pos >> HBITMAP_CHUNK_SHIFT];
+    return chunk ? &chunk[pos & (HBITMAP_CHUNK_LONGS - 1)] : NULL;
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level,
+                                    uint64_t pos)
+{
+    unsigned long *p = hb_find_word(hb, level, pos);
+
+    return p ? *p : 0;
+}
+
+/* Same as hb_find_word(), but allocate the chunk if needed */
+static inline unsigned long *hb_get_word(HBitmap *hb, int level,
+                                         uint64_t pos)
+{
+    unsigned long **chunk;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+
+    chunk = &hb->chunks[pos >> HBITMAP_CHUNK_SHIFT];
+    if (!*chunk) {
+        *chunk = g_new0(unsigned long, HBITMAP_CHUNK_LONGS);
+    }
+    return &(*chunk)[pos & (HBITMAP_CHUNK_LONGS - 1)];
+}
+
+/* Free the chunks from @first to @last that have no bit set anymore.  The
+ * level above tells it without looking at the chunks themselves.
+ */
+static void hb_free_empty_chunks(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    const int level = HBITMAP_LEVELS - 2;
+    uint64_t c, pos, end;
+
+    for (c = first; c <= last; c++) {
+        if (!hb->chunks[c]) {
+            continue;
+        }
+
+        pos = ((uint64_t)c << HBITMAP_CHUNK_SHIFT) >> BITS_PER_LEVEL;
+        end = MIN(pos + (HBITMAP_CHUNK_LONGS >> BITS_PER_LEVEL),
+                  hb->sizes[level]);
+        while (pos < end && !hb->levels[level][pos]) {
+            pos++;
+        }
+        if (pos == end) {
+            g_free(hb->chunks[c]);
+            hb->chunks[c] = NULL;
+        }
+    }
+}
+
+static void hb_free_chunks(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    uint64_t c;
+
+    for (c = first; c <= last; c++) {
+        g_free(hb->chunks[c]);
+        hb->chunks[c] = NULL;
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -114,7 +208,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     do {
         i--;
         pos >>= BITS_PER_LEVEL;
-        cur = hbi->cur[i] & hb->levels[i][pos];
+        cur = hbi->cur[i] & hb_word(hb, i, pos);
     } while (cur == 0);
 
     /* Check for end of iteration.  We always use fewer than BITS_PER_LONG
@@ -136,7 +230,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +243,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +276,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -219,9 +313,9 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
+    const int last_lev = HBITMAP_LEVELS - 1;
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +326,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, last_lev, pos);
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -247,13 +342,13 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        } while (pos < sz && hb_word(hb, last_lev, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, last_lev, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -406,18 +501,21 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_get_word(hb, level, i), start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_get_word(hb, level, i);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_get_word(hb, level, i), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -464,6 +562,11 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     assert((last >> BITS_PER_LEVEL) == (start >> BITS_PER_LEVEL));
     assert(start <= last);
 
+    /* Part of a chunk that is not allocated, nothing to clear */
+    if (!elem) {
+        return false;
+    }
+
     mask = 2UL << (last & (BITS_PER_LONG - 1));
     mask -= 1UL << (start & (BITS_PER_LONG - 1));
     blanked = *elem != 0 && ((*elem & ~mask) == 0);
@@ -490,25 +593,30 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(hb_find_word(hb, level, i), start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            elem = hb_find_word(hb, level, i);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(hb_find_word(hb, level, i), start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -544,9 +652,12 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        hb_free_empty_chunks(hb, first >> BITS_PER_LEVEL >> HBITMAP_CHUNK_SHIFT,
+                             last >> BITS_PER_LEVEL >> HBITMAP_CHUNK_SHIFT);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
@@ -555,7 +666,8 @@ void hbitmap_reset_all(HBitmap *hb)
     unsigned int i;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    hb_free_chunks(hb, 0, hb_nb_chunks(hb) - 1);
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -588,7 +700,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +717,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,20 +731,19 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first, el_count;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -640,8 +751,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
 void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end, el_count;
 
     if (!count) {
         return;
@@ -650,9 +760,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -663,8 +773,8 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end, el_count;
+    unsigned long el, *elem;
 
     if (!count) {
         return;
@@ -673,12 +783,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
-
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+
+        /* Do not allocate chunks for zeroes, they are freed as a whole */
+        elem = el ? hb_get_word(hb, HBITMAP_LEVELS - 1, cur)
+                  : hb_find_word(hb, HBITMAP_LEVELS - 1, cur);
+        if (elem) {
+            *elem = el;
         }
 
         buf += sizeof(unsigned long);
@@ -692,15 +804,20 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count, i;
+    unsigned long *elem;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        elem = hb_find_word(hb, HBITMAP_LEVELS - 1, i);
+        if (elem) {
+            *elem = 0;
+        }
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -709,15 +826,16 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count, i;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    for (i = first; i < first + el_count; i++) {
+        *hb_get_word(hb, HBITMAP_LEVELS - 1, i) = ~0UL;
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -726,6 +844,7 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
+    uint64_t c, nb_chunks = hb_nb_chunks(bitmap);
     int lev;
 
     /* restore levels starting from penultimate to zero level, assuming
@@ -736,6 +855,27 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
+        if (lev == HBITMAP_LEVELS - 2) {
+            /* Only look at the allocated chunks of the last level */
+            for (c = 0; c < nb_chunks; c++) {
+                int64_t end;
+
+                if (!bitmap->chunks[c]) {
+                    continue;
+                }
+                i = c << HBITMAP_CHUNK_SHIFT;
+                end = MIN(i + HBITMAP_CHUNK_LONGS, prev_size);
+                for (; i < end; ++i) {
+                    if (hb_word(bitmap, lev + 1, i)) {
+                        bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                            1UL << (i & (BITS_PER_LONG - 1));
+                    }
+                }
+            }
+            hb_free_empty_chunks(bitmap, 0, nb_chunks - 1);
+            continue;
+        }
+
         for (i = 0; i < prev_size; ++i) {
             if (bitmap->levels[lev + 1][i]) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
@@ -752,7 +892,9 @@ void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    hb_free_chunks(hb, 0, hb_nb_chunks(hb) - 1);
+    g_free(hb->chunks);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -775,7 +917,11 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb->chunks = g_new0(unsigned long *, hb_nb_chunks(hb));
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -828,6 +974,23 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
             break;
         }
         old = hb->sizes[i];
+        if (i == HBITMAP_LEVELS - 1) {
+            /* Chunks are allocated whole, with the bits past the end clear */
+            uint64_t old_chunks = hb_nb_chunks(hb);
+            uint64_t new_chunks;
+
+            hb->sizes[i] = size;
+            new_chunks = hb_nb_chunks(hb);
+            if (shrink && new_chunks < old_chunks) {
+                hb_free_chunks(hb, new_chunks, old_chunks - 1);
+            }
+            hb->chunks = g_renew(unsigned long *, hb->chunks, new_chunks);
+            if (!shrink && new_chunks > old_chunks) {
+                memset(&hb->chunks[old_chunks], 0,
+                       (new_chunks - old_chunks) * sizeof(*hb->chunks));
+            }
+            continue;
+        }
         hb->sizes[i] = size;
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
@@ -875,7 +1038,7 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t c, j;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -905,12 +1068,27 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* The last level is merged chunk by chunk, skipping those that are
+     * clear in both bitmaps.  The other levels are merged as a whole, which
+     * is O(size / BITS_PER_LONG) as HBITMAP_LEVELS is constant.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (c = 0; c < hb_nb_chunks(a); c++) {
+        unsigned long *ca = a->chunks[c], *cb = b->chunks[c], *cr;
+
+        if (!ca && !cb) {
+            hb_free_chunks(result, c, c);
+            continue;
+        }
+        if (!result->chunks[c]) {
+            result->chunks[c] = g_new0(unsigned long, HBITMAP_CHUNK_LONGS);
+        }
+        cr = result->chunks[c];
+        for (j = 0; j < HBITMAP_CHUNK_LONGS; j++) {
+            cr[j] = (ca ? ca[j] : 0) | (cb ? cb[j] : 0);
+        }
+    }
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
@@ -922,12 +1100,31 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     return true;
 }
 
+uint64_t hbitmap_allocated_chunks(const HBitmap *hb)
+{
+    uint64_t c, n = 0;
+
+    for (c = 0; c < hb_nb_chunks(hb); c++) {
+        n += !!hb->chunks[c];
+    }
+    return n;
+}
+
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
+    static const unsigned long zero_chunk[HBITMAP_CHUNK_LONGS];
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t c, nb_chunks = hb_nb_chunks(bitmap);
+    g_autofree struct iovec *iov = g_new(struct iovec, nb_chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    /* Hash the last level as if it was a single array */
+    for (c = 0; c < nb_chunks; c++) {
+        iov[c].iov_base = bitmap->chunks[c] ?: (void *)zero_chunk;
+        iov[c].iov_len = MIN(size, sizeof(zero_chunk));
+        size -= iov[c].iov_len;
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, nb_chunks, &hash, errp);
 
     return hash;
 }
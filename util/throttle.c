@@ -87,6 +87,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute how many units a leaky bucket can hold before I/O must wait
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +125,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -386,6 +398,11 @@ void throttle_config(ThrottleState *ts,
 {
     int i;
 
+    /* The credits were computed for the previous configuration */
+    for (i = 0; i < 2; i++) {
+        throttle_reclaim_credits(ts, i);
+    }
+
     ts->cfg = *cfg;
 
     /* Zero bucket level */
@@ -444,29 +461,26 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
-/* do the accounting for this operation
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+/* fill the buckets of the given type of operation
  *
  * @is_write: the type of operation (read/write)
- * @size:     the size of the operation
+ * @size:     the number of bytes
+ * @units:    the number of operations
  */
-void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+static void throttle_do_account(ThrottleState *ts, bool is_write,
+                                uint64_t size, double units)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;
 
@@ -484,6 +498,172 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* do the accounting for this operation
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = 1.0;
+
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double) size / ts->cfg.op_size;
+    }
+
+    throttle_do_account(ts, is_write, size, units);
+}
+
+/* Credits pack a number of operations in their upper 32 bits and a number
+ * of bytes in their lower 32 bits, so that both can be consumed with a
+ * single atomic operation.
+ */
+#define THROTTLE_CREDITS_MAX UINT32_MAX
+
+static uint64_t throttle_credits_pack(uint64_t ops, uint64_t bytes)
+{
+    if (!ops || !bytes) {
+        return 0;
+    }
+    return (MIN(ops, THROTTLE_CREDITS_MAX) << 32) |
+           MIN(bytes, THROTTLE_CREDITS_MAX);
+}
+
+/* Units that can still go into a leaky bucket without any I/O having to
+ * wait, or THROTTLE_CREDITS_MAX if the bucket has no limit.
+ *
+ * @bkt:    the leaky bucket we operate on
+ * @shared: whether the bucket is also used by the other type of operation
+ */
+static uint64_t throttle_bucket_room(LeakyBucket *bkt, bool shared)
+{
+    double bucket_size, burst_bucket_size, room;
+
+    if (!bkt->avg) {
+        return THROTTLE_CREDITS_MAX;
+    }
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+    room = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        room = MIN(room, burst_bucket_size - bkt->burst_level);
+    }
+
+    /* reads and writes get half of the room of the total buckets each */
+    if (shared) {
+        room /= 2;
+    }
+
+    return room > 0 ? room : 0;
+}
+
+/* Hand out credits for operations of one type, that
+ * throttle_try_consume_credits() can use without taking the lock that
+ * protects the ThrottleState.  The credits are the room left in the
+ * buckets, so operations that consume them would not have had to wait
+ * anyway; they only skip the lock while the limits are far from reached.
+ *
+ * The caller must hold the lock, and the credits must have been reclaimed
+ * since they were last granted.
+ *
+ * @is_write: the type of operation (read/write)
+ * @now:      the current timestamp in ns
+ */
+void throttle_grant_credits(ThrottleState *ts, bool is_write, int64_t now)
+{
+#ifdef CONFIG_ATOMIC64
+    uint64_t bytes = THROTTLE_CREDITS_MAX, ops = THROTTLE_CREDITS_MAX;
+    uint64_t credits;
+    unsigned i;
+
+    assert(!ts->granted_credits[is_write]);
+
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        bytes = MIN(bytes, throttle_bucket_room(bkt, i == 0));
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        ops = MIN(ops, throttle_bucket_room(bkt, i == 0));
+    }
+
+    credits = throttle_credits_pack(ops, bytes);
+    ts->granted_credits[is_write] = credits;
+    qatomic_set(&ts->credit_op_size, ts->cfg.op_size);
+    qatomic_store_release(&ts->credits[is_write], credits);
+#endif
+}
+
+/* Take back the credits of one type of operation, and do the accounting
+ * for the operations that consumed them.
+ *
+ * The caller must hold the lock that protects the ThrottleState.
+ *
+ * @is_write: the type of operation (read/write)
+ */
+void throttle_reclaim_credits(ThrottleState *ts, bool is_write)
+{
+#ifdef CONFIG_ATOMIC64
+    uint64_t granted = ts->granted_credits[is_write];
+    uint64_t left;
+
+    if (!granted) {
+        return;
+    }
+
+    left = qatomic_xchg(&ts->credits[is_write], 0);
+    ts->granted_credits[is_write] = 0;
+
+    throttle_do_account(ts, is_write,
+                        (uint32_t)granted - (uint32_t)left,
+                        (granted >> 32) - (left >> 32));
+#endif
+}
+
+/* Try to do the accounting for an operation with the credits handed out
+ * by throttle_grant_credits().  This can be called without any lock.
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ * @ret:      true if the operation can be done right away, false if the
+ *            caller must go through the usual accounting
+ */
+bool throttle_try_consume_credits(ThrottleState *ts, bool is_write,
+                                  uint64_t size)
+{
+#ifdef CONFIG_ATOMIC64
+    uint64_t credits, old, op_size, ops = 1;
+
+    credits = qatomic_load_acquire(&ts->credits[is_write]);
+    if (!credits) {
+        return false;
+    }
+
+    /* Round up, the exact unit count is not known when reclaiming */
+    op_size = qatomic_read(&ts->credit_op_size);
+    if (op_size && size > op_size) {
+        ops = DIV_ROUND_UP(size, op_size);
+    }
+
+    do {
+        old = credits;
+        if ((old >> 32) < ops || (uint32_t)old < size) {
+            return false;
+        }
+        credits = qatomic_cmpxchg(&ts->credits[is_write], old,
+                                  old - (ops << 32) - size);
+    } while (credits != old);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
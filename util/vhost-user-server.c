@@ -51,6 +51,13 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * Virtqueues can be assigned AioContexts of their own, their kick fds are then
+ * monitored there and their requests run there.  libvhost-user state that is
+ * shared between virtqueues is only changed by vu_dispatch(), so before a
+ * message is dispatched the kick fds in other AioContexts are unmonitored and
+ * the in-flight requests (see vhost_user_server_inc_in_flight()) drained.
+ * Monitoring resumes when vu_client_trip() is back to reading messages.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -74,6 +81,119 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
     error_report("vu_panic: %s", buf);
 }
 
+void vhost_user_server_inc_in_flight(VuServer *server)
+{
+    qatomic_inc(&server->in_flight);
+}
+
+/* May be called from any of the AioContexts of @server */
+void vhost_user_server_dec_in_flight(VuServer *server)
+{
+    if (qatomic_fetch_dec(&server->in_flight) == 1) {
+        Coroutine *co = qatomic_xchg(&server->wait_idle_co, NULL);
+
+        if (co) {
+            aio_co_wake(co);
+        }
+    }
+}
+
+/* Wait in server->ctx until no request is in flight */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    while (qatomic_read(&server->in_flight)) {
+        qatomic_set(&server->wait_idle_co, qemu_coroutine_self());
+        /* Pairs with the atomic ops in vhost_user_server_dec_in_flight() */
+        smp_mb();
+        if (!qatomic_read(&server->in_flight) &&
+            qatomic_xchg(&server->wait_idle_co, NULL)) {
+            /* Nobody is going to wake us up */
+            break;
+        }
+        qemu_coroutine_yield();
+    }
+}
+
+static void kick_handler(void *opaque);
+
+static void vu_fd_watch_attach(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    if (!vu_fd_watch->queue_ctx) {
+        aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true, kick_handler,
+                           NULL, NULL, vu_fd_watch);
+    } else if (!server->queues_paused) {
+        aio_set_fd_handler(vu_fd_watch->queue_ctx, vu_fd_watch->fd, true,
+                           kick_handler, NULL, NULL, vu_fd_watch);
+    }
+}
+
+static void vu_fd_watch_detach(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    aio_set_fd_handler(vu_fd_watch->queue_ctx ?: server->ctx,
+                       vu_fd_watch->fd, true, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Stop processing the virtqueues that have an AioContext of their own and
+ * wait for their requests, so that vu_dispatch() and vu_deinit() do not race
+ * with them.
+ */
+static void coroutine_fn vu_pause_queues(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+    AioContext *last_ctx = NULL;
+    int i;
+
+    if (!server->queue_ctx || server->queues_paused) {
+        return;
+    }
+
+    qatomic_set(&server->queues_paused, true);
+    /* Pairs with kick_handler() */
+    smp_mb();
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->queue_ctx) {
+            vu_fd_watch_detach(server, vu_fd_watch);
+        }
+    }
+
+    /*
+     * A kick_handler() that was dispatched before its fd handler was
+     * removed may not have counted itself as in flight yet.  It is done
+     * once this coroutine got to run in its AioContext.  We can't block
+     * in aio_wait_bh_oneshot() here, so visit each AioContext instead.
+     */
+    for (i = 0; i < server->max_queues; i++) {
+        AioContext *ctx = server->queue_ctx[i];
+
+        if (ctx && ctx != last_ctx) {
+            aio_co_reschedule_self(ctx);
+            last_ctx = ctx;
+        }
+    }
+    aio_co_reschedule_self(server->ctx);
+
+    vu_wait_idle(server);
+}
+
+static void vu_resume_queues(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!server->queues_paused) {
+        return;
+    }
+
+    qatomic_set(&server->queues_paused, false);
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->queue_ctx) {
+            vu_fd_watch_attach(server, vu_fd_watch);
+        }
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -94,6 +214,10 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
     }
 
     assert(qemu_in_coroutine());
+
+    /* The previous message has been dispatched */
+    vu_resume_queues(server);
+
     do {
         size_t nfds = 0;
         int *fds = NULL;
@@ -160,6 +284,7 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    vu_pause_queues(server);
     return true;
 
 fail:
@@ -177,7 +302,9 @@ static coroutine_fn void vu_client_trip(void *opaque)
         /* Keep running */
     }
 
+    vu_pause_queues(server);
     vu_deinit(vu_dev);
+    server->queues_paused = false;
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -206,15 +333,27 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+
+    /*
+     * The kick may be handled in the AioContext of its virtqueue while
+     * vu_pause_queues() unmonitors it, in which case the kick is left for
+     * vu_resume_queues().
+     */
+    vhost_user_server_inc_in_flight(server);
+    if (vu_fd_watch->queue_ctx && qatomic_read(&server->queues_paused)) {
+        goto out;
+    }
 
     vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+out:
+    vhost_user_server_dec_in_flight(server);
 }
 
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
@@ -249,10 +388,20 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
         qemu_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+
+        /*
+         * libvhost-user only watches kick fds, and passes the index of the
+         * virtqueue as pvt
+         */
+        if (server->queue_ctx) {
+            int index = (intptr_t)pvt;
+
+            g_assert(index >= 0 && index < vu_dev->max_queues);
+            vu_fd_watch->queue_ctx = server->queue_ctx[index];
+        }
+        vu_fd_watch_attach(server, vu_fd_watch);
     }
 }
 
@@ -270,7 +419,7 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true, NULL, NULL, NULL, NULL);
+    vu_fd_watch_detach(server, vu_fd_watch);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -333,8 +482,7 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
-                               NULL, NULL, NULL, vu_fd_watch);
+            vu_fd_watch_detach(server, vu_fd_watch);
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -375,9 +523,11 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 
     qio_channel_attach_aio_context(server->ioc, ctx);
 
+    /* Virtqueues with an AioContext of their own are not moved */
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
-                           NULL, vu_fd_watch);
+        if (!vu_fd_watch->queue_ctx) {
+            vu_fd_watch_attach(server, vu_fd_watch);
+        }
     }
 
     aio_co_schedule(ctx, server->co_trip);
@@ -390,8 +540,9 @@ void vhost_user_server_detach_aio_context(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
-                               NULL, NULL, NULL, vu_fd_watch);
+            if (!vu_fd_watch->queue_ctx) {
+                vu_fd_watch_detach(server, vu_fd_watch);
+            }
         }
 
         qio_channel_detach_aio_context(server->ioc);
@@ -404,6 +555,7 @@ bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
@@ -432,6 +584,7 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .queue_ctx             = queue_ctx,
     };
 
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");